@@ -33,7 +33,12 @@
 // #define VERBOSE
 #include "qemu/osdep.h" // Required to be the first #include
 #include "qapi/error.h"
+#include "qapi/visitor.h"
 #include <pthread.h>    // Required for Windows (MSYS2)
+#include <glib/gstdio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #ifdef QEMU_V9_2_0
 #include "hw/pci/pci_device.h"
 #else
@@ -56,7 +61,14 @@
 #include "include/svga_types.h"
 #include "include/vmware_pack_begin.h"
 #include "include/vmware_pack_end.h"
+#include "migration/blocker.h"
 #include "migration/vmstate.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/processor.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "sysemu/runstate.h"
 #include "vga_int.h"
 #include "include/VGPU10ShaderTokens.h" // Required to be the last #include
 #define SVGA_CAP_ALPHA_BLEND 0x00002000
@@ -92,7 +104,7 @@
 #define SVGA_CMD_SURFACE_COPY 27
 #define SVGA_CMD_SURFACE_FILL 26
 #define SVGA_PALETTE_SIZE 769
-#define SVGA_PIXMAP_SIZE(w, h, bpp) (((((w) * (bpp))) >> 5) * (h))
+#define SVGA_PIXMAP_SIZE(w, h, bpp) (((((w) * (bpp)) + 31) >> 5) * (h))
 #define SVGA_REG_CURSOR_MAX_BYTE_SIZE 66
 #define SVGA_REG_CURSOR_MAX_DIMENSION 67
 #define SVGA_REG_CURSOR_MOBID 65
@@ -104,6 +116,66 @@
 #define SVGA_REG_PALETTE_MAX (SVGA_REG_PALETTE_MIN + SVGA_PALETTE_SIZE)
 #define SVGA_REG_PALETTE_MIN 1024
 #define SVGA_REG_SCREENDMA 75
+#define VMSVGA_CURSOR_CACHE_SIZE 8
+#define VMSVGA_CURSOR_MAX_DIMENSION 2048
+#define VMSVGA_CURSOR_POLL_MS 4
+#define VMSVGA_CURSOR_IDLE_MS 32
+#define VMSVGA_FIFO_SIZE_MIN 262144
+#define VMSVGA_FIFO_SIZE_MAX 33554432
+#define VMSVGA_COPY_QUEUE_SIZE 32
+#define VMSVGA_SPIN_MIN_NS 2000
+#define VMSVGA_SPIN_MAX_NS 50000
+#define VMSVGA_LOOP_ACTIVE_US 1000
+#define VMSVGA_FIFO_BATCH 256
+#define VMSVGA_REFRESH_STALL_MS 5000
+#define VMSVGA_MAX_WIDTH 8192
+#define VMSVGA_MAX_HEIGHT 8192
+#define VMSVGA_MAX_SCREENS 8
+#define VMSVGA_SCREEN_MAX_DIMENSION 8192
+#define VMSVGA_GMR_MAX_IDS 64
+#define VMSVGA_GMR_MAX_PAGES 196608
+#define VMSVGA_GMR_MAX_DESCRIPTORS 4096
+#define VMSVGA_GMR_PAGE_SHIFT 12
+#define VMSVGA_SCREEN_OBJECT_MAX_SIZE 4096
+#define VMSVGA_SURFACE_BUDGET_MB 256
+#define VMSVGA_CPU_DRAW_BUDGET (1 << 24)
+#define VMSVGA_SURFACE_MAX_DIMENSION 16384
+#define VMSVGA_SURFACE_MAX_MIPS 15
+#define VMSVGA_ARENA_MIN_SHIFT 12
+#define VMSVGA_ARENA_CLASSES 13
+#define VMSVGA_ARENA_DEPTH 4
+#define VMSVGA_DIRTY_RENDERSTATE (1 << 0)
+#define VMSVGA_DIRTY_TEXTURESTATE (1 << 1)
+#define VMSVGA_DIRTY_TRANSFORM (1 << 2)
+#define VMSVGA_DIRTY_MATERIAL (1 << 3)
+#define VMSVGA_DIRTY_LIGHT (1 << 4)
+#define VMSVGA_DIRTY_VIEWPORT (1 << 5)
+#define VMSVGA_DIRTY_ZRANGE (1 << 6)
+#define VMSVGA_DIRTY_SCISSOR (1 << 7)
+#define VMSVGA_DIRTY_CLIPPLANE (1 << 8)
+#define VMSVGA_DIRTY_RENDERTARGET (1 << 9)
+#define VMSVGA_DIRTY_SHADER (1 << 10)
+#define VMSVGA_DIRTY_ALL 0x7ff
+#define VMSVGA_SHADER_CACHE_MAX 1024
+#define VMSVGA_SHADER_CACHE_BYTES (64 * 1024 * 1024)
+#define VMSVGA_SHADER_DISK_MB 256
+#define VMSVGA_SHADER_IO_MAX 256
+#define VMSVGA_SHADER_DX 0x100
+#define VMSVGA_SHADER_VERSION 2
+#define VMSVGA_SHADER_MAGIC 0x56534853
+#define VMSVGA_DX_SHADER_MAX (1 << 20)
+#define VMSVGA_MOB_MAX 65536
+#define VMSVGA_CAPTURE_MAGIC "VMSVGACP"
+#define VMSVGA_CAPTURE_VERSION 2
+#define VMSVGA_CAPTURE_BLOCK 4096
+#define VMSVGA_CAPTURE_CHUNK 262144
+#define VMSVGA_CAPTURE_SRC_REG 0
+#define VMSVGA_CAPTURE_SRC_SYNC 1
+#define VMSVGA_CAPTURE_SRC_REFRESH 2
+#define VMSVGA_CAPTURE_KIND_REG 0
+#define VMSVGA_CAPTURE_KIND_FIFO 1
+#define VMSVGA_CAPTURE_KIND_VRAM 2
+#define VMSVGA_CAPTURE_KIND_GMR 3
 #ifdef VERBOSE
 #define VPRINT(fmt, ...)                                                       \
   printf("vmsvga (%s): %u - %s: " fmt, __FILE__, (uint32_t)time(NULL),         \
@@ -111,20 +183,217 @@
 #else
 #define VPRINT(...)
 #endif
+struct vmsvga_cursor_cache_s {
+  QEMUCursor *qc;
+  uint64_t hash;
+  uint32_t id;
+  uint32_t width;
+  uint32_t height;
+  uint32_t hot_x;
+  uint32_t hot_y;
+  uint32_t kind;
+};
+// Capture files are little-endian and every record starts 8-byte aligned
+// so a reader can mmap the log and walk it without copying. REG records
+// hold {index, value}, FIFO records the command words as consumed, VRAM
+// records {offset, size} and the bytes changed since the previous VRAM
+// record, starting from zeroed VRAM, GMR records {id, num_pages,
+// first_page, count} and count pages
+struct vmsvga_capture_header_s {
+  char magic[8];
+  uint32_t version;
+  uint32_t vram_size;
+  uint32_t fifo_size;
+  uint32_t reserved;
+};
+struct vmsvga_capture_record_s {
+  uint64_t timestamp;
+  uint16_t source;
+  uint16_t kind;
+  uint32_t length;
+};
+struct vmsvga_copy_s {
+  uint32_t src_x;
+  uint32_t src_y;
+  uint32_t dst_x;
+  uint32_t dst_y;
+  uint32_t w;
+  uint32_t h;
+};
+// Guest memory regions, a flat list of guest physical page numbers
+struct vmsvga_gmr_s {
+  uint32_t num_pages;
+  uint64_t *pages;
+};
+// Screen objects always scan out of the GFB, offset and pitch locate the
+// backing store inside VRAM
+struct vmsvga_screen_s {
+  uint32_t defined;
+  uint32_t flags;
+  uint32_t width;
+  uint32_t height;
+  int32_t root_x;
+  int32_t root_y;
+  uint32_t offset;
+  uint32_t pitch;
+};
+// Screens other than #0 get a console of their own
+struct vmsvga_head_s {
+  struct vmsvga_state_s *s;
+  QemuConsole *con;
+  struct vmsvga_screen_s screen;
+  uint32_t gen;
+  uint32_t surface_gen;
+};
+// Host copy of a 3D surface, faces and mips are packed the way
+// svga3dsurface_get_image_offset lays them out
+struct vmsvga_surface_s {
+  struct vmsvga_state_s *s;
+  uint32_t sid;
+  uint32_t flags;
+  uint32_t format;
+  uint32_t faces;
+  uint32_t mips;
+  uint32_t multisample;
+  SVGA3dSize size;
+  uint32_t bytes;
+  uint8_t *data;
+};
+// Translated D3D9 shader, shared by every context that defines the same
+// tokens. Entries nobody references stay cached until the table fills up.
+// No render backend consumes the GLSL yet, the translation is kept for the
+// shader cache and offline checks only
+struct vmsvga_shader_s {
+  struct vmsvga_state_s *s;
+  uint64_t hash;
+  uint64_t bytes;
+  uint32_t type;
+  uint32_t words;
+  uint32_t *tokens;
+  char *glsl;
+  uint32_t refs;
+  bool disk_pending;
+};
+struct vmsvga_mob_s {
+  uint32_t format;
+  uint32_t size;
+  uint64_t base;
+};
+struct vmsvga_dx_shader_s {
+  uint32_t type;
+  uint32_t size;
+  struct vmsvga_shader_s *sh;
+};
+// Legacy SVGA3D context state as last set by the guest. Sets that change
+// nothing are dropped, the rest mark their group in dirty (and the entry
+// in the per-group masks) until the backend is flushed at the next draw
+struct vmsvga_context_s {
+  uint32_t cid;
+  SVGA3dSurfaceImageId rt[SVGA3D_RT_MAX];
+  uint32_t rs[SVGA3D_RS_MAX];
+  uint32_t ts[SVGA3D_NUM_TEXTURE_UNITS][SVGA3D_TS_MAX];
+  float transform[SVGA3D_TRANSFORM_MAX][16];
+  SVGA3dMaterial material[SVGA3D_FACE_MAX];
+  SVGA3dLightData light[SVGA3D_NUM_LIGHTS];
+  uint32_t light_enabled[SVGA3D_NUM_LIGHTS];
+  float clip_plane[SVGA3D_NUM_CLIPPLANES][4];
+  SVGA3dRect viewport;
+  SVGA3dRect scissor;
+  SVGA3dZRange zrange;
+  uint32_t dirty;
+  uint64_t rs_dirty[DIV_ROUND_UP(SVGA3D_RS_MAX, 64)];
+  uint32_t ts_dirty;
+  uint32_t transform_dirty;
+  uint32_t light_dirty;
+  uint32_t clip_dirty;
+  GHashTable *shaders;
+  struct vmsvga_shader_s *shader[SVGA3D_NUM_SHADERTYPE_PREDX];
+  void *backend;
+};
+// A render backend executes context commands on the FIFO thread, the
+// context and flush hooks are optional
+struct vmsvga_render_ops_s {
+  const char *name;
+  void (*flush)(struct vmsvga_state_s *s, struct vmsvga_context_s *ctx);
+  void (*context_define)(struct vmsvga_state_s *s,
+                         struct vmsvga_context_s *ctx);
+  void (*context_destroy)(struct vmsvga_state_s *s,
+                          struct vmsvga_context_s *ctx);
+  void (*clear)(struct vmsvga_state_s *s, struct vmsvga_context_s *ctx,
+                const SVGA3dCmdClear *clear, const SVGA3dRect *rects,
+                uint32_t count);
+  void (*draw)(struct vmsvga_state_s *s, struct vmsvga_context_s *ctx,
+               const SVGA3dVertexDecl *decls, uint32_t num_decls,
+               const SVGA3dPrimitiveRange *ranges, uint32_t num_ranges);
+  void (*present)(struct vmsvga_state_s *s, struct vmsvga_surface_s *surf,
+                  const SVGA3dCopyRect *rects, uint32_t count);
+};
+// Fields are grouped by the thread that writes them, each group starts on
+// its own cache line so FIFO processing, vCPU register traffic and the
+// refresh path do not bounce lines between each other
 struct vmsvga_state_s {
-  uint32_t svgapalettebase[SVGA_PALETTE_SIZE];
+  // FIFO consumer, written by whoever runs vmsvga_fifo_run
+  uint32_t *fifo QEMU_ALIGNED(64);
+  uint32_t fifo_min;
+  uint32_t fifo_max;
+  uint32_t fifo_next;
+  uint32_t fifo_stop;
+  uint32_t fifo_size;
+  uint32_t sync;
+  uint32_t irq_mask;
+  uint32_t irq_status;
+  uint32_t capture_source;
+  uint64_t capture_gmr;
+  uint32_t sync_done;
+  bool fifo_paused;
+  int64_t fifo_spin_ns;
+  uint32_t fifo_seen_next;
+  struct vmsvga_screen_s screen[VMSVGA_MAX_SCREENS];
+  uint32_t gmrfb_gmr;
+  uint32_t gmrfb_offset;
+  uint32_t gmrfb_pitch;
+  uint32_t gmrfb_bpp;
+  GHashTable *surfaces;
+  uint64_t surface_bytes;
+  uint8_t *arena_free[VMSVGA_ARENA_CLASSES];
+  uint32_t arena_count[VMSVGA_ARENA_CLASSES];
+  const struct vmsvga_render_ops_s *render;
+  struct vmsvga_context_s *context[SVGA3D_MAX_CONTEXT_IDS];
+  uint32_t context_count;
+  bool objects_live;
+  uint64_t state_sets;
+  uint64_t state_dropped;
+  uint64_t state_flushes;
+  uint64_t draws_truncated;
+  GHashTable *shader_cache;
+  uint64_t shader_cache_bytes;
+  uint64_t shader_hits;
+  uint64_t shader_misses;
+  uint64_t shader_failures;
+  uint64_t shader_translate_ns;
+  uint64_t shader_disk_hits;
+  uint64_t shader_disk_writes;
+  uint64_t shader_disk_evictions;
+  uint64_t shader_disk_bytes;
+  GHashTable *mobs;
+  GHashTable *dx_shaders;
+  struct vmsvga_shader_s *dx_shader[SVGA3D_NUM_SHADERTYPE];
+  // register file, written by the vCPU thread through the I/O BAR
+  uint32_t index QEMU_ALIGNED(64);
   uint32_t enable;
   uint32_t config;
-  uint32_t index;
-  uint32_t scratch_size;
   uint32_t new_width;
   uint32_t new_height;
   uint32_t new_depth;
-  uint32_t num_gd;
-  uint32_t disp_prim;
+  uint32_t pitchlock;
+  uint32_t mode_staged;
+  uint32_t sync_req;
+  uint32_t cursor;
+  uint32_t display_id;
   uint32_t disp_x;
   uint32_t disp_y;
-  uint32_t devcap_val;
+  uint32_t num_gd;
+  uint32_t disp_prim;
   uint32_t gmrdesc;
   uint32_t gmrid;
   uint32_t gmrpage;
@@ -133,23 +402,93 @@ struct vmsvga_state_s {
   uint32_t cmd_high;
   uint32_t guest;
   uint32_t svgaid;
-  uint32_t thread;
-  uint32_t sync;
   uint32_t bios;
-  uint32_t fifo_size;
-  uint32_t fifo_min;
-  uint32_t fifo_max;
-  uint32_t fifo_next;
-  uint32_t fifo_stop;
-  uint32_t irq_mask;
-  uint32_t irq_status;
-  uint32_t display_id;
-  uint32_t pitchlock;
-  uint32_t cursor;
+  uint32_t devcap_val;
+  uint32_t scratch_size;
+  uint32_t *scratch;
+  // scanout, written by the refresh path, vmsvga_loop and the cursor timer
+  uint32_t mode_width QEMU_ALIGNED(64);
+  uint32_t mode_height;
+  uint32_t mode_depth;
+  uint32_t mode_stride;
+  uint32_t mode_offset;
+  uint32_t mode_screen;
+  uint32_t mode_gen;
+  uint32_t mode_seen;
+  uint32_t mode_polled;
+  uint32_t surface_gen;
+  uint32_t fifo_pitchlock;
+  uint32_t shadow_active;
+  uint32_t shadow_dirty;
+  uint32_t palette_dirty;
+  uint32_t cursor_count;
+  uint32_t cursor_x;
+  uint32_t cursor_y;
+  uint32_t cursor_on;
+  uint32_t cursor_poll_ms;
+  uint32_t cursor_pending;
+  uint32_t refresh_stalled;
+  int64_t refresh_last;
+  QEMUCursor *cursor_shown;
+  struct vmsvga_cursor_cache_s cursor_cache[VMSVGA_CURSOR_CACHE_SIZE];
+  uint32_t palette_lut[256];
+  struct vmsvga_head_s head[VMSVGA_MAX_SCREENS];
+  // cold configuration, migration staging and backing state
+  uint32_t svgapalettebase[SVGA_PALETTE_SIZE] QEMU_ALIGNED(64);
+  uint32_t thread;
   uint32_t fc;
   uint32_t ff;
-  uint32_t *fifo;
-  uint32_t *scratch;
+  bool shadow;
+  bool rect_copy;
+  bool cursor_premultiplied;
+  bool screen_object;
+  uint32_t num_screens;
+  uint32_t surface_budget_mb;
+  char *render_backend;
+  char *shader_cache_dir;
+  uint32_t shader_cache_size_mb;
+  char *capture_path;
+  FILE *capture_file;
+  QemuMutex capture_lock;
+  int64_t capture_start;
+  bool capture_failed;
+  uint8_t *capture_vram;
+  QEMUTimer *cursor_timer;
+  uint32_t cursor_mig_width;
+  uint32_t cursor_mig_height;
+  uint32_t cursor_mig_hot_x;
+  uint32_t cursor_mig_hot_y;
+  uint32_t cursor_mig_size;
+  uint8_t *cursor_mig_data;
+  bool mode_loaded;
+  uint32_t gmr_mig_size;
+  uint8_t *gmr_mig_data;
+  struct vmsvga_gmr_s gmr[VMSVGA_GMR_MAX_IDS];
+  // FIFO worker handoff, console and IRQ work queued for the main loop
+  QemuEvent fifo_event;
+  QemuMutex fifo_lock;
+  QemuMutex bh_lock;
+  QEMUBH *fifo_bh;
+  uint64_t gmr_pending;
+  struct vmsvga_gmr_s gmr_next[VMSVGA_GMR_MAX_IDS];
+  uint32_t irq_pending;
+  uint32_t activity;
+  QEMUCursor *cursor_next;
+  uint32_t copy_count;
+  bool copy_overflow;
+  struct vmsvga_copy_s copy_queue[VMSVGA_COPY_QUEUE_SIZE];
+  uint32_t screen_pending;
+  struct vmsvga_screen_s screen_next[VMSVGA_MAX_SCREENS];
+  bool screen_reset_pending;
+  bool blocker_pending;
+  bool blocker_want;
+  Error *migration_blocker;
+  // shader cache disk I/O, lookups come back through shader_io_done
+  QemuEvent shader_io_event;
+  QemuMutex shader_io_lock;
+  GQueue shader_io_todo;
+  GQueue shader_io_done;
+  uint32_t shader_io_ready;
   VGACommonState vga;
   VGACommonState vcs;
   MemoryRegion fifo_ram;
@@ -160,15 +499,104 @@ struct pci_vmsvga_state_s {
   struct vmsvga_state_s chip;
   MemoryRegion io_bar;
 };
+// Bumped on anything the display cares about, vmsvga_loop waits for the
+// next FIFO kick while it stays put
+static inline void vmsvga_activity(struct vmsvga_state_s *s) {
+  qatomic_inc(&s->activity);
+};
+// Pushed damage and cursor moves are dropped while the console has no
+// listener. A registered VNC server without clients still counts as one
+// but stops calling gfx_update, and an idle listener refreshes at least
+// every few seconds, so a refresh stall this long is treated the same
+static bool vmsvga_scanout_watched(struct vmsvga_state_s *s) {
+  if (s->refresh_stalled < 1 &&
+      (!qemu_console_is_visible(s->vga.con) ||
+       qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - s->refresh_last >
+           VMSVGA_REFRESH_STALL_MS)) {
+    VPRINT("vmsvga_scanout_watched: no listener or refresh, stalling\n");
+    s->refresh_stalled = 1;
+  };
+  return s->refresh_stalled < 1;
+};
 static void cursor_update_from_fifo(struct vmsvga_state_s *s) {
   VPRINT("cursor_update_from_fifo was just executed\n");
+  uint32_t x = s->fifo[SVGA_FIFO_CURSOR_X];
+  uint32_t y = s->fifo[SVGA_FIFO_CURSOR_Y];
+  uint32_t on;
   if ((s->fifo[SVGA_FIFO_CURSOR_ON] == SVGA_CURSOR_ON_SHOW) ||
       (s->fifo[SVGA_FIFO_CURSOR_ON] == SVGA_CURSOR_ON_RESTORE_TO_FB)) {
-    dpy_mouse_set(s->vga.con, s->fifo[SVGA_FIFO_CURSOR_X],
-                  s->fifo[SVGA_FIFO_CURSOR_Y], SVGA_CURSOR_ON_SHOW);
+    on = SVGA_CURSOR_ON_SHOW;
+  } else {
+    on = SVGA_CURSOR_ON_HIDE;
+  };
+  if (s->cursor_pending < 1 && x == s->cursor_x && y == s->cursor_y &&
+      on == s->cursor_on) {
+    return;
+  };
+  s->cursor_pending = 0;
+  s->cursor_x = x;
+  s->cursor_y = y;
+  s->cursor_on = on;
+  vmsvga_activity(s);
+  if (vmsvga_scanout_watched(s)) {
+    dpy_mouse_set(s->vga.con, x, y, on);
+  };
+};
+static inline uint32_t vmsvga_bytes_per_line(struct vmsvga_state_s *s);
+static inline void vmsvga_mode_stage(struct vmsvga_state_s *s);
+// SVGA_FIFO_PITCHLOCK is the FIFO twin of the PITCHLOCK register and is
+// handled on the same BQL side. Anything other than the pitch we published
+// was written by the guest, a guest write racing the new pitch wins and is
+// picked up on the next poll
+static void vmsvga_fifo_pitchlock_poll(struct vmsvga_state_s *s) {
+  uint32_t value = qatomic_read(&s->fifo[SVGA_FIFO_PITCHLOCK]);
+  uint32_t pitch;
+  if (value != s->fifo_pitchlock) {
+    if (value >= 1 && value <= s->vga.vram_size) {
+      s->pitchlock = value;
+    } else {
+      s->pitchlock = 0;
+    };
+    vmsvga_mode_stage(s);
+  };
+  pitch = vmsvga_bytes_per_line(s);
+  if (pitch == value ||
+      qatomic_cmpxchg(&s->fifo[SVGA_FIFO_PITCHLOCK], value, pitch) == value) {
+    s->fifo_pitchlock = pitch;
+  };
+};
+// Cursor moves are published through SVGA_FIFO_CURSOR_COUNT without any
+// FIFO command, poll it on a short timer of its own instead of waiting
+// for the next console refresh
+static void vmsvga_cursor_poll(void *opaque) {
+  struct vmsvga_state_s *s = opaque;
+  uint32_t count;
+  // guest RAM stays untouched while stopped, vmsvga_vm_state_change and
+  // the ENABLE and CONFIG_DONE writes start polling again
+  if ((s->enable < 1 && s->config < 1) || !runstate_is_running()) {
+    return;
+  };
+  vmsvga_fifo_pitchlock_poll(s);
+  count = s->fifo[SVGA_FIFO_CURSOR_COUNT];
+  if (count != s->cursor_count || s->cursor_pending >= 1) {
+    s->cursor_count = count;
+    cursor_update_from_fifo(s);
+    s->fifo[SVGA_FIFO_CURSOR_LAST_UPDATED] = count;
+    s->cursor_poll_ms = VMSVGA_CURSOR_POLL_MS;
   } else {
-    dpy_mouse_set(s->vga.con, s->fifo[SVGA_FIFO_CURSOR_X],
-                  s->fifo[SVGA_FIFO_CURSOR_Y], SVGA_CURSOR_ON_HIDE);
+    // a cursor at rest is polled less often, the first move brings back
+    // the short interval
+    s->cursor_poll_ms = MIN(s->cursor_poll_ms * 2, VMSVGA_CURSOR_IDLE_MS);
+  };
+  timer_mod(s->cursor_timer,
+            qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + s->cursor_poll_ms);
+};
+static inline void vmsvga_cursor_poll_arm(struct vmsvga_state_s *s) {
+  if (s->cursor_timer != NULL && !timer_pending(s->cursor_timer) &&
+      runstate_is_running()) {
+    s->cursor_poll_ms = VMSVGA_CURSOR_POLL_MS;
+    timer_mod(s->cursor_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + s->cursor_poll_ms);
   };
 };
 struct vmsvga_cursor_definition_s {
@@ -179,70 +607,2804 @@ struct vmsvga_cursor_definition_s {
   uint32_t hot_y;
   uint32_t and_mask_bpp;
   uint32_t xor_mask_bpp;
-  uint32_t and_mask[4096];
-  uint32_t xor_mask[4096];
 };
-static inline void vmsvga_cursor_define(struct vmsvga_state_s *s,
-                                        struct vmsvga_cursor_definition_s *c) {
-  VPRINT("vmsvga_cursor_define was just executed\n");
-  QEMUCursor *qc;
-  qc = cursor_alloc(c->width, c->height);
-  if (qc != NULL) {
-    qc->hot_x = c->hot_x;
-    qc->hot_y = c->hot_y;
-    if (c->xor_mask_bpp != 1 && c->and_mask_bpp != 1) {
-      uint32_t i;
-      uint32_t pixels = ((c->width) * (c->height));
-      for (i = 0; i < pixels; i++) {
-        qc->data[i] = ((c->xor_mask[i]) + (c->and_mask[i]));
+// Cursor payloads are consumed in place from the FIFO ring, these return
+// the contiguous run of words starting word entries past fifo_stop
+static inline uint32_t vmsvga_fifo_span(struct vmsvga_state_s *s,
+                                        uint32_t word, uint32_t words,
+                                        const uint32_t **ptr) {
+  uint32_t off = s->fifo_stop + (word * sizeof(uint32_t));
+  uint32_t avail;
+  if (off >= s->fifo_max) {
+    off -= (s->fifo_max - s->fifo_min);
+  };
+  avail = ((s->fifo_max - off) / sizeof(uint32_t));
+  *ptr = &s->fifo[off / sizeof(uint32_t)];
+  return MIN(words, avail);
+};
+static inline uint32_t vmsvga_fifo_peek(struct vmsvga_state_s *s,
+                                        uint32_t word) {
+  const uint32_t *ptr;
+  vmsvga_fifo_span(s, word, 1, &ptr);
+  return le32_to_cpu(*ptr);
+};
+static inline void vmsvga_fifo_copy(struct vmsvga_state_s *s, void *dst,
+                                    uint32_t word, uint32_t words) {
+  uint32_t *out = dst;
+  uint32_t i;
+  for (i = 0; i < words; i++) {
+    out[i] = vmsvga_fifo_peek(s, word + i);
+  };
+};
+static inline void vmsvga_fifo_skip(struct vmsvga_state_s *s,
+                                    uint32_t words) {
+  uint32_t off = s->fifo_stop + (words * sizeof(uint32_t));
+  if (off >= s->fifo_max) {
+    off -= (s->fifo_max - s->fifo_min);
+  };
+  s->fifo_stop = off;
+  s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
+};
+static inline QEMUCursor *vmsvga_cursor_ref(QEMUCursor *qc) {
+#ifdef QEMU_V9_2_0
+  return cursor_ref(qc);
+#else
+  cursor_get(qc);
+  return qc;
+#endif
+};
+static inline void vmsvga_cursor_unref(QEMUCursor *qc) {
+#ifdef QEMU_V9_2_0
+  cursor_unref(qc);
+#else
+  cursor_put(qc);
+#endif
+};
+static inline uint64_t vmsvga_cursor_hash(struct vmsvga_state_s *s,
+                                          uint32_t words) {
+  VPRINT("vmsvga_cursor_hash was just executed\n");
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  const uint32_t *src;
+  uint32_t done = 0;
+  uint32_t n;
+  uint32_t i;
+  while (done < words) {
+    n = vmsvga_fifo_span(s, done, words - done, &src);
+    for (i = 0; i < n; i++) {
+      hash = (hash ^ src[i]) * 0x100000001b3ULL;
+    };
+    done += n;
+  };
+  return hash;
+};
+static inline struct vmsvga_cursor_cache_s *
+vmsvga_cursor_cache_slot(struct vmsvga_state_s *s,
+                         struct vmsvga_cursor_definition_s *c, uint32_t kind,
+                         uint64_t hash) {
+  uint32_t slot =
+      (uint32_t)(hash ^ (hash >> 32) ^ (c->id * 0x9e3779b9u) ^ kind) %
+      VMSVGA_CURSOR_CACHE_SIZE;
+  return &s->cursor_cache[slot];
+};
+static inline bool vmsvga_cursor_cache_match(struct vmsvga_cursor_cache_s *e,
+                                             struct vmsvga_cursor_definition_s *c,
+                                             uint32_t kind, uint64_t hash) {
+  return e->qc != NULL && e->hash == hash && e->id == c->id &&
+         e->kind == kind && e->width == c->width && e->height == c->height &&
+         e->hot_x == c->hot_x && e->hot_y == c->hot_y &&
+         e->qc->width == c->width && e->qc->height == c->height;
+};
+static inline void vmsvga_cursor_cache_store(struct vmsvga_cursor_cache_s *e,
+                                             struct vmsvga_cursor_definition_s *c,
+                                             uint32_t kind, uint64_t hash,
+                                             QEMUCursor *qc) {
+  if (e->qc != NULL) {
+    vmsvga_cursor_unref(e->qc);
+  };
+  e->qc = vmsvga_cursor_ref(qc);
+  e->hash = hash;
+  e->id = c->id;
+  e->kind = kind;
+  e->width = c->width;
+  e->height = c->height;
+  e->hot_x = c->hot_x;
+  e->hot_y = c->hot_y;
+};
+static void vmsvga_cursor_cache_reset(struct vmsvga_state_s *s) {
+  VPRINT("vmsvga_cursor_cache_reset was just executed\n");
+  uint32_t i;
+  for (i = 0; i < VMSVGA_CURSOR_CACHE_SIZE; i++) {
+    if (s->cursor_cache[i].qc != NULL) {
+      vmsvga_cursor_unref(s->cursor_cache[i].qc);
+    };
+    s->cursor_cache[i].qc = NULL;
+  };
+  if (s->cursor_shown != NULL) {
+    vmsvga_cursor_unref(s->cursor_shown);
+  };
+  s->cursor_shown = NULL;
+};
+// Hands a cursor to the UI unless it is already the one on screen, the
+// extra reference keeps the pointer compare valid after cache eviction
+static inline void vmsvga_cursor_show(struct vmsvga_state_s *s,
+                                      QEMUCursor *qc) {
+  VPRINT("vmsvga_cursor_show was just executed\n");
+  if (s->cursor_shown == qc) {
+    return;
+  };
+  dpy_cursor_define(s->vga.con, qc);
+  if (s->cursor_shown != NULL) {
+    vmsvga_cursor_unref(s->cursor_shown);
+  };
+  s->cursor_shown = vmsvga_cursor_ref(qc);
+};
+#include "vmware_vga_pixel.c.inc"
+// SVGA monochrome masks are scanline padded to 32 bits and stored MSB
+// first per byte, AND set with XOR set is an inverting pixel which the
+// host cursor cannot express so it is drawn opaque black
+static inline uint32_t vmsvga_cursor_mono_bit(uint32_t word, uint32_t x) {
+  return (word >> ((((x >> 3) & 3) * 8) + (7 - (x & 7)))) & 1;
+};
+static void vmsvga_cursor_convert_mono(struct vmsvga_state_s *s,
+                                       struct vmsvga_cursor_definition_s *c,
+                                       uint32_t *dst) {
+  VPRINT("vmsvga_cursor_convert_mono was just executed\n");
+  uint32_t and_stride = SVGA_PIXMAP_SIZE(c->width, 1, 1);
+  uint32_t xor_stride = SVGA_PIXMAP_SIZE(c->width, 1, c->xor_mask_bpp);
+  uint32_t xor_base = SVGA_PIXMAP_SIZE(c->width, c->height, 1);
+  uint32_t and_word = 0;
+  uint32_t xor_word = 0;
+  uint32_t color;
+  uint32_t x, y;
+  for (y = 0; y < c->height; y++) {
+    for (x = 0; x < c->width; x++) {
+      if ((x & 31) == 0) {
+        and_word = vmsvga_fifo_peek(s, (y * and_stride) + (x >> 5));
+        if (c->xor_mask_bpp == 1) {
+          xor_word = vmsvga_fifo_peek(s, xor_base + (y * xor_stride) + (x >> 5));
+        };
+      };
+      if (c->xor_mask_bpp == 1) {
+        color = vmsvga_cursor_mono_bit(xor_word, x) ? 0x00ffffff : 0;
+      } else {
+        color =
+            vmsvga_fifo_peek(s, xor_base + (y * xor_stride) + x) & 0x00ffffff;
+      };
+      if (vmsvga_cursor_mono_bit(and_word, x)) {
+        *dst++ = (color != 0) ? 0xff000000 : 0;
+      } else {
+        *dst++ = 0xff000000 | color;
       };
-    } else {
-      cursor_set_mono(qc, 0xffffff, 0x000000, (void *)c->xor_mask, 1,
-                      (void *)c->and_mask);
     };
-#ifdef VERBOSE
-    cursor_print_ascii_art(qc, "vmsvga_mono");
+  };
+};
+// The FIFO worker runs without the BQL, anything that touches the console
+// or the PCI interrupt is queued here and applied by vmsvga_fifo_bh
+static void vmsvga_cursor_defer(struct vmsvga_state_s *s, QEMUCursor *qc) {
+  qemu_mutex_lock(&s->bh_lock);
+  if (s->cursor_next != NULL) {
+    vmsvga_cursor_unref(s->cursor_next);
+  };
+  s->cursor_next = vmsvga_cursor_ref(qc);
+  qemu_mutex_unlock(&s->bh_lock);
+  qemu_bh_schedule(s->fifo_bh);
+};
+static void vmsvga_copy_defer(struct vmsvga_state_s *s, uint32_t src_x,
+                              uint32_t src_y, uint32_t dst_x, uint32_t dst_y,
+                              uint32_t w, uint32_t h) {
+  struct vmsvga_copy_s *c;
+  qemu_mutex_lock(&s->bh_lock);
+  if (s->copy_count < VMSVGA_COPY_QUEUE_SIZE) {
+    c = &s->copy_queue[s->copy_count++];
+    c->src_x = src_x;
+    c->src_y = src_y;
+    c->dst_x = dst_x;
+    c->dst_y = dst_y;
+    c->w = w;
+    c->h = h;
+  } else {
+    s->copy_overflow = true;
+  };
+  qemu_mutex_unlock(&s->bh_lock);
+  qemu_bh_schedule(s->fifo_bh);
+};
+static void vmsvga_irq_defer(struct vmsvga_state_s *s, uint32_t irq_status) {
+  qemu_mutex_lock(&s->bh_lock);
+  s->irq_pending |= irq_status;
+  qemu_mutex_unlock(&s->bh_lock);
+  qemu_bh_schedule(s->fifo_bh);
+};
+static void vmsvga_screen_defer(struct vmsvga_state_s *s, uint32_t id) {
+  qemu_mutex_lock(&s->bh_lock);
+  s->screen_next[id] = s->screen[id];
+  s->screen_pending |= (1u << id);
+  qemu_mutex_unlock(&s->bh_lock);
+  qemu_bh_schedule(s->fifo_bh);
+};
+// Drops the screen table vmsvga_screen_reset asked for, called with
+// fifo_lock held before the next command. A screen the main loop may have
+// taken over from a command still in flight is sent again as undefined
+static void vmsvga_screen_apply(struct vmsvga_state_s *s) {
+  uint32_t i;
+  qatomic_set(&s->screen_reset_pending, false);
+  for (i = 0; i < VMSVGA_MAX_SCREENS; i++) {
+    if (s->screen[i].defined >= 1) {
+      memset(&s->screen[i], 0, sizeof(s->screen[i]));
+      vmsvga_screen_defer(s, i);
+    };
+  };
+};
+// Surfaces, contexts, shaders and MOBs live in host memory only, after a
+// migration every id the guest holds would resolve to nothing. Called with
+// fifo_lock held whenever they may have changed, the blocker itself is
+// added and removed by vmsvga_fifo_bh
+static void vmsvga_objects_check(struct vmsvga_state_s *s) {
+  bool live = s->context_count > 0 || g_hash_table_size(s->surfaces) > 0 ||
+              g_hash_table_size(s->mobs) > 0 ||
+              g_hash_table_size(s->dx_shaders) > 0;
+  if (live == s->objects_live) {
+    return;
+  };
+  s->objects_live = live;
+  qemu_mutex_lock(&s->bh_lock);
+  s->blocker_want = live;
+  s->blocker_pending = true;
+  qemu_mutex_unlock(&s->bh_lock);
+  qemu_bh_schedule(s->fifo_bh);
+};
+static void vmsvga_migration_block(struct vmsvga_state_s *s, bool block) {
+  Error *err = NULL;
+  if (block && s->migration_blocker == NULL) {
+    error_setg(&s->migration_blocker,
+               "vmware-svga: 3D surfaces, contexts and shaders are in use "
+               "and cannot be migrated");
+#ifdef QEMU_V9_2_0
+    if (migrate_add_blocker(&s->migration_blocker, &err) < 0) {
+      error_report_err(err);
+    };
+#else
+    if (migrate_add_blocker(s->migration_blocker, &err) < 0) {
+      error_report_err(err);
+      error_free(s->migration_blocker);
+      s->migration_blocker = NULL;
+    };
 #endif
-    VPRINT("vmsvga_cursor_define | xor_mask == %u : and_mask == %u\n",
-           *c->xor_mask, *c->and_mask);
-    dpy_cursor_define(s->vga.con, qc);
+  } else if (!block && s->migration_blocker != NULL) {
 #ifdef QEMU_V9_2_0
-    cursor_unref(qc);
+    migrate_del_blocker(&s->migration_blocker);
 #else
-    cursor_put(qc);
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+    s->migration_blocker = NULL;
 #endif
   };
 };
-static inline void
-vmsvga_rgba_cursor_define(struct vmsvga_state_s *s,
-                          struct vmsvga_cursor_definition_s *c) {
-  VPRINT("vmsvga_rgba_cursor_define was just executed\n");
-  QEMUCursor *qc;
-  qc = cursor_alloc(c->width, c->height);
-  if (qc != NULL) {
-    qc->hot_x = c->hot_x;
-    qc->hot_y = c->hot_y;
-    if (c->xor_mask_bpp != 1 && c->and_mask_bpp != 1) {
-      uint32_t i;
-      uint32_t pixels = ((c->width) * (c->height));
-      for (i = 0; i < pixels; i++) {
-        qc->data[i] = ((c->xor_mask[i]) + (c->and_mask[i]));
+// Guest memory is only accessed where it is RAM. pci_dma_* dispatches
+// anything else as MMIO under the BQL, and BQL holders wait for fifo_lock,
+// so the worker must never get there. Reads of anything else return zeros
+static bool vmsvga_dma(struct vmsvga_state_s *s, dma_addr_t addr, void *buf,
+                       dma_addr_t size, bool write) {
+  struct pci_vmsvga_state_s *pci_vmsvga =
+      container_of(s, struct pci_vmsvga_state_s, chip);
+  AddressSpace *as = pci_get_address_space(PCI_DEVICE(pci_vmsvga));
+  MemoryRegionCache cache;
+  uint8_t *p = buf;
+  int64_t n;
+  bool ok = true;
+  while (size > 0) {
+    n = address_space_cache_init(&cache, as, addr, size, write);
+    if (n < 1 || cache.ptr == NULL) {
+      ok = false;
+    } else if (write) {
+      memcpy(cache.ptr, p, n);
+      address_space_cache_invalidate(&cache, 0, n);
+    } else {
+      memcpy(p, cache.ptr, n);
+    };
+    address_space_cache_destroy(&cache);
+    if (!ok) {
+      break;
+    };
+    p += n;
+    addr += n;
+    size -= n;
+  };
+  if (!ok && !write) {
+    memset(p, 0, size);
+  };
+  return ok;
+};
+static void vmsvga_capture_gmr(struct vmsvga_state_s *s, uint32_t gmr_id);
+// Reads or writes size bytes at offset inside a GMR. Pages that follow each
+// other in guest physical memory are merged so every run is one DMA
+static bool vmsvga_gmr_access(struct vmsvga_state_s *s, uint32_t gmr_id,
+                              uint64_t offset, void *buf, uint32_t size,
+                              bool write) {
+  struct vmsvga_gmr_s *gmr;
+  uint8_t *p = buf;
+  uint64_t page;
+  uint64_t run;
+  uint64_t end = offset + size;
+  uint32_t n;
+  dma_addr_t addr;
+  if (gmr_id == SVGA_GMR_FRAMEBUFFER) {
+    if (end > s->vga.vram_size) {
+      return false;
+    };
+    // the other side of a blit may live in VRAM as well
+    if (write) {
+      memmove(s->vga.vram_ptr + offset, buf, size);
+      memory_region_set_dirty(&s->vga.vram, offset, size);
+    } else {
+      memmove(buf, s->vga.vram_ptr + offset, size);
+    };
+    return true;
+  };
+  if (gmr_id >= VMSVGA_GMR_MAX_IDS) {
+    return false;
+  };
+  gmr = &s->gmr[gmr_id];
+  if (end > ((uint64_t)gmr->num_pages << VMSVGA_GMR_PAGE_SHIFT)) {
+    return false;
+  };
+  vmsvga_capture_gmr(s, gmr_id);
+  while (offset < end) {
+    page = offset >> VMSVGA_GMR_PAGE_SHIFT;
+    run = 1;
+    while (((page + run) << VMSVGA_GMR_PAGE_SHIFT) < end &&
+           gmr->pages[page + run] == gmr->pages[page] + run) {
+      run++;
+    };
+    n = MIN(end, (page + run) << VMSVGA_GMR_PAGE_SHIFT) - offset;
+    addr = (gmr->pages[page] << VMSVGA_GMR_PAGE_SHIFT) +
+           (offset & ((1 << VMSVGA_GMR_PAGE_SHIFT) - 1));
+    if (!vmsvga_dma(s, addr, p, n, write)) {
+      return false;
+    };
+    p += n;
+    offset += n;
+  };
+  return true;
+};
+static void vmsvga_gmr_define(struct vmsvga_state_s *s, uint32_t gmr_id,
+                              uint32_t num_pages) {
+  VPRINT("vmsvga_gmr_define was just executed\n");
+  struct vmsvga_gmr_s *gmr;
+  if (gmr_id >= VMSVGA_GMR_MAX_IDS || num_pages > VMSVGA_GMR_MAX_PAGES) {
+    return;
+  };
+  gmr = &s->gmr[gmr_id];
+  if (num_pages < 1) {
+    g_free(gmr->pages);
+    gmr->pages = NULL;
+  } else {
+    gmr->pages = g_renew(uint64_t, gmr->pages, num_pages);
+    if (num_pages > gmr->num_pages) {
+      memset(gmr->pages + gmr->num_pages, 0,
+             (num_pages - gmr->num_pages) * sizeof(uint64_t));
+    };
+  };
+  gmr->num_pages = num_pages;
+  s->capture_gmr &= ~(1ULL << gmr_id);
+};
+static void vmsvga_gmr_reset(struct vmsvga_state_s *s) {
+  uint32_t i;
+  for (i = 0; i < VMSVGA_GMR_MAX_IDS; i++) {
+    vmsvga_gmr_define(s, i, 0);
+  };
+  qemu_mutex_lock(&s->bh_lock);
+  for (i = 0; i < VMSVGA_GMR_MAX_IDS; i++) {
+    g_free(s->gmr_next[i].pages);
+    s->gmr_next[i].pages = NULL;
+    s->gmr_next[i].num_pages = 0;
+  };
+  qatomic_set(&s->gmr_pending, 0);
+  qemu_mutex_unlock(&s->bh_lock);
+};
+// Takes over the descriptor lists the vCPU built, called with fifo_lock
+// held before any command that could use them
+static void vmsvga_gmr_apply(struct vmsvga_state_s *s) {
+  uint64_t pending;
+  uint32_t i;
+  qemu_mutex_lock(&s->bh_lock);
+  pending = s->gmr_pending;
+  qatomic_set(&s->gmr_pending, 0);
+  s->capture_gmr &= ~pending;
+  for (i = 0; i < VMSVGA_GMR_MAX_IDS; i++) {
+    if (pending & (1ULL << i)) {
+      g_free(s->gmr[i].pages);
+      s->gmr[i] = s->gmr_next[i];
+      s->gmr_next[i].pages = NULL;
+      s->gmr_next[i].num_pages = 0;
+    };
+  };
+  qemu_mutex_unlock(&s->bh_lock);
+};
+// Resolves a page of a guest backed MOB. PT_1 and PT_2 walk one or two
+// levels of page tables in guest memory, RANGE is physically contiguous
+static bool vmsvga_mob_ppn(struct vmsvga_state_s *s, struct vmsvga_mob_s *mob,
+                           uint64_t page, uint64_t *ppn) {
+  uint32_t entry = (mob->format >= SVGA3D_MOBFMT_PT64_0) ? 8 : 4;
+  uint32_t per = (1 << VMSVGA_GMR_PAGE_SHIFT) / entry;
+  uint32_t levels;
+  uint64_t table = mob->base;
+  uint64_t span = 1;
+  uint64_t idx;
+  uint32_t e32;
+  uint64_t e64;
+  uint32_t i;
+  if (mob->format == SVGA3D_MOBFMT_RANGE) {
+    *ppn = mob->base + page;
+    return true;
+  };
+  levels = mob->format - ((entry == 8) ? SVGA3D_MOBFMT_PT64_0
+                                       : SVGA3D_MOBFMT_PT_0);
+  for (i = 1; i < levels; i++) {
+    span *= per;
+  };
+  if (page >= span * ((levels > 0) ? per : 1)) {
+    return false;
+  };
+  for (i = levels; i > 0; i--) {
+    idx = page / span;
+    page %= span;
+    span /= (i > 1) ? per : 1;
+    // page tables outside guest RAM fail the walk instead of reaching MMIO
+    if (entry == 8) {
+      if (!vmsvga_dma(s, (table << VMSVGA_GMR_PAGE_SHIFT) + idx * entry, &e64,
+                      sizeof(e64), false)) {
+        return false;
+      };
+      table = le64_to_cpu(e64);
+    } else {
+      if (!vmsvga_dma(s, (table << VMSVGA_GMR_PAGE_SHIFT) + idx * entry, &e32,
+                      sizeof(e32), false)) {
+        return false;
       };
+      table = le32_to_cpu(e32);
+    };
+  };
+  *ppn = table;
+  return true;
+};
+static bool vmsvga_mob_read(struct vmsvga_state_s *s, uint32_t mobid,
+                            uint64_t offset, void *buf, uint32_t size) {
+  VPRINT("vmsvga_mob_read was just executed\n");
+  struct vmsvga_mob_s *mob;
+  uint8_t *p = buf;
+  uint64_t end = offset + size;
+  uint64_t ppn;
+  uint32_t n;
+  mob = g_hash_table_lookup(s->mobs, GUINT_TO_POINTER(mobid));
+  if (mob == NULL || end > mob->size) {
+    return false;
+  };
+  while (offset < end) {
+    if (!vmsvga_mob_ppn(s, mob, offset >> VMSVGA_GMR_PAGE_SHIFT, &ppn)) {
+      return false;
+    };
+    n = MIN(end - offset, (1 << VMSVGA_GMR_PAGE_SHIFT) -
+                              (offset & ((1 << VMSVGA_GMR_PAGE_SHIFT) - 1)));
+    if (!vmsvga_dma(s,
+                    (ppn << VMSVGA_GMR_PAGE_SHIFT) +
+                        (offset & ((1 << VMSVGA_GMR_PAGE_SHIFT) - 1)),
+                    p, n, false)) {
+      return false;
+    };
+    p += n;
+    offset += n;
+  };
+  return true;
+};
+// SVGA_REG_GMR_DESCRIPTOR points at a chain of SVGAGuestMemDescriptor
+// pages, a zero page count links to the next page and two zeros end it
+static void vmsvga_gmr_define_desc(struct vmsvga_state_s *s, uint32_t gmr_id,
+                                   uint32_t ppn) {
+  VPRINT("vmsvga_gmr_define_desc was just executed\n");
+  struct pci_vmsvga_state_s *pci_vmsvga =
+      container_of(s, struct pci_vmsvga_state_s, chip);
+  SVGAGuestMemDescriptor desc;
+  uint64_t *pages = NULL;
+  uint32_t count = 0;
+  uint32_t index = 0;
+  uint32_t steps;
+  uint32_t i;
+  if (gmr_id >= VMSVGA_GMR_MAX_IDS) {
+    return;
+  };
+  for (steps = 0; ppn != 0 && steps < VMSVGA_GMR_MAX_DESCRIPTORS; steps++) {
+    pci_dma_read(PCI_DEVICE(pci_vmsvga),
+                 ((dma_addr_t)ppn << VMSVGA_GMR_PAGE_SHIFT) +
+                     (index * sizeof(desc)),
+                 &desc, sizeof(desc));
+    desc.ppn = le32_to_cpu(desc.ppn);
+    desc.numPages = le32_to_cpu(desc.numPages);
+    if (desc.numPages < 1) {
+      ppn = desc.ppn;
+      index = 0;
+      continue;
+    };
+    if (desc.numPages > VMSVGA_GMR_MAX_PAGES - count) {
+      break;
+    };
+    pages = g_renew(uint64_t, pages, count + desc.numPages);
+    for (i = 0; i < desc.numPages; i++) {
+      pages[count++] = (uint64_t)desc.ppn + i;
+    };
+    index++;
+    if (((index + 1) * sizeof(desc)) > (1 << VMSVGA_GMR_PAGE_SHIFT)) {
+      break;
+    };
+  };
+  // the worker may sit on fifo_lock for a whole batch, so the list is
+  // handed over instead of waiting for it on the vCPU
+  qemu_mutex_lock(&s->bh_lock);
+  g_free(s->gmr_next[gmr_id].pages);
+  s->gmr_next[gmr_id].pages = pages;
+  s->gmr_next[gmr_id].num_pages = count;
+  qatomic_set(&s->gmr_pending, s->gmr_pending | (1ULL << gmr_id));
+  qemu_mutex_unlock(&s->bh_lock);
+};
+// The PPN list of SVGA_CMD_REMAP_GMR2 is still in the FIFO ring, or in
+// another GMR when SVGA_REMAP_GMR2_VIA_GMR is set
+static void vmsvga_gmr_remap(struct vmsvga_state_s *s,
+                             SVGAFifoCmdRemapGMR2 *remap) {
+  VPRINT("vmsvga_gmr_remap was just executed\n");
+  struct vmsvga_gmr_s *gmr;
+  uint32_t size = (remap->flags & SVGA_REMAP_GMR2_PPN64) ? 8 : 4;
+  uint32_t gmr_id = 0;
+  uint32_t offset = 0;
+  uint32_t entry;
+  uint32_t i;
+  uint64_t ppn = 0;
+  if (remap->gmrId >= VMSVGA_GMR_MAX_IDS) {
+    return;
+  };
+  gmr = &s->gmr[remap->gmrId];
+  if (((uint64_t)remap->offsetPages + remap->numPages) > gmr->num_pages) {
+    return;
+  };
+  if (remap->flags & SVGA_REMAP_GMR2_VIA_GMR) {
+    gmr_id = vmsvga_fifo_peek(s, 0);
+    offset = vmsvga_fifo_peek(s, 1);
+  };
+  for (i = 0; i < remap->numPages; i++) {
+    entry = (remap->flags & SVGA_REMAP_GMR2_SINGLE_PPN) ? 0 : i;
+    if (remap->flags & SVGA_REMAP_GMR2_VIA_GMR) {
+      ppn = 0;
+      if (!vmsvga_gmr_access(s, gmr_id, (uint64_t)offset + (entry * size),
+                             &ppn, size, false)) {
+        return;
+      };
+      ppn = le64_to_cpu(ppn);
+    } else if (remap->flags & SVGA_REMAP_GMR2_PPN64) {
+      ppn = vmsvga_fifo_peek(s, entry * 2) |
+            ((uint64_t)vmsvga_fifo_peek(s, (entry * 2) + 1) << 32);
     } else {
-      cursor_set_mono(qc, 0xffffff, 0x000000, (void *)c->xor_mask, 1,
-                      (void *)c->and_mask);
+      ppn = vmsvga_fifo_peek(s, entry);
+    };
+    gmr->pages[remap->offsetPages + i] = ppn;
+  };
+};
+// Words of SVGA_CMD_REMAP_GMR2 payload that follow the fixed header
+static inline uint64_t vmsvga_gmr_remap_words(SVGAFifoCmdRemapGMR2 *remap) {
+  uint64_t entries;
+  if (remap->flags & SVGA_REMAP_GMR2_VIA_GMR) {
+    return sizeof(SVGAGuestPtr) / sizeof(uint32_t);
+  };
+  entries = (remap->flags & SVGA_REMAP_GMR2_SINGLE_PPN) ? 1 : remap->numPages;
+  return entries * ((remap->flags & SVGA_REMAP_GMR2_PPN64) ? 2 : 1);
+};
+static void vmsvga_screen_define(struct vmsvga_state_s *s,
+                                 SVGAScreenObject *obj, uint32_t size) {
+  VPRINT("vmsvga_screen_define was just executed\n");
+  struct vmsvga_screen_s scr;
+  if (obj->id >= s->num_screens) {
+    VPRINT("vmsvga_screen_define: screen id %u out of range\n", obj->id);
+    return;
+  };
+  memset(&scr, 0, sizeof(scr));
+  scr.defined = 1;
+  scr.flags = obj->flags;
+  scr.width = obj->size.width;
+  scr.height = obj->size.height;
+  scr.root_x = obj->root.x;
+  scr.root_y = obj->root.y;
+  if (!(scr.flags & SVGA_SCREEN_DEACTIVATE)) {
+    if (size >= offsetof(SVGAScreenObject, cloneCount)) {
+      if (obj->backingStore.ptr.gmrId != SVGA_GMR_FRAMEBUFFER) {
+        VPRINT("vmsvga_screen_define: backing store outside the GFB\n");
+        return;
+      };
+      scr.offset = obj->backingStore.ptr.offset;
+      scr.pitch = obj->backingStore.pitch;
+    } else if (obj->id != 0) {
+      // version 1 screens without a backing store only work as the
+      // primary, which then scans out from the start of the GFB
+      VPRINT("vmsvga_screen_define: screen %u has no backing store\n",
+             obj->id);
+      return;
+    };
+    if (scr.pitch < 1) {
+      scr.pitch = scr.width * 4;
+    };
+    if (scr.width < 1 || scr.height < 1 ||
+        scr.width > VMSVGA_SCREEN_MAX_DIMENSION ||
+        scr.height > VMSVGA_SCREEN_MAX_DIMENSION ||
+        scr.pitch < (scr.width * 4) || (scr.pitch % 4) != 0 ||
+        (scr.offset % 4) != 0 ||
+        ((uint64_t)scr.offset + ((uint64_t)scr.pitch * scr.height)) >
+            s->vga.vram_size) {
+      VPRINT("vmsvga_screen_define: screen %u rejected\n", obj->id);
+      return;
+    };
+  };
+  s->screen[obj->id] = scr;
+  vmsvga_screen_defer(s, obj->id);
+};
+static void vmsvga_screen_destroy(struct vmsvga_state_s *s, uint32_t id) {
+  VPRINT("vmsvga_screen_destroy was just executed\n");
+  if (id >= s->num_screens) {
+    return;
+  };
+  memset(&s->screen[id], 0, sizeof(s->screen[id]));
+  vmsvga_screen_defer(s, id);
+};
+static inline bool vmsvga_screen_live(struct vmsvga_screen_s *scr) {
+  return scr->defined >= 1 && !(scr->flags & SVGA_SCREEN_DEACTIVATE);
+};
+// rect is relative to the screen origin, clip it to the screen and move
+// src along with the left/top edges
+static bool vmsvga_screen_clip(struct vmsvga_screen_s *scr,
+                               SVGASignedRect *rect, SVGASignedPoint *src) {
+  int64_t left = MAX(rect->left, 0);
+  int64_t top = MAX(rect->top, 0);
+  int64_t right = MIN((int64_t)rect->right, (int64_t)scr->width);
+  int64_t bottom = MIN((int64_t)rect->bottom, (int64_t)scr->height);
+  if (left >= right || top >= bottom) {
+    return false;
+  };
+  src->x += left - rect->left;
+  src->y += top - rect->top;
+  if (src->x < 0 || src->y < 0) {
+    return false;
+  };
+  rect->left = left;
+  rect->top = top;
+  rect->right = right;
+  rect->bottom = bottom;
+  return true;
+};
+static void vmsvga_blit_to_screen(struct vmsvga_state_s *s, uint32_t id,
+                                  SVGASignedPoint src, SVGASignedRect rect) {
+  VPRINT("vmsvga_blit_to_screen was just executed\n");
+  struct vmsvga_screen_s *scr = &s->screen[id];
+  uint32_t bytes;
+  uint32_t y;
+  uint8_t *dst;
+  if (!vmsvga_screen_live(scr) || !vmsvga_screen_clip(scr, &rect, &src)) {
+    return;
+  };
+  if (s->gmrfb_bpp != 32) {
+    VPRINT("vmsvga_blit_to_screen: unsupported GMRFB depth %u\n",
+           s->gmrfb_bpp);
+    return;
+  };
+  bytes = (rect.right - rect.left) * 4;
+  dst = s->vga.vram_ptr + scr->offset + (rect.top * scr->pitch) +
+        (rect.left * 4);
+  for (y = 0; y < (rect.bottom - rect.top); y++) {
+    if (!vmsvga_gmr_access(s, s->gmrfb_gmr,
+                           (uint64_t)s->gmrfb_offset +
+                               ((uint64_t)(src.y + y) * s->gmrfb_pitch) +
+                               (src.x * 4),
+                           dst + (y * scr->pitch), bytes, false)) {
+      break;
+    };
+  };
+  memory_region_set_dirty(&s->vga.vram, scr->offset + (rect.top * scr->pitch),
+                          (rect.bottom - rect.top) * scr->pitch);
+};
+// SVGA_ID_INVALID addresses the virtual desktop, the rectangle is split
+// across every screen it touches
+static void vmsvga_blit_gmrfb_to_screen(struct vmsvga_state_s *s,
+                                        SVGAFifoCmdBlitGMRFBToScreen *blit) {
+  VPRINT("vmsvga_blit_gmrfb_to_screen was just executed\n");
+  SVGASignedRect rect;
+  uint32_t i;
+  if (blit->destScreenId != SVGA_ID_INVALID) {
+    if (blit->destScreenId < s->num_screens) {
+      vmsvga_blit_to_screen(s, blit->destScreenId, blit->srcOrigin,
+                            blit->destRect);
+    };
+    return;
+  };
+  for (i = 0; i < s->num_screens; i++) {
+    if (!vmsvga_screen_live(&s->screen[i])) {
+      continue;
+    };
+    rect.left = blit->destRect.left - s->screen[i].root_x;
+    rect.top = blit->destRect.top - s->screen[i].root_y;
+    rect.right = blit->destRect.right - s->screen[i].root_x;
+    rect.bottom = blit->destRect.bottom - s->screen[i].root_y;
+    vmsvga_blit_to_screen(s, i, blit->srcOrigin, rect);
+  };
+};
+// Readback has no clipping, a source that leaves the screen is dropped
+static void vmsvga_blit_screen_to_gmrfb(struct vmsvga_state_s *s,
+                                        SVGAFifoCmdBlitScreenToGMRFB *blit) {
+  VPRINT("vmsvga_blit_screen_to_gmrfb was just executed\n");
+  struct vmsvga_screen_s *scr;
+  SVGASignedRect *rect = &blit->srcRect;
+  uint32_t bytes;
+  uint32_t y;
+  if (blit->srcScreenId >= s->num_screens || s->gmrfb_bpp != 32 ||
+      blit->destOrigin.x < 0 || blit->destOrigin.y < 0) {
+    return;
+  };
+  scr = &s->screen[blit->srcScreenId];
+  if (!vmsvga_screen_live(scr) || rect->left < 0 || rect->top < 0 ||
+      rect->left >= rect->right || rect->top >= rect->bottom ||
+      rect->right > scr->width || rect->bottom > scr->height) {
+    return;
+  };
+  bytes = (rect->right - rect->left) * 4;
+  for (y = 0; y < (rect->bottom - rect->top); y++) {
+    if (!vmsvga_gmr_access(
+            s, s->gmrfb_gmr,
+            (uint64_t)s->gmrfb_offset +
+                ((uint64_t)(blit->destOrigin.y + y) * s->gmrfb_pitch) +
+                (blit->destOrigin.x * 4),
+            s->vga.vram_ptr + scr->offset + ((rect->top + y) * scr->pitch) +
+                (rect->left * 4),
+            bytes, true)) {
+      break;
+    };
+  };
+};
+// Surface storage comes in power-of-two blocks from 4 KiB up, freed blocks
+// are kept per class for the next surface of the same size
+static inline uint32_t vmsvga_arena_class(uint64_t size) {
+  uint32_t c = 0;
+  while (c < VMSVGA_ARENA_CLASSES &&
+         ((uint64_t)1 << (c + VMSVGA_ARENA_MIN_SHIFT)) < size) {
+    c++;
+  };
+  return c;
+};
+static inline uint64_t vmsvga_arena_block(uint64_t size) {
+  uint32_t c = vmsvga_arena_class(size);
+  if (c >= VMSVGA_ARENA_CLASSES) {
+    return size;
+  };
+  return (uint64_t)1 << (c + VMSVGA_ARENA_MIN_SHIFT);
+};
+static void vmsvga_arena_trim(struct vmsvga_state_s *s) {
+  uint8_t *p;
+  uint32_t c;
+  for (c = 0; c < VMSVGA_ARENA_CLASSES; c++) {
+    while ((p = s->arena_free[c]) != NULL) {
+      s->arena_free[c] = *(uint8_t **)p;
+      g_free(p);
+      s->surface_bytes -= (uint64_t)1 << (c + VMSVGA_ARENA_MIN_SHIFT);
+    };
+    s->arena_count[c] = 0;
+  };
+};
+// Returns storage for size bytes, or NULL once the budget is spent. Fresh
+// blocks come from calloc so untouched pages stay off the host RSS, reused
+// ones are only cleared when the caller cares about their contents
+static uint8_t *vmsvga_arena_alloc(struct vmsvga_state_s *s, uint64_t size,
+                                   bool zero) {
+  uint32_t c = vmsvga_arena_class(size);
+  uint64_t block = vmsvga_arena_block(size);
+  uint64_t budget = (uint64_t)s->surface_budget_mb << 20;
+  uint8_t *p;
+  if (c < VMSVGA_ARENA_CLASSES && s->arena_free[c] != NULL) {
+    p = s->arena_free[c];
+    s->arena_free[c] = *(uint8_t **)p;
+    s->arena_count[c]--;
+    if (zero) {
+      memset(p, 0, size);
+    };
+    return p;
+  };
+  if (s->surface_bytes + block > budget) {
+    vmsvga_arena_trim(s);
+    if (s->surface_bytes + block > budget) {
+      return NULL;
+    };
+  };
+  p = g_try_malloc0(block);
+  if (p != NULL) {
+    s->surface_bytes += block;
+  };
+  return p;
+};
+static void vmsvga_arena_free(struct vmsvga_state_s *s, uint8_t *p,
+                              uint64_t size) {
+  uint32_t c = vmsvga_arena_class(size);
+  if (p == NULL) {
+    return;
+  };
+  if (c < VMSVGA_ARENA_CLASSES && s->arena_count[c] < VMSVGA_ARENA_DEPTH) {
+    *(uint8_t **)p = s->arena_free[c];
+    s->arena_free[c] = p;
+    s->arena_count[c]++;
+    return;
+  };
+  g_free(p);
+  s->surface_bytes -= vmsvga_arena_block(size);
+};
+static void vmsvga_surface_free(gpointer data) {
+  struct vmsvga_surface_s *surf = data;
+  vmsvga_arena_free(surf->s, surf->data, surf->bytes);
+  g_free(surf);
+};
+static inline struct vmsvga_surface_s *
+vmsvga_surface_lookup(struct vmsvga_state_s *s, uint32_t sid) {
+  return g_hash_table_lookup(s->surfaces, GUINT_TO_POINTER(sid));
+};
+// Backing store is only allocated once something writes to the surface,
+// until then its contents read as zero. Recycled arena blocks hold data of
+// an earlier surface, so only a writer replacing every byte may skip the
+// clear
+static uint8_t *vmsvga_surface_data(struct vmsvga_state_s *s,
+                                    struct vmsvga_surface_s *surf,
+                                    bool discard) {
+  if (surf->data == NULL) {
+    surf->data = vmsvga_arena_alloc(s, surf->bytes, !discard);
+    if (surf->data == NULL) {
+      VPRINT("vmsvga_surface_data: surface %u over budget\n", surf->sid);
+    };
+  };
+  return surf->data;
+};
+// Faces are stored one after another, each holding its whole mip chain
+static inline uint32_t vmsvga_surface_offset(struct vmsvga_surface_s *surf,
+                                             uint32_t face, uint32_t mip) {
+  return svga3dsurface_get_image_offset(surf->format, surf->size, surf->mips,
+                                        face, mip);
+};
+// SVGA3dCmdDefineSurface and _v2 are followed by one SVGA3dSize per mip of
+// every face, words is the payload size from the 3D command header
+static void vmsvga_surface_define(struct vmsvga_state_s *s, uint32_t cmd,
+                                  uint32_t words) {
+  VPRINT("vmsvga_surface_define was just executed\n");
+  const struct svga3d_surface_desc *desc;
+  struct vmsvga_surface_s *surf;
+  SVGA3dSize size;
+  SVGA3dSize mip_size;
+  uint32_t fixed = (cmd == SVGA_3D_CMD_SURFACE_DEFINE_V2)
+                       ? sizeof(SVGA3dCmdDefineSurface_v2) / sizeof(uint32_t)
+                       : sizeof(SVGA3dCmdDefineSurface) / sizeof(uint32_t);
+  uint32_t sid;
+  uint32_t flags;
+  uint32_t format;
+  uint32_t faces;
+  uint32_t mips;
+  uint32_t bytes;
+  uint32_t face;
+  uint32_t mip;
+  uint32_t word;
+  if (words < fixed + 3) {
+    return;
+  };
+  sid = vmsvga_fifo_peek(s, 0);
+  flags = vmsvga_fifo_peek(s, 1);
+  format = vmsvga_fifo_peek(s, 2);
+  mips = vmsvga_fifo_peek(s, 3);
+  faces = (flags & SVGA3D_SURFACE_CUBEMAP) ? SVGA3D_MAX_SURFACE_FACES : 1;
+  for (face = 0; face < SVGA3D_MAX_SURFACE_FACES; face++) {
+    if (vmsvga_fifo_peek(s, 3 + face) != ((face < faces) ? mips : 0)) {
+      VPRINT("vmsvga_surface_define: surface %u has uneven faces\n", sid);
+      return;
+    };
+  };
+  desc = svga3dsurface_get_desc(format);
+  if (sid >= SVGA3D_MAX_SURFACE_IDS || desc->bytes_per_block < 1 ||
+      mips < 1 || mips > VMSVGA_SURFACE_MAX_MIPS ||
+      words != fixed + (faces * mips * 3)) {
+    VPRINT("vmsvga_surface_define: surface %u rejected\n", sid);
+    return;
+  };
+  size.width = vmsvga_fifo_peek(s, fixed);
+  size.height = vmsvga_fifo_peek(s, fixed + 1);
+  size.depth = vmsvga_fifo_peek(s, fixed + 2);
+  if (size.width < 1 || size.height < 1 || size.depth < 1 ||
+      size.width > VMSVGA_SURFACE_MAX_DIMENSION ||
+      size.height > VMSVGA_SURFACE_MAX_DIMENSION ||
+      size.depth > VMSVGA_SURFACE_MAX_DIMENSION) {
+    return;
+  };
+  // the layout math assumes every face carries the standard mip chain
+  for (face = 0; face < faces; face++) {
+    for (mip = 0; mip < mips; mip++) {
+      word = fixed + (((face * mips) + mip) * 3);
+      mip_size = svga3dsurface_get_mip_size(size, mip);
+      if (vmsvga_fifo_peek(s, word) != mip_size.width ||
+          vmsvga_fifo_peek(s, word + 1) != mip_size.height ||
+          vmsvga_fifo_peek(s, word + 2) != mip_size.depth) {
+        VPRINT("vmsvga_surface_define: surface %u has odd mip sizes\n", sid);
+        return;
+      };
+    };
+  };
+  bytes = svga3dsurface_get_serialized_size(format, size, mips, faces);
+  if (bytes == MAX_UINT32 || bytes > ((uint64_t)s->surface_budget_mb << 20)) {
+    VPRINT("vmsvga_surface_define: surface %u is %u bytes\n", sid, bytes);
+    return;
+  };
+  surf = g_new0(struct vmsvga_surface_s, 1);
+  surf->s = s;
+  surf->sid = sid;
+  surf->flags = flags;
+  surf->format = format;
+  surf->faces = faces;
+  surf->mips = mips;
+  surf->size = size;
+  surf->bytes = bytes;
+  if (cmd == SVGA_3D_CMD_SURFACE_DEFINE_V2) {
+    surf->multisample = vmsvga_fifo_peek(s, 9);
+  };
+  g_hash_table_replace(s->surfaces, GUINT_TO_POINTER(sid), surf);
+};
+static inline void vmsvga_surface_destroy(struct vmsvga_state_s *s,
+                                          uint32_t sid) {
+  g_hash_table_remove(s->surfaces, GUINT_TO_POINTER(sid));
+};
+// Guest and host sides of a surface DMA that are contiguous in both are
+// moved with a single GMR access
+struct vmsvga_dma_run_s {
+  uint32_t gmr_id;
+  uint64_t guest;
+  uint32_t host;
+  uint32_t len;
+};
+static void vmsvga_dma_flush(struct vmsvga_state_s *s,
+                             struct vmsvga_dma_run_s *run, uint8_t *data,
+                             bool to_host) {
+  uint8_t *zero;
+  if (run->len < 1) {
+    return;
+  };
+  if (data != NULL) {
+    if (!vmsvga_gmr_access(s, run->gmr_id, run->guest, data + run->host,
+                           run->len, !to_host)) {
+      VPRINT("vmsvga_dma_flush: gmr %u offset %" PRIu64 " out of range\n",
+             run->gmr_id, run->guest);
+    };
+  } else if (!to_host) {
+    // the surface was never written, reading it back yields zeros
+    zero = g_malloc0(run->len);
+    vmsvga_gmr_access(s, run->gmr_id, run->guest, zero, run->len, true);
+    g_free(zero);
+  };
+  run->len = 0;
+};
+static inline void vmsvga_dma_queue(struct vmsvga_state_s *s,
+                                    struct vmsvga_dma_run_s *run,
+                                    uint8_t *data, bool to_host,
+                                    uint64_t guest, uint32_t host,
+                                    uint32_t len) {
+  if (run->len > 0 && guest == run->guest + run->len &&
+      host == run->host + run->len && len <= UINT32_MAX - run->len) {
+    run->len += len;
+    return;
+  };
+  vmsvga_dma_flush(s, run, data, to_host);
+  run->guest = guest;
+  run->host = host;
+  run->len = len;
+};
+// SVGA3dCmdSurfaceDMA is followed by SVGA3dCopyBox entries and, from newer
+// guests, a SVGA3dCmdSurfaceDMASuffix in the last words of the command
+static void vmsvga_surface_dma(struct vmsvga_state_s *s, uint32_t words) {
+  VPRINT("vmsvga_surface_dma was just executed\n");
+  const struct svga3d_surface_desc *desc;
+  struct vmsvga_surface_s *surf;
+  struct vmsvga_dma_run_s run;
+  SVGA3dCmdSurfaceDMA dma;
+  SVGA3dCmdSurfaceDMASuffix suffix;
+  SVGA3dCopyBox box;
+  SVGA3dSize mip_size;
+  SVGA3dSize blocks;
+  uint32_t fixed = sizeof(dma) / sizeof(uint32_t);
+  uint32_t boxes;
+  uint32_t guest_pitch;
+  uint32_t host_pitch;
+  uint64_t guest_slice;
+  uint32_t host_slice;
+  uint32_t image;
+  uint32_t bx;
+  uint32_t by;
+  uint32_t cols;
+  uint32_t rows;
+  uint32_t row_bytes;
+  uint32_t span;
+  uint32_t step;
+  uint64_t guest;
+  uint32_t host;
+  uint32_t i;
+  uint32_t j;
+  uint32_t z;
+  uint32_t y;
+  bool to_host;
+  bool whole;
+  uint8_t *data;
+  if (words < fixed) {
+    return;
+  };
+  for (i = 0; i < fixed; i++) {
+    ((uint32_t *)&dma)[i] = vmsvga_fifo_peek(s, i);
+  };
+  memset(&suffix, 0, sizeof(suffix));
+  suffix.maximumOffset = MAX_UINT32;
+  boxes = (words - fixed) / (sizeof(box) / sizeof(uint32_t));
+  if (((words - fixed) % (sizeof(box) / sizeof(uint32_t))) ==
+          sizeof(suffix) / sizeof(uint32_t) &&
+      vmsvga_fifo_peek(s, words - (sizeof(suffix) / sizeof(uint32_t))) ==
+          sizeof(suffix)) {
+    for (i = 0; i < sizeof(suffix) / sizeof(uint32_t); i++) {
+      ((uint32_t *)&suffix)[i] = vmsvga_fifo_peek(
+          s, words - (sizeof(suffix) / sizeof(uint32_t)) + i);
+    };
+  };
+  surf = vmsvga_surface_lookup(s, dma.host.sid);
+  if (surf == NULL || dma.host.face >= surf->faces ||
+      dma.host.mipmap >= surf->mips ||
+      (dma.transfer != SVGA3D_WRITE_HOST_VRAM &&
+       dma.transfer != SVGA3D_READ_HOST_VRAM)) {
+    VPRINT("vmsvga_surface_dma: bad target surface %u\n", dma.host.sid);
+    return;
+  };
+  desc = svga3dsurface_get_desc(surf->format);
+  if (svga3dsurface_is_planar_surface(desc)) {
+    return;
+  };
+  to_host = (dma.transfer == SVGA3D_WRITE_HOST_VRAM);
+  if (to_host) {
+    // discard only gives up the current face and mip, the write has to be
+    // the only image of the surface and cover it with one box
+    whole = false;
+    if (suffix.flags.discard && surf->faces == 1 && surf->mips == 1 &&
+        boxes == 1) {
+      for (j = 0; j < sizeof(box) / sizeof(uint32_t); j++) {
+        ((uint32_t *)&box)[j] = vmsvga_fifo_peek(s, fixed + j);
+      };
+      whole = box.x == 0 && box.y == 0 && box.z == 0 &&
+              box.w >= surf->size.width && box.h >= surf->size.height &&
+              box.d >= surf->size.depth;
+    };
+    data = vmsvga_surface_data(s, surf, whole);
+    if (data == NULL) {
+      return;
+    };
+  } else {
+    data = surf->data;
+  };
+  mip_size = svga3dsurface_get_mip_size(surf->size, dma.host.mipmap);
+  svga3dsurface_get_size_in_blocks(desc, &mip_size, &blocks);
+  image = vmsvga_surface_offset(surf, dma.host.face, dma.host.mipmap);
+  host_pitch = svga3dsurface_calculate_pitch(desc, &mip_size);
+  host_slice = host_pitch * blocks.height;
+  guest_pitch = (dma.guest.pitch > 0) ? dma.guest.pitch : host_pitch;
+  guest_slice = (uint64_t)guest_pitch * blocks.height;
+  run.gmr_id = dma.guest.ptr.gmrId;
+  run.len = 0;
+  for (i = 0; i < boxes; i++) {
+    for (j = 0; j < sizeof(box) / sizeof(uint32_t); j++) {
+      ((uint32_t *)&box)[j] =
+          vmsvga_fifo_peek(s, fixed + (i * sizeof(box) / sizeof(uint32_t)) + j);
+    };
+    // boxes are in pixels, clip them to the mip and round out to blocks
+    if (box.x >= mip_size.width || box.y >= mip_size.height ||
+        box.z >= mip_size.depth) {
+      continue;
+    };
+    box.w = MIN(box.w, mip_size.width - box.x);
+    box.h = MIN(box.h, mip_size.height - box.y);
+    box.d = MIN(box.d, mip_size.depth - box.z);
+    if (box.w < 1 || box.h < 1 || box.d < 1) {
+      continue;
+    };
+    bx = box.x / desc->block_size.width;
+    by = box.y / desc->block_size.height;
+    cols = DIV_ROUND_UP(box.x + box.w, desc->block_size.width) - bx;
+    rows = DIV_ROUND_UP(box.y + box.h, desc->block_size.height) - by;
+    row_bytes = cols * desc->bytes_per_block;
+    // guest offsets stay relative to the GuestPtr so maximumOffset applies
+    guest = (box.srcz * guest_slice) +
+            ((uint64_t)(box.srcy / desc->block_size.height) * guest_pitch) +
+            ((uint64_t)(box.srcx / desc->block_size.width) *
+             desc->bytes_per_block);
+    host = image + (box.z * host_slice) + (by * host_pitch) +
+           (bx * desc->bytes_per_block);
+    // boxes spanning whole rows on both sides move as one block, anything
+    // narrower goes row by row so texels and guest memory beside the box
+    // stay untouched
+    step = 1;
+    span = row_bytes;
+    if (guest_pitch == host_pitch && row_bytes == host_pitch && bx == 0 &&
+        box.srcx < desc->block_size.width) {
+      step = rows;
+      span = rows * host_pitch;
+    };
+    for (z = 0; z < box.d; z++) {
+      for (y = 0; y < rows; y += step) {
+        if (guest + (z * guest_slice) + (y * (uint64_t)guest_pitch) + span >
+            suffix.maximumOffset) {
+          break;
+        };
+        vmsvga_dma_queue(s, &run, data, to_host,
+                         dma.guest.ptr.offset + guest + (z * guest_slice) +
+                             (y * (uint64_t)guest_pitch),
+                         host + (z * host_slice) + (y * host_pitch), span);
+      };
+    };
+  };
+  vmsvga_dma_flush(s, &run, data, to_host);
+};
+static void vmsvga_surface_reset(struct vmsvga_state_s *s) {
+  g_hash_table_remove_all(s->surfaces);
+  vmsvga_arena_trim(s);
+};
+#include "vmware_vga_shader.c.inc"
+static uint64_t vmsvga_shader_hash(uint32_t type, const uint32_t *tok,
+                                   uint32_t count) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  uint32_t i;
+  hash = (hash ^ type) * 0x100000001b3ULL;
+  for (i = 0; i < count; i++) {
+    hash = (hash ^ tok[i]) * 0x100000001b3ULL;
+  };
+  return hash;
+};
+static void vmsvga_shader_free(gpointer data) {
+  struct vmsvga_shader_s *sh = data;
+  sh->s->shader_cache_bytes -= sh->bytes;
+  g_free(sh->tokens);
+  g_free(sh->glsl);
+  g_free(sh);
+};
+// Context tables only hold references, the cache owns the entries
+static void vmsvga_shader_unref(gpointer data) {
+  struct vmsvga_shader_s *sh = data;
+  sh->refs--;
+};
+static gboolean vmsvga_shader_idle(gpointer key, gpointer value,
+                                   gpointer opaque) {
+  struct vmsvga_shader_s *sh = value;
+  return sh->refs == 0;
+};
+// Referenced entries cannot be dropped, so once they alone fill the cache
+// new shaders are refused instead of growing it without bound
+static bool vmsvga_shader_room(struct vmsvga_state_s *s, uint64_t bytes) {
+  if (g_hash_table_size(s->shader_cache) < VMSVGA_SHADER_CACHE_MAX &&
+      s->shader_cache_bytes + bytes <= VMSVGA_SHADER_CACHE_BYTES) {
+    return true;
+  };
+  g_hash_table_foreach_remove(s->shader_cache, vmsvga_shader_idle, NULL);
+  return g_hash_table_size(s->shader_cache) < VMSVGA_SHADER_CACHE_MAX &&
+         s->shader_cache_bytes + bytes <= VMSVGA_SHADER_CACHE_BYTES;
+};
+// Entries of the on-disk cache hold translator output and are shared by
+// every VM of the host user, so the file name carries the translator
+// version and the tokens are compared before an entry is trusted
+struct vmsvga_shader_file_s {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t type;
+  uint32_t words;
+  uint32_t glsl_len;
+};
+// Disk lookups and writes go to the shader I/O thread, the FIFO worker
+// never waits on the filesystem while it holds fifo_lock. A lookup carries
+// the tokens and comes back with the GLSL on a hit, a write carries the
+// whole file
+struct vmsvga_shader_job_s {
+  uint64_t hash;
+  uint32_t type;
+  uint32_t words;
+  uint32_t *tokens;
+  char *path;
+  char *data;
+  gsize size;
+  char *glsl;
+};
+struct vmsvga_shader_entry_s {
+  char *path;
+  int64_t mtime;
+  uint64_t size;
+};
+static void vmsvga_shader_job_free(struct vmsvga_shader_job_s *job) {
+  g_free(job->tokens);
+  g_free(job->path);
+  g_free(job->data);
+  g_free(job->glsl);
+  g_free(job);
+};
+static char *vmsvga_shader_path(struct vmsvga_state_s *s,
+                                struct vmsvga_shader_s *sh) {
+  char *name;
+  char *path;
+  name = g_strdup_printf("%016" PRIx64 "-%u.shader", sh->hash,
+                         VMSVGA_SHADER_VERSION);
+  path = g_build_filename(s->shader_cache_dir, name, NULL);
+  g_free(name);
+  return path;
+};
+// Queue full means the disk is far behind, the caller goes on without it
+static bool vmsvga_shader_io_queue(struct vmsvga_state_s *s,
+                                   struct vmsvga_shader_job_s *job) {
+  bool queued = false;
+  qemu_mutex_lock(&s->shader_io_lock);
+  if (g_queue_get_length(&s->shader_io_todo) < VMSVGA_SHADER_IO_MAX) {
+    g_queue_push_tail(&s->shader_io_todo, job);
+    queued = true;
+  };
+  qemu_mutex_unlock(&s->shader_io_lock);
+  if (queued) {
+    qemu_event_set(&s->shader_io_event);
+  };
+  return queued;
+};
+static int vmsvga_shader_entry_cmp(gconstpointer a, gconstpointer b) {
+  const struct vmsvga_shader_entry_s *x = a;
+  const struct vmsvga_shader_entry_s *y = b;
+  return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+};
+// Lookups touch the entries they hit, so removing the oldest mtime first
+// drops what no VM of the user has asked for in the longest time. Trims
+// to 3/4 of shader-cache-size-mb so a full cache is not rescanned on every
+// write
+static void vmsvga_shader_io_trim(struct vmsvga_state_s *s) {
+  VPRINT("vmsvga_shader_io_trim was just executed\n");
+  struct vmsvga_shader_entry_s entry;
+  struct vmsvga_shader_entry_s *e;
+  uint64_t limit = (uint64_t)s->shader_cache_size_mb << 20;
+  uint64_t total = 0;
+  GArray *entries;
+  GStatBuf st;
+  const char *name;
+  GDir *dir;
+  uint32_t i;
+  dir = g_dir_open(s->shader_cache_dir, 0, NULL);
+  if (dir == NULL) {
+    return;
+  };
+  entries = g_array_new(FALSE, FALSE, sizeof(entry));
+  while ((name = g_dir_read_name(dir)) != NULL) {
+    if (!g_str_has_suffix(name, ".shader")) {
+      continue;
+    };
+    entry.path = g_build_filename(s->shader_cache_dir, name, NULL);
+    if (g_stat(entry.path, &st) < 0 || !S_ISREG(st.st_mode)) {
+      g_free(entry.path);
+      continue;
+    };
+    entry.mtime = st.st_mtime;
+    entry.size = st.st_size;
+    total += entry.size;
+    g_array_append_val(entries, entry);
+  };
+  g_dir_close(dir);
+  if (total > limit) {
+    g_array_sort(entries, vmsvga_shader_entry_cmp);
+    for (i = 0; i < entries->len && total > (limit / 4) * 3; i++) {
+      e = &g_array_index(entries, struct vmsvga_shader_entry_s, i);
+      if (g_unlink(e->path) == 0) {
+        total -= e->size;
+        s->shader_disk_evictions++;
+      };
+    };
+  };
+  for (i = 0; i < entries->len; i++) {
+    g_free(g_array_index(entries, struct vmsvga_shader_entry_s, i).path);
+  };
+  g_array_free(entries, TRUE);
+  s->shader_disk_bytes = total;
+};
+static void vmsvga_shader_io_load(struct vmsvga_state_s *s,
+                                  struct vmsvga_shader_job_s *job) {
+  VPRINT("vmsvga_shader_io_load was just executed\n");
+  struct vmsvga_shader_file_s hdr;
+  const uint32_t *tok;
+  char *data = NULL;
+  gsize size = 0;
+  uint64_t need;
+  uint32_t i;
+  if (!g_file_get_contents(job->path, &data, &size, NULL) ||
+      size < sizeof(hdr)) {
+    goto out;
+  };
+  memcpy(&hdr, data, sizeof(hdr));
+  need = sizeof(hdr) + (uint64_t)le32_to_cpu(hdr.words) * sizeof(uint32_t) +
+         le32_to_cpu(hdr.glsl_len);
+  if (le32_to_cpu(hdr.magic) != VMSVGA_SHADER_MAGIC ||
+      le32_to_cpu(hdr.version) != VMSVGA_SHADER_VERSION ||
+      le32_to_cpu(hdr.type) != job->type ||
+      le32_to_cpu(hdr.words) != job->words || le32_to_cpu(hdr.glsl_len) < 1 ||
+      need != size) {
+    goto out;
+  };
+  tok = (const uint32_t *)(data + sizeof(hdr));
+  for (i = 0; i < job->words; i++) {
+    if (le32_to_cpu(tok[i]) != job->tokens[i]) {
+      goto out;
+    };
+  };
+  job->glsl =
+      g_strndup((const char *)(tok + job->words), le32_to_cpu(hdr.glsl_len));
+  // used again, keep it away from the trim
+  g_utime(job->path, NULL);
+out:
+  g_free(data);
+};
+// Written through a rename, so VMs racing on the same entry never see a
+// partial file
+static void vmsvga_shader_io_store(struct vmsvga_state_s *s,
+                                   struct vmsvga_shader_job_s *job) {
+  VPRINT("vmsvga_shader_io_store was just executed\n");
+  if (g_file_set_contents(job->path, job->data, job->size, NULL)) {
+    s->shader_disk_writes++;
+    s->shader_disk_bytes += job->size;
+  };
+  if (s->shader_disk_bytes > ((uint64_t)s->shader_cache_size_mb << 20)) {
+    vmsvga_shader_io_trim(s);
+  };
+};
+static void *vmsvga_shader_io(void *arg) {
+  struct vmsvga_state_s *s = arg;
+  struct vmsvga_shader_job_s *job;
+  vmsvga_shader_io_trim(s);
+  while (true) {
+    qemu_event_wait(&s->shader_io_event);
+    qemu_event_reset(&s->shader_io_event);
+    while (true) {
+      qemu_mutex_lock(&s->shader_io_lock);
+      job = g_queue_pop_head(&s->shader_io_todo);
+      qemu_mutex_unlock(&s->shader_io_lock);
+      if (job == NULL) {
+        break;
+      };
+      if (job->data != NULL) {
+        vmsvga_shader_io_store(s, job);
+        vmsvga_shader_job_free(job);
+        continue;
+      };
+      vmsvga_shader_io_load(s, job);
+      qemu_mutex_lock(&s->shader_io_lock);
+      g_queue_push_tail(&s->shader_io_done, job);
+      qemu_mutex_unlock(&s->shader_io_lock);
+      qatomic_set(&s->shader_io_ready, 1);
+      qemu_event_set(&s->fifo_event);
+    };
+  };
+  return NULL;
+};
+static void vmsvga_shader_store(struct vmsvga_state_s *s,
+                                struct vmsvga_shader_s *sh) {
+  VPRINT("vmsvga_shader_store was just executed\n");
+  struct vmsvga_shader_file_s hdr;
+  struct vmsvga_shader_job_s *job;
+  uint32_t *tok;
+  uint32_t glsl_len = strlen(sh->glsl);
+  uint32_t i;
+  hdr.magic = cpu_to_le32(VMSVGA_SHADER_MAGIC);
+  hdr.version = cpu_to_le32(VMSVGA_SHADER_VERSION);
+  hdr.type = cpu_to_le32(sh->type);
+  hdr.words = cpu_to_le32(sh->words);
+  hdr.glsl_len = cpu_to_le32(glsl_len);
+  job = g_new0(struct vmsvga_shader_job_s, 1);
+  job->size = sizeof(hdr) + sh->words * sizeof(uint32_t) + glsl_len;
+  job->data = g_malloc(job->size);
+  memcpy(job->data, &hdr, sizeof(hdr));
+  tok = (uint32_t *)(job->data + sizeof(hdr));
+  for (i = 0; i < sh->words; i++) {
+    tok[i] = cpu_to_le32(sh->tokens[i]);
+  };
+  memcpy(tok + sh->words, sh->glsl, glsl_len);
+  job->path = vmsvga_shader_path(s, sh);
+  if (!vmsvga_shader_io_queue(s, job)) {
+    vmsvga_shader_job_free(job);
+  };
+};
+// Fills in the GLSL of a cache entry, glsl is what the disk cache returned
+// or NULL to run the translator. The caller holds a reference so making
+// room never drops the entry itself
+static void vmsvga_shader_translate(struct vmsvga_state_s *s,
+                                    struct vmsvga_shader_s *sh, char *glsl) {
+  bool translated = false;
+  uint64_t bytes;
+  int64_t start;
+  if (glsl == NULL) {
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    glsl = (sh->type & VMSVGA_SHADER_DX)
+               ? vmsvga_dx_translate(sh->type & 0xff, sh->tokens, sh->words)
+               : vmsvga_sm_translate(sh->type, sh->tokens, sh->words);
+    s->shader_translate_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    translated = true;
+  };
+  if (glsl == NULL) {
+    s->shader_failures++;
+    return;
+  };
+  bytes = strlen(glsl);
+  if (!vmsvga_shader_room(s, bytes)) {
+    s->shader_failures++;
+    g_free(glsl);
+    return;
+  };
+  sh->glsl = glsl;
+  sh->bytes += bytes;
+  s->shader_cache_bytes += bytes;
+  if (translated && s->shader_cache_dir != NULL) {
+    vmsvga_shader_store(s, sh);
+  };
+};
+// Called with fifo_lock held. Entries dropped or replaced since the lookup
+// was queued just discard the answer
+static void vmsvga_shader_io_apply(struct vmsvga_state_s *s) {
+  VPRINT("vmsvga_shader_io_apply was just executed\n");
+  struct vmsvga_shader_job_s *job;
+  struct vmsvga_shader_s *sh;
+  GQueue done;
+  qatomic_set(&s->shader_io_ready, 0);
+  qemu_mutex_lock(&s->shader_io_lock);
+  done = s->shader_io_done;
+  g_queue_init(&s->shader_io_done);
+  qemu_mutex_unlock(&s->shader_io_lock);
+  while ((job = g_queue_pop_head(&done)) != NULL) {
+    sh = g_hash_table_lookup(s->shader_cache, &job->hash);
+    if (sh != NULL && sh->disk_pending && sh->type == job->type &&
+        sh->words == job->words &&
+        memcmp(sh->tokens, job->tokens, job->words * sizeof(uint32_t)) == 0) {
+      sh->disk_pending = false;
+      if (job->glsl != NULL) {
+        s->shader_disk_hits++;
+      };
+      sh->refs++;
+      vmsvga_shader_translate(s, sh, job->glsl);
+      job->glsl = NULL;
+      sh->refs--;
+    };
+    vmsvga_shader_job_free(job);
+  };
+};
+// With a shader-cache-dir the translation waits for the disk lookup, a hit
+// takes the GLSL from there instead. Returns false when the I/O thread is
+// too far behind to ask
+static bool vmsvga_shader_lookup(struct vmsvga_state_s *s,
+                                 struct vmsvga_shader_s *sh) {
+  struct vmsvga_shader_job_s *job = g_new0(struct vmsvga_shader_job_s, 1);
+  job->hash = sh->hash;
+  job->type = sh->type;
+  job->words = sh->words;
+  job->tokens = g_memdup2(sh->tokens, MAX(sh->words, 1) * sizeof(uint32_t));
+  job->path = vmsvga_shader_path(s, sh);
+  if (!vmsvga_shader_io_queue(s, job)) {
+    vmsvga_shader_job_free(job);
+    return false;
+  };
+  sh->disk_pending = true;
+  return true;
+};
+// Looks the tokens up by content and translates them on a miss, failures
+// are cached as well so a broken shader is only tried once. With a
+// shader-cache-dir the GLSL survives the VM and a miss asks the disk
+// before translating. Takes ownership of tokens and returns a new
+// reference
+static struct vmsvga_shader_s *vmsvga_shader_get(struct vmsvga_state_s *s,
+                                                 uint32_t type,
+                                                 uint32_t *tokens,
+                                                 uint32_t count) {
+  VPRINT("vmsvga_shader_get was just executed\n");
+  struct vmsvga_shader_s *sh;
+  uint64_t hash = vmsvga_shader_hash(type, tokens, count);
+  sh = g_hash_table_lookup(s->shader_cache, &hash);
+  if (sh != NULL && sh->type == type && sh->words == count &&
+      memcmp(sh->tokens, tokens, count * sizeof(uint32_t)) == 0) {
+    s->shader_hits++;
+    sh->refs++;
+    g_free(tokens);
+    return sh;
+  };
+  if (sh != NULL) {
+    // hash collision, only an unused entry can make room
+    if (sh->refs > 0) {
+      s->shader_failures++;
+      g_free(tokens);
+      return NULL;
+    };
+    g_hash_table_remove(s->shader_cache, &hash);
+  };
+  s->shader_misses++;
+  if (!vmsvga_shader_room(s, count * sizeof(uint32_t))) {
+    s->shader_failures++;
+    g_free(tokens);
+    return NULL;
+  };
+  sh = g_new0(struct vmsvga_shader_s, 1);
+  sh->s = s;
+  sh->hash = hash;
+  sh->type = type;
+  sh->words = count;
+  sh->tokens = tokens;
+  sh->bytes = count * sizeof(uint32_t);
+  s->shader_cache_bytes += sh->bytes;
+  g_hash_table_insert(s->shader_cache, &sh->hash, sh);
+  sh->refs++;
+  if (s->shader_cache_dir == NULL || !vmsvga_shader_lookup(s, sh)) {
+    vmsvga_shader_translate(s, sh, NULL);
+  };
+  return sh;
+};
+// Legacy SVGA3D contexts. The decoder keeps the state the guest sets, the
+// render backend reads it when a clear, draw or present has to happen
+static void vmsvga_context_destroy(struct vmsvga_state_s *s, uint32_t cid) {
+  struct vmsvga_context_s *ctx;
+  uint32_t i;
+  if (cid >= SVGA3D_MAX_CONTEXT_IDS || s->context[cid] == NULL) {
+    return;
+  };
+  ctx = s->context[cid];
+  if (s->render != NULL && s->render->context_destroy != NULL) {
+    s->render->context_destroy(s, ctx);
+  };
+  for (i = 0; i < SVGA3D_NUM_SHADERTYPE_PREDX; i++) {
+    if (ctx->shader[i] != NULL) {
+      vmsvga_shader_unref(ctx->shader[i]);
+    };
+  };
+  g_hash_table_destroy(ctx->shaders);
+  s->context[cid] = NULL;
+  s->context_count--;
+  g_free(ctx);
+};
+static void vmsvga_context_dirty_all(struct vmsvga_context_s *ctx) {
+  ctx->dirty = VMSVGA_DIRTY_ALL;
+  memset(ctx->rs_dirty, 0xff, sizeof(ctx->rs_dirty));
+  ctx->ts_dirty = UINT32_MAX;
+  ctx->transform_dirty = UINT32_MAX;
+  ctx->light_dirty = UINT32_MAX;
+  ctx->clip_dirty = UINT32_MAX;
+};
+// Shadow compare for one piece of context state, returns whether it changed
+static inline bool vmsvga_context_set(struct vmsvga_state_s *s,
+                                      struct vmsvga_context_s *ctx, void *dst,
+                                      const void *src, size_t size,
+                                      uint32_t group) {
+  s->state_sets++;
+  if (memcmp(dst, src, size) == 0) {
+    s->state_dropped++;
+    return false;
+  };
+  memcpy(dst, src, size);
+  ctx->dirty |= group;
+  return true;
+};
+static void vmsvga_context_flush(struct vmsvga_state_s *s,
+                                 struct vmsvga_context_s *ctx) {
+  if (ctx->dirty == 0) {
+    return;
+  };
+  if (s->render->flush != NULL) {
+    s->render->flush(s, ctx);
+  };
+  s->state_flushes++;
+  ctx->dirty = 0;
+  memset(ctx->rs_dirty, 0, sizeof(ctx->rs_dirty));
+  ctx->ts_dirty = 0;
+  ctx->transform_dirty = 0;
+  ctx->light_dirty = 0;
+  ctx->clip_dirty = 0;
+};
+static void vmsvga_context_define(struct vmsvga_state_s *s, uint32_t cid) {
+  VPRINT("vmsvga_context_define was just executed\n");
+  struct vmsvga_context_s *ctx;
+  uint32_t i;
+  if (cid >= SVGA3D_MAX_CONTEXT_IDS) {
+    return;
+  };
+  vmsvga_context_destroy(s, cid);
+  ctx = g_new0(struct vmsvga_context_s, 1);
+  ctx->cid = cid;
+  ctx->shaders = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                       vmsvga_shader_unref);
+  for (i = 0; i < SVGA3D_RT_MAX; i++) {
+    ctx->rt[i].sid = SVGA3D_INVALID_ID;
+  };
+  for (i = 0; i < SVGA3D_TRANSFORM_MAX; i++) {
+    ctx->transform[i][0] = 1.0f;
+    ctx->transform[i][5] = 1.0f;
+    ctx->transform[i][10] = 1.0f;
+    ctx->transform[i][15] = 1.0f;
+  };
+  // D3D9 defaults for the states the backends look at
+  ctx->rs[SVGA3D_RS_ZWRITEENABLE] = 1;
+  ctx->rs[SVGA3D_RS_ZFUNC] = SVGA3D_CMP_LESSEQUAL;
+  ctx->rs[SVGA3D_RS_CULLMODE] = SVGA3D_FACE_BACK;
+  ctx->rs[SVGA3D_RS_FRONTWINDING] = SVGA3D_FRONTWINDING_CW;
+  ctx->rs[SVGA3D_RS_SRCBLEND] = SVGA3D_BLENDOP_ONE;
+  ctx->rs[SVGA3D_RS_DSTBLEND] = SVGA3D_BLENDOP_ZERO;
+  ctx->zrange.max = 1.0f;
+  vmsvga_context_dirty_all(ctx);
+  s->context[cid] = ctx;
+  s->context_count++;
+  if (s->render != NULL && s->render->context_define != NULL) {
+    s->render->context_define(s, ctx);
+  };
+};
+static void vmsvga_context_reset(struct vmsvga_state_s *s) {
+  uint32_t i;
+  for (i = 0; i < SVGA3D_MAX_CONTEXT_IDS; i++) {
+    vmsvga_context_destroy(s, i);
+  };
+};
+static inline struct vmsvga_context_s *
+vmsvga_context_lookup(struct vmsvga_state_s *s, uint32_t cid) {
+  return (cid < SVGA3D_MAX_CONTEXT_IDS) ? s->context[cid] : NULL;
+};
+// Writes rows of 32bpp pixels into the legacy GFB or a screen object
+static void vmsvga_present_rows(struct vmsvga_state_s *s, uint32_t offset,
+                                uint32_t pitch, const uint8_t *src,
+                                uint32_t src_pitch, uint32_t w, uint32_t h) {
+  uint32_t y;
+  if (h < 1 || ((uint64_t)offset + ((uint64_t)(h - 1) * pitch) + (w * 4)) >
+                   s->vga.vram_size) {
+    return;
+  };
+  for (y = 0; y < h; y++) {
+    memcpy(s->vga.vram_ptr + offset + (y * pitch), src + (y * src_pitch),
+           w * 4);
+  };
+  memory_region_set_dirty(&s->vga.vram, offset, (hwaddr)h * pitch);
+};
+// SVGA3dCmdPresent copies rectangles of a surface to the virtual desktop,
+// which is the GFB unless screen objects are in use
+static void vmsvga_present(struct vmsvga_state_s *s,
+                           struct vmsvga_surface_s *surf,
+                           const SVGA3dCopyRect *rects, uint32_t count) {
+  VPRINT("vmsvga_present was just executed\n");
+  struct vmsvga_screen_s *scr;
+  const uint8_t *src;
+  SVGASignedRect rect;
+  SVGASignedPoint origin;
+  uint32_t pitch;
+  uint32_t i;
+  uint32_t j;
+  if ((surf->format != SVGA3D_X8R8G8B8 && surf->format != SVGA3D_A8R8G8B8) ||
+      surf->data == NULL) {
+    return;
+  };
+  pitch = surf->size.width * 4;
+  for (i = 0; i < count; i++) {
+    if (rects[i].srcx >= surf->size.width ||
+        rects[i].srcy >= surf->size.height) {
+      continue;
+    };
+    src = surf->data + (rects[i].srcy * pitch) + (rects[i].srcx * 4);
+    if (s->mode_screen < 1) {
+      if (s->mode_depth != 32 || rects[i].x >= s->mode_width ||
+          rects[i].y >= s->mode_height) {
+        continue;
+      };
+      vmsvga_present_rows(
+          s, s->mode_offset + (rects[i].y * s->mode_stride) + (rects[i].x * 4),
+          s->mode_stride, src, pitch,
+          MIN(MIN(rects[i].w, s->mode_width - rects[i].x),
+              surf->size.width - rects[i].srcx),
+          MIN(MIN(rects[i].h, s->mode_height - rects[i].y),
+              surf->size.height - rects[i].srcy));
+      continue;
+    };
+    for (j = 0; j < s->num_screens; j++) {
+      scr = &s->screen[j];
+      if (!vmsvga_screen_live(scr)) {
+        continue;
+      };
+      rect.left = (int64_t)rects[i].x - scr->root_x;
+      rect.top = (int64_t)rects[i].y - scr->root_y;
+      rect.right = rect.left + MIN(rects[i].w, surf->size.width - rects[i].srcx);
+      rect.bottom =
+          rect.top + MIN(rects[i].h, surf->size.height - rects[i].srcy);
+      origin.x = 0;
+      origin.y = 0;
+      if (!vmsvga_screen_clip(scr, &rect, &origin)) {
+        continue;
+      };
+      vmsvga_present_rows(s,
+                          scr->offset + (rect.top * scr->pitch) +
+                              (rect.left * 4),
+                          scr->pitch, src + (origin.y * pitch) + (origin.x * 4),
+                          pitch, rect.right - rect.left,
+                          rect.bottom - rect.top);
+    };
+  };
+};
+// The CPU backend renders straight into the surface store. A target is one
+// face and mip of a surface in a format it knows how to write
+struct vmsvga_cpu_target_s {
+  uint8_t *base;
+  uint32_t format;
+  uint32_t pitch;
+  uint32_t width;
+  uint32_t height;
+  uint32_t bpp;
+};
+struct vmsvga_cpu_context_s {
+  float mvp[16];
+};
+struct vmsvga_cpu_vertex_s {
+  float x;
+  float y;
+  float z;
+  float c[4];
+};
+static bool vmsvga_cpu_target(struct vmsvga_state_s *s,
+                              SVGA3dSurfaceImageId *id, bool depth,
+                              struct vmsvga_cpu_target_s *t) {
+  struct vmsvga_surface_s *surf = vmsvga_surface_lookup(s, id->sid);
+  SVGA3dSize size;
+  uint8_t *data;
+  if (surf == NULL || id->face >= surf->faces || id->mipmap >= surf->mips) {
+    return false;
+  };
+  switch (surf->format) {
+  case SVGA3D_X8R8G8B8:
+  case SVGA3D_A8R8G8B8:
+    t->bpp = depth ? 0 : 4;
+    break;
+  case SVGA3D_R5G6B5:
+    t->bpp = depth ? 0 : 2;
+    break;
+  case SVGA3D_Z_D16:
+    t->bpp = depth ? 2 : 0;
+    break;
+  case SVGA3D_Z_D32:
+  case SVGA3D_Z_D24S8:
+  case SVGA3D_Z_D24X8:
+    t->bpp = depth ? 4 : 0;
+    break;
+  default:
+    t->bpp = 0;
+    break;
+  };
+  if (t->bpp < 1) {
+    VPRINT("vmsvga_cpu_target: format %u not renderable\n", surf->format);
+    return false;
+  };
+  data = vmsvga_surface_data(s, surf, false);
+  if (data == NULL) {
+    return false;
+  };
+  size = svga3dsurface_get_mip_size(surf->size, id->mipmap);
+  t->format = surf->format;
+  t->width = size.width;
+  t->height = size.height;
+  t->pitch = size.width * t->bpp;
+  t->base = data + vmsvga_surface_offset(surf, id->face, id->mipmap);
+  return true;
+};
+static inline uint32_t vmsvga_cpu_get_color(struct vmsvga_cpu_target_s *t,
+                                            uint32_t x, uint32_t y) {
+  uint8_t *p = t->base + (y * t->pitch) + (x * t->bpp);
+  uint32_t v;
+  if (t->bpp == 2) {
+    v = lduw_le_p(p);
+    return 0xff000000 | ((v & 0xf800) << 8) | ((v & 0xe000) << 3) |
+           ((v & 0x07e0) << 5) | ((v & 0x0600) >> 1) | ((v & 0x001f) << 3) |
+           ((v & 0x001c) >> 2);
+  };
+  v = ldl_le_p(p);
+  return (t->format == SVGA3D_X8R8G8B8) ? (v | 0xff000000) : v;
+};
+static inline void vmsvga_cpu_put_color(struct vmsvga_cpu_target_s *t,
+                                        uint32_t x, uint32_t y,
+                                        uint32_t argb) {
+  uint8_t *p = t->base + (y * t->pitch) + (x * t->bpp);
+  if (t->bpp == 2) {
+    stw_le_p(p, ((argb >> 8) & 0xf800) | ((argb >> 5) & 0x07e0) |
+                    ((argb >> 3) & 0x001f));
+  } else {
+    stl_le_p(p, argb);
+  };
+};
+static inline float vmsvga_cpu_get_depth(struct vmsvga_cpu_target_s *t,
+                                         uint32_t x, uint32_t y) {
+  uint8_t *p = t->base + (y * t->pitch) + (x * t->bpp);
+  switch (t->format) {
+  case SVGA3D_Z_D16:
+    return lduw_le_p(p) / 65535.0f;
+  case SVGA3D_Z_D32:
+    return (float)(ldl_le_p(p) / 4294967295.0);
+  default:
+    return (ldl_le_p(p) >> 8) / 16777215.0f;
+  };
+};
+static inline void vmsvga_cpu_put_depth(struct vmsvga_cpu_target_s *t,
+                                        uint32_t x, uint32_t y, float z) {
+  uint8_t *p = t->base + (y * t->pitch) + (x * t->bpp);
+  z = MIN(MAX(z, 0.0f), 1.0f);
+  switch (t->format) {
+  case SVGA3D_Z_D16:
+    stw_le_p(p, (uint16_t)(z * 65535.0f + 0.5f));
+    break;
+  case SVGA3D_Z_D32:
+    stl_le_p(p, (uint32_t)(z * 4294967295.0 + 0.5));
+    break;
+  default:
+    stl_le_p(p, ((uint32_t)(z * 16777215.0f + 0.5f) << 8) |
+                    (ldl_le_p(p) & 0xff));
+    break;
+  };
+};
+static inline void vmsvga_cpu_put_stencil(struct vmsvga_cpu_target_s *t,
+                                          uint32_t x, uint32_t y,
+                                          uint32_t stencil) {
+  uint8_t *p = t->base + (y * t->pitch) + (x * t->bpp);
+  if (t->format == SVGA3D_Z_D24S8) {
+    stl_le_p(p, (ldl_le_p(p) & 0xffffff00) | (stencil & 0xff));
+  };
+};
+// Intersects the target with the viewport and, when enabled, the scissor
+static void vmsvga_cpu_bounds(struct vmsvga_context_s *ctx,
+                              struct vmsvga_cpu_target_s *t,
+                              SVGA3dRect *clip) {
+  uint64_t right = t->width;
+  uint64_t bottom = t->height;
+  clip->x = 0;
+  clip->y = 0;
+  if (ctx->viewport.w > 0 && ctx->viewport.h > 0) {
+    clip->x = ctx->viewport.x;
+    clip->y = ctx->viewport.y;
+    right = MIN(right, (uint64_t)ctx->viewport.x + ctx->viewport.w);
+    bottom = MIN(bottom, (uint64_t)ctx->viewport.y + ctx->viewport.h);
+  };
+  if (ctx->rs[SVGA3D_RS_SCISSORTESTENABLE]) {
+    clip->x = MAX(clip->x, ctx->scissor.x);
+    clip->y = MAX(clip->y, ctx->scissor.y);
+    right = MIN(right, (uint64_t)ctx->scissor.x + ctx->scissor.w);
+    bottom = MIN(bottom, (uint64_t)ctx->scissor.y + ctx->scissor.h);
+  };
+  clip->w = (right > clip->x) ? right - clip->x : 0;
+  clip->h = (bottom > clip->y) ? bottom - clip->y : 0;
+};
+static void vmsvga_cpu_clear(struct vmsvga_state_s *s,
+                             struct vmsvga_context_s *ctx,
+                             const SVGA3dCmdClear *clear,
+                             const SVGA3dRect *rects, uint32_t count) {
+  VPRINT("vmsvga_cpu_clear was just executed\n");
+  struct vmsvga_cpu_target_s color;
+  struct vmsvga_cpu_target_s depth;
+  struct vmsvga_cpu_target_s *t;
+  SVGA3dRect bounds;
+  SVGA3dRect whole;
+  uint64_t right;
+  uint64_t bottom;
+  uint32_t x0;
+  uint32_t y0;
+  uint32_t x;
+  uint32_t y;
+  uint32_t i;
+  bool has_color = (clear->clearFlag & SVGA3D_CLEAR_COLOR) &&
+                   vmsvga_cpu_target(s, &ctx->rt[SVGA3D_RT_COLOR0], false,
+                                     &color);
+  bool has_depth = (clear->clearFlag &
+                    (SVGA3D_CLEAR_DEPTH | SVGA3D_CLEAR_STENCIL)) &&
+                   vmsvga_cpu_target(s, &ctx->rt[SVGA3D_RT_DEPTH], true,
+                                     &depth);
+  if (!has_color && !has_depth) {
+    return;
+  };
+  t = has_color ? &color : &depth;
+  vmsvga_cpu_bounds(ctx, t, &bounds);
+  if (count < 1) {
+    whole = bounds;
+    rects = &whole;
+    count = 1;
+  };
+  for (i = 0; i < count; i++) {
+    x0 = MAX(rects[i].x, bounds.x);
+    y0 = MAX(rects[i].y, bounds.y);
+    right = MIN((uint64_t)rects[i].x + rects[i].w,
+                (uint64_t)bounds.x + bounds.w);
+    bottom = MIN((uint64_t)rects[i].y + rects[i].h,
+                 (uint64_t)bounds.y + bounds.h);
+    if (has_depth) {
+      right = MIN(right, depth.width);
+      bottom = MIN(bottom, depth.height);
+    };
+    for (y = y0; y < bottom; y++) {
+      for (x = x0; x < right; x++) {
+        if (has_color) {
+          vmsvga_cpu_put_color(&color, x, y, clear->color);
+        };
+        if (has_depth && (clear->clearFlag & SVGA3D_CLEAR_DEPTH)) {
+          vmsvga_cpu_put_depth(&depth, x, y, clear->depth);
+        };
+        if (has_depth && (clear->clearFlag & SVGA3D_CLEAR_STENCIL)) {
+          vmsvga_cpu_put_stencil(&depth, x, y, clear->stencil);
+        };
+      };
+    };
+  };
+};
+// Reads one vertex element as four floats, missing components default to
+// (0, 0, 0, 1) like the D3D9 input assembler
+static void vmsvga_cpu_fetch(struct vmsvga_state_s *s,
+                             const SVGA3dVertexDecl *decl, uint32_t index,
+                             float out[4]) {
+  struct vmsvga_surface_s *surf = vmsvga_surface_lookup(s, decl->array.surfaceId);
+  uint64_t offset = (uint64_t)decl->array.offset +
+                    ((uint64_t)index * decl->array.stride);
+  uint32_t count = 0;
+  uint32_t v;
+  uint32_t i;
+  out[0] = 0.0f;
+  out[1] = 0.0f;
+  out[2] = 0.0f;
+  out[3] = 1.0f;
+  if (surf == NULL || surf->data == NULL) {
+    return;
+  };
+  if (decl->identity.type == SVGA3D_DECLTYPE_D3DCOLOR) {
+    if (offset + 4 > surf->bytes) {
+      return;
+    };
+    v = ldl_le_p(surf->data + offset);
+    out[0] = ((v >> 16) & 0xff) / 255.0f;
+    out[1] = ((v >> 8) & 0xff) / 255.0f;
+    out[2] = (v & 0xff) / 255.0f;
+    out[3] = ((v >> 24) & 0xff) / 255.0f;
+    return;
+  };
+  if (decl->identity.type <= SVGA3D_DECLTYPE_FLOAT4) {
+    count = decl->identity.type + 1;
+  };
+  if (offset + (count * 4) > surf->bytes) {
+    return;
+  };
+  for (i = 0; i < count; i++) {
+    v = ldl_le_p(surf->data + offset + (i * 4));
+    memcpy(&out[i], &v, sizeof(float));
+  };
+};
+static inline float vmsvga_cpu_blend(uint32_t op, const float src[4],
+                                     const float dst[4], uint32_t c) {
+  switch (op) {
+  case SVGA3D_BLENDOP_ZERO:
+    return 0.0f;
+  case SVGA3D_BLENDOP_SRCCOLOR:
+    return src[c];
+  case SVGA3D_BLENDOP_INVSRCCOLOR:
+    return 1.0f - src[c];
+  case SVGA3D_BLENDOP_SRCALPHA:
+    return src[3];
+  case SVGA3D_BLENDOP_INVSRCALPHA:
+    return 1.0f - src[3];
+  case SVGA3D_BLENDOP_DESTALPHA:
+    return dst[3];
+  case SVGA3D_BLENDOP_INVDESTALPHA:
+    return 1.0f - dst[3];
+  case SVGA3D_BLENDOP_DESTCOLOR:
+    return dst[c];
+  case SVGA3D_BLENDOP_INVDESTCOLOR:
+    return 1.0f - dst[c];
+  default:
+    return 1.0f;
+  };
+};
+static inline bool vmsvga_cpu_compare(uint32_t func, float a, float b) {
+  switch (func) {
+  case SVGA3D_CMP_NEVER:
+    return false;
+  case SVGA3D_CMP_LESS:
+    return a < b;
+  case SVGA3D_CMP_EQUAL:
+    return a == b;
+  case SVGA3D_CMP_LESSEQUAL:
+    return a <= b;
+  case SVGA3D_CMP_GREATER:
+    return a > b;
+  case SVGA3D_CMP_NOTEQUAL:
+    return a != b;
+  case SVGA3D_CMP_GREATEREQUAL:
+    return a >= b;
+  default:
+    return true;
+  };
+};
+static inline uint32_t vmsvga_cpu_pack(const float c[4]) {
+  uint32_t argb = 0;
+  uint32_t i;
+  static const uint32_t shift[4] = {16, 8, 0, 24};
+  for (i = 0; i < 4; i++) {
+    argb |= (uint32_t)(MIN(MAX(c[i], 0.0f), 1.0f) * 255.0f + 0.5f) << shift[i];
+  };
+  return argb;
+};
+// Bounding boxes come from guest floats, keep them well inside int64_t
+static inline int64_t vmsvga_cpu_coord(float f) {
+  if (!(f > -1e9f)) {
+    return -1000000000;
+  };
+  if (!(f < 1e9f)) {
+    return 1000000000;
+  };
+  return (int64_t)f - ((f < 0.0f) ? 1 : 0);
+};
+// Half-space rasterizer, pixel centres sit on integer coordinates as in D3D9.
+// Returns the number of pixels to test, a triangle needing more than budget
+// is left undrawn
+static uint64_t vmsvga_cpu_triangle(struct vmsvga_context_s *ctx,
+                                    struct vmsvga_cpu_target_s *color,
+                                    struct vmsvga_cpu_target_s *depth,
+                                    const SVGA3dRect *clip,
+                                    const struct vmsvga_cpu_vertex_s *v0,
+                                    const struct vmsvga_cpu_vertex_s *v1,
+                                    const struct vmsvga_cpu_vertex_s *v2,
+                                    uint64_t budget) {
+  float area = ((v1->x - v0->x) * (v2->y - v0->y)) -
+               ((v2->x - v0->x) * (v1->y - v0->y));
+  float src[4];
+  float dst[4];
+  float b0;
+  float b1;
+  float b2;
+  float z;
+  uint32_t cull = ctx->rs[SVGA3D_RS_CULLMODE];
+  uint32_t argb;
+  int64_t min_x;
+  int64_t min_y;
+  int64_t max_x;
+  int64_t max_y;
+  int64_t x;
+  int64_t y;
+  uint64_t pixels;
+  uint32_t c;
+  bool front;
+  if (!(area > 0.0f || area < 0.0f)) {
+    return 0;
+  };
+  // area is positive for clockwise triangles since y grows downwards
+  front = (area > 0.0f) ==
+          (ctx->rs[SVGA3D_RS_FRONTWINDING] != SVGA3D_FRONTWINDING_CCW);
+  if (cull == SVGA3D_FACE_FRONT_BACK ||
+      (cull == SVGA3D_FACE_FRONT && front) ||
+      (cull == SVGA3D_FACE_BACK && !front)) {
+    return 0;
+  };
+  min_x = MAX(vmsvga_cpu_coord(MIN(MIN(v0->x, v1->x), v2->x)),
+              (int64_t)clip->x);
+  min_y = MAX(vmsvga_cpu_coord(MIN(MIN(v0->y, v1->y), v2->y)),
+              (int64_t)clip->y);
+  max_x = MIN(vmsvga_cpu_coord(MAX(MAX(v0->x, v1->x), v2->x)) + 1,
+              (int64_t)clip->x + clip->w - 1);
+  max_y = MIN(vmsvga_cpu_coord(MAX(MAX(v0->y, v1->y), v2->y)) + 1,
+              (int64_t)clip->y + clip->h - 1);
+  if (max_x < min_x || max_y < min_y) {
+    return 0;
+  };
+  pixels = (uint64_t)(max_x - min_x + 1) * (max_y - min_y + 1);
+  if (pixels > budget) {
+    return pixels;
+  };
+  for (y = min_y; y <= max_y; y++) {
+    for (x = min_x; x <= max_x; x++) {
+      b0 = (((v2->x - v1->x) * (y - v1->y)) - ((v2->y - v1->y) * (x - v1->x))) /
+           area;
+      b1 = (((v0->x - v2->x) * (y - v2->y)) - ((v0->y - v2->y) * (x - v2->x))) /
+           area;
+      b2 = 1.0f - b0 - b1;
+      if (b0 < 0.0f || b1 < 0.0f || b2 < 0.0f) {
+        continue;
+      };
+      if (depth != NULL && ctx->rs[SVGA3D_RS_ZENABLE]) {
+        z = (b0 * v0->z) + (b1 * v1->z) + (b2 * v2->z);
+        if (!vmsvga_cpu_compare(ctx->rs[SVGA3D_RS_ZFUNC], z,
+                                vmsvga_cpu_get_depth(depth, x, y))) {
+          continue;
+        };
+        if (ctx->rs[SVGA3D_RS_ZWRITEENABLE]) {
+          vmsvga_cpu_put_depth(depth, x, y, z);
+        };
+      };
+      for (c = 0; c < 4; c++) {
+        src[c] = (b0 * v0->c[c]) + (b1 * v1->c[c]) + (b2 * v2->c[c]);
+      };
+      if (ctx->rs[SVGA3D_RS_BLENDENABLE]) {
+        argb = vmsvga_cpu_get_color(color, x, y);
+        dst[0] = ((argb >> 16) & 0xff) / 255.0f;
+        dst[1] = ((argb >> 8) & 0xff) / 255.0f;
+        dst[2] = (argb & 0xff) / 255.0f;
+        dst[3] = ((argb >> 24) & 0xff) / 255.0f;
+        for (c = 0; c < 4; c++) {
+          src[c] = (src[c] * vmsvga_cpu_blend(ctx->rs[SVGA3D_RS_SRCBLEND], src,
+                                              dst, c)) +
+                   (dst[c] * vmsvga_cpu_blend(ctx->rs[SVGA3D_RS_DSTBLEND], src,
+                                              dst, c));
+        };
+      };
+      vmsvga_cpu_put_color(color, x, y, vmsvga_cpu_pack(src));
+    };
+  };
+  return pixels;
+};
+static inline void vmsvga_cpu_mul(float out[16], const float a[16],
+                                  const float b[16]) {
+  uint32_t r;
+  uint32_t c;
+  for (r = 0; r < 4; r++) {
+    for (c = 0; c < 4; c++) {
+      out[(r * 4) + c] = (a[r * 4] * b[c]) + (a[(r * 4) + 1] * b[4 + c]) +
+                         (a[(r * 4) + 2] * b[8 + c]) +
+                         (a[(r * 4) + 3] * b[12 + c]);
+    };
+  };
+};
+// Fixed function only, POSITIONT vertices are used as they are and POSITION
+// goes through world, view and projection. Vertices behind the eye drop
+// their triangle rather than being clipped
+static bool vmsvga_cpu_vertex(struct vmsvga_state_s *s,
+                              struct vmsvga_context_s *ctx,
+                              const SVGA3dVertexDecl *decls,
+                              uint32_t num_decls, const float mvp[16],
+                              const SVGA3dRect *vp, uint32_t index,
+                              struct vmsvga_cpu_vertex_s *out) {
+  float pos[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+  float clip[4];
+  bool transformed = false;
+  uint32_t i;
+  out->c[0] = 1.0f;
+  out->c[1] = 1.0f;
+  out->c[2] = 1.0f;
+  out->c[3] = 1.0f;
+  for (i = 0; i < num_decls; i++) {
+    if (decls[i].identity.usageIndex != 0) {
+      continue;
+    };
+    switch (decls[i].identity.usage) {
+    case SVGA3D_DECLUSAGE_POSITIONT:
+      transformed = true;
+      vmsvga_cpu_fetch(s, &decls[i], index, pos);
+      break;
+    case SVGA3D_DECLUSAGE_POSITION:
+      vmsvga_cpu_fetch(s, &decls[i], index, pos);
+      break;
+    case SVGA3D_DECLUSAGE_COLOR:
+      vmsvga_cpu_fetch(s, &decls[i], index, out->c);
+      break;
+    default:
+      break;
+    };
+  };
+  if (transformed) {
+    out->x = pos[0];
+    out->y = pos[1];
+    out->z = pos[2];
+    return true;
+  };
+  for (i = 0; i < 4; i++) {
+    clip[i] = (pos[0] * mvp[i]) + (pos[1] * mvp[4 + i]) +
+              (pos[2] * mvp[8 + i]) + (pos[3] * mvp[12 + i]);
+  };
+  if (!(clip[3] > 0.0f)) {
+    return false;
+  };
+  out->x = vp->x + ((clip[0] / clip[3]) + 1.0f) * vp->w * 0.5f;
+  out->y = vp->y + (1.0f - (clip[1] / clip[3])) * vp->h * 0.5f;
+  out->z = ctx->zrange.min +
+           ((clip[2] / clip[3]) * (ctx->zrange.max - ctx->zrange.min));
+  return true;
+};
+static bool vmsvga_cpu_index(struct vmsvga_state_s *s,
+                             const SVGA3dPrimitiveRange *range, uint32_t i,
+                             uint32_t *index) {
+  struct vmsvga_surface_s *surf;
+  uint64_t offset;
+  if (range->indexArray.surfaceId == SVGA3D_INVALID_ID) {
+    *index = i + range->indexBias;
+    return true;
+  };
+  surf = vmsvga_surface_lookup(s, range->indexArray.surfaceId);
+  offset = (uint64_t)range->indexArray.offset +
+           ((uint64_t)i * range->indexArray.stride);
+  if (surf == NULL || surf->data == NULL ||
+      (range->indexWidth != 2 && range->indexWidth != 4) ||
+      offset + range->indexWidth > surf->bytes) {
+    return false;
+  };
+  *index = ((range->indexWidth == 2) ? lduw_le_p(surf->data + offset)
+                                     : ldl_le_p(surf->data + offset)) +
+           range->indexBias;
+  return true;
+};
+static void vmsvga_cpu_draw(struct vmsvga_state_s *s,
+                            struct vmsvga_context_s *ctx,
+                            const SVGA3dVertexDecl *decls, uint32_t num_decls,
+                            const SVGA3dPrimitiveRange *ranges,
+                            uint32_t num_ranges) {
+  VPRINT("vmsvga_cpu_draw was just executed\n");
+  struct vmsvga_cpu_target_s color;
+  struct vmsvga_cpu_target_s depth;
+  struct vmsvga_cpu_vertex_s v[3];
+  SVGA3dRect clip;
+  SVGA3dRect vp;
+  struct vmsvga_cpu_context_s *cpu = ctx->backend;
+  uint64_t budget = VMSVGA_CPU_DRAW_BUDGET;
+  uint64_t work;
+  uint32_t corner[3];
+  uint32_t index;
+  uint32_t r;
+  uint32_t p;
+  uint32_t k;
+  bool has_depth;
+  bool ok;
+  // shaders are translated but not run here, drawing fixed-function
+  // output in place of a bound shader would be wrong either way
+  for (k = 0; k < ARRAY_SIZE(ctx->shader); k++) {
+    if (ctx->shader[k] != NULL) {
+      VPRINT("vmsvga_cpu_draw: draw with a shader bound skipped\n");
+      return;
+    };
+  };
+  if (!vmsvga_cpu_target(s, &ctx->rt[SVGA3D_RT_COLOR0], false, &color)) {
+    return;
+  };
+  has_depth = vmsvga_cpu_target(s, &ctx->rt[SVGA3D_RT_DEPTH], true, &depth) &&
+              depth.width >= color.width && depth.height >= color.height;
+  vmsvga_cpu_bounds(ctx, &color, &clip);
+  vp = ctx->viewport;
+  if (vp.w < 1 || vp.h < 1) {
+    vp.x = 0;
+    vp.y = 0;
+    vp.w = color.width;
+    vp.h = color.height;
+  };
+  for (r = 0; r < num_ranges; r++) {
+    for (p = 0; p < ranges[r].primitiveCount; p++) {
+      switch (ranges[r].primType) {
+      case SVGA3D_PRIMITIVE_TRIANGLELIST:
+        corner[0] = p * 3;
+        corner[1] = (p * 3) + 1;
+        corner[2] = (p * 3) + 2;
+        break;
+      case SVGA3D_PRIMITIVE_TRIANGLESTRIP:
+        // odd triangles of a strip are flipped to keep their winding
+        corner[0] = p;
+        corner[1] = (p & 1) ? p + 2 : p + 1;
+        corner[2] = (p & 1) ? p + 1 : p + 2;
+        break;
+      case SVGA3D_PRIMITIVE_TRIANGLEFAN:
+        corner[0] = 0;
+        corner[1] = p + 1;
+        corner[2] = p + 2;
+        break;
+      default:
+        VPRINT("vmsvga_cpu_draw: primitive %u not rasterized\n",
+               ranges[r].primType);
+        p = ranges[r].primitiveCount;
+        continue;
+      };
+      ok = true;
+      for (k = 0; k < 3 && ok; k++) {
+        ok = vmsvga_cpu_index(s, &ranges[r], corner[k], &index) &&
+             vmsvga_cpu_vertex(s, ctx, decls, num_decls, cpu->mvp, &vp, index,
+                               &v[k]);
+      };
+      work = 1;
+      if (ok) {
+        work += vmsvga_cpu_triangle(ctx, &color, has_depth ? &depth : NULL,
+                                    &clip, &v[0], &v[1], &v[2], budget - 1);
+      };
+      // this runs on the FIFO worker under fifo_lock, one command must not
+      // keep it there for seconds
+      if (work >= budget) {
+        VPRINT("vmsvga_cpu_draw: draw over budget truncated\n");
+        s->draws_truncated++;
+        return;
+      };
+      budget -= work;
+    };
+  };
+};
+static void vmsvga_cpu_context_define(struct vmsvga_state_s *s,
+                                      struct vmsvga_context_s *ctx) {
+  ctx->backend = g_new0(struct vmsvga_cpu_context_s, 1);
+};
+static void vmsvga_cpu_context_destroy(struct vmsvga_state_s *s,
+                                       struct vmsvga_context_s *ctx) {
+  g_free(ctx->backend);
+  ctx->backend = NULL;
+};
+// Everything but the combined transform is read straight from the context
+static void vmsvga_cpu_flush(struct vmsvga_state_s *s,
+                             struct vmsvga_context_s *ctx) {
+  struct vmsvga_cpu_context_s *cpu = ctx->backend;
+  float wv[16];
+  if (ctx->transform_dirty & ((1u << SVGA3D_TRANSFORM_WORLD) |
+                              (1u << SVGA3D_TRANSFORM_VIEW) |
+                              (1u << SVGA3D_TRANSFORM_PROJECTION))) {
+    vmsvga_cpu_mul(wv, ctx->transform[SVGA3D_TRANSFORM_WORLD],
+                   ctx->transform[SVGA3D_TRANSFORM_VIEW]);
+    vmsvga_cpu_mul(cpu->mvp, wv, ctx->transform[SVGA3D_TRANSFORM_PROJECTION]);
+  };
+};
+static const struct vmsvga_render_ops_s vmsvga_render_cpu = {
+    .name = "cpu",
+    .flush = vmsvga_cpu_flush,
+    .context_define = vmsvga_cpu_context_define,
+    .context_destroy = vmsvga_cpu_context_destroy,
+    .clear = vmsvga_cpu_clear,
+    .draw = vmsvga_cpu_draw,
+    .present = vmsvga_present,
+};
+static const struct vmsvga_render_ops_s *const vmsvga_render_backends[] = {
+    &vmsvga_render_cpu,
+};
+// Context commands of the legacy SVGA3D protocol, words is the payload size
+// from the 3D command header
+static void vmsvga_context_cmd(struct vmsvga_state_s *s, uint32_t cmd,
+                               uint32_t words) {
+  VPRINT("vmsvga_context_cmd was just executed\n");
+  struct vmsvga_context_s *ctx = NULL;
+  struct vmsvga_surface_s *surf;
+  SVGA3dVertexDecl decls[SVGA3D_MAX_VERTEX_ARRAYS];
+  SVGA3dPrimitiveRange ranges[SVGA3D_MAX_DRAW_PRIMITIVE_RANGES];
+  SVGA3dCmdDrawPrimitives draw;
+  SVGA3dCmdSetRenderTarget target;
+  SVGA3dCmdSetTransform transform;
+  SVGA3dCmdClear clear;
+  SVGA3dCmdSetMaterial material;
+  SVGA3dCmdSetLightData light;
+  SVGA3dCmdSetLightEnabled enabled;
+  SVGA3dCmdSetClipPlane plane;
+  SVGA3dCmdSetZRange zrange;
+  SVGA3dCmdSetViewport rect;
+  SVGA3dRenderState state;
+  SVGA3dTextureState texture;
+  SVGA3dCmdDefineShader shader;
+  SVGA3dCmdSetShader bind;
+  struct vmsvga_shader_s *sh;
+  struct vmsvga_shader_s *old;
+  uint32_t *tokens;
+  SVGA3dRect *rects;
+  SVGA3dCopyRect *copies;
+  uint32_t count;
+  uint32_t i;
+  if (words < 1) {
+    return;
+  };
+  if (cmd == SVGA_3D_CMD_CONTEXT_DEFINE) {
+    vmsvga_context_define(s, vmsvga_fifo_peek(s, 0));
+    return;
+  };
+  if (cmd == SVGA_3D_CMD_CONTEXT_DESTROY) {
+    vmsvga_context_destroy(s, vmsvga_fifo_peek(s, 0));
+    return;
+  };
+  if (cmd == SVGA_3D_CMD_PRESENT) {
+    surf = vmsvga_surface_lookup(s, vmsvga_fifo_peek(s, 0));
+    count = (words - 1) / (sizeof(SVGA3dCopyRect) / sizeof(uint32_t));
+    if (surf == NULL || count < 1 || s->render == NULL) {
+      return;
+    };
+    copies = g_new(SVGA3dCopyRect, count);
+    vmsvga_fifo_copy(s, copies, 1,
+                     count * (sizeof(SVGA3dCopyRect) / sizeof(uint32_t)));
+    s->render->present(s, surf, copies, count);
+    g_free(copies);
+    return;
+  };
+  ctx = vmsvga_context_lookup(s, vmsvga_fifo_peek(s, 0));
+  if (ctx == NULL) {
+    VPRINT("vmsvga_context_cmd: command %u for unknown context\n", cmd);
+    return;
+  };
+  switch (cmd) {
+  case SVGA_3D_CMD_SETRENDERSTATE:
+    for (i = 1; i + 1 < words; i += 2) {
+      vmsvga_fifo_copy(s, &state, i, 2);
+      if (state.state < SVGA3D_RS_MAX &&
+          vmsvga_context_set(s, ctx, &ctx->rs[state.state], &state.uintValue,
+                             sizeof(uint32_t), VMSVGA_DIRTY_RENDERSTATE)) {
+        ctx->rs_dirty[state.state / 64] |= (uint64_t)1 << (state.state % 64);
+      };
+    };
+    break;
+  case SVGA_3D_CMD_SETTEXTURESTATE:
+    for (i = 1; i + 2 < words; i += 3) {
+      vmsvga_fifo_copy(s, &texture, i, 3);
+      if (texture.stage < SVGA3D_NUM_TEXTURE_UNITS &&
+          texture.name < SVGA3D_TS_MAX &&
+          vmsvga_context_set(s, ctx, &ctx->ts[texture.stage][texture.name],
+                             &texture.value, sizeof(uint32_t),
+                             VMSVGA_DIRTY_TEXTURESTATE)) {
+        ctx->ts_dirty |= 1u << texture.stage;
+      };
+    };
+    break;
+  case SVGA_3D_CMD_SETRENDERTARGET:
+    if (words >= sizeof(target) / sizeof(uint32_t)) {
+      vmsvga_fifo_copy(s, &target, 0, sizeof(target) / sizeof(uint32_t));
+      if (target.type < SVGA3D_RT_MAX) {
+        vmsvga_context_set(s, ctx, &ctx->rt[target.type], &target.target,
+                           sizeof(target.target), VMSVGA_DIRTY_RENDERTARGET);
+      };
+    };
+    break;
+  case SVGA_3D_CMD_SETTRANSFORM:
+    if (words >= sizeof(transform) / sizeof(uint32_t)) {
+      vmsvga_fifo_copy(s, &transform, 0, sizeof(transform) / sizeof(uint32_t));
+      if (transform.type < SVGA3D_TRANSFORM_MAX &&
+          vmsvga_context_set(s, ctx, ctx->transform[transform.type],
+                             transform.matrix, sizeof(transform.matrix),
+                             VMSVGA_DIRTY_TRANSFORM)) {
+        ctx->transform_dirty |= 1u << transform.type;
+      };
+    };
+    break;
+  case SVGA_3D_CMD_SETMATERIAL:
+    if (words >= sizeof(material) / sizeof(uint32_t)) {
+      vmsvga_fifo_copy(s, &material, 0, sizeof(material) / sizeof(uint32_t));
+      if (material.face < SVGA3D_FACE_MAX) {
+        vmsvga_context_set(s, ctx, &ctx->material[material.face],
+                           &material.material, sizeof(material.material),
+                           VMSVGA_DIRTY_MATERIAL);
+      };
+    };
+    break;
+  case SVGA_3D_CMD_SETLIGHTDATA:
+    if (words >= sizeof(light) / sizeof(uint32_t)) {
+      vmsvga_fifo_copy(s, &light, 0, sizeof(light) / sizeof(uint32_t));
+      if (light.index < SVGA3D_NUM_LIGHTS &&
+          vmsvga_context_set(s, ctx, &ctx->light[light.index], &light.data,
+                             sizeof(light.data), VMSVGA_DIRTY_LIGHT)) {
+        ctx->light_dirty |= 1u << light.index;
+      };
+    };
+    break;
+  case SVGA_3D_CMD_SETLIGHTENABLED:
+    if (words >= sizeof(enabled) / sizeof(uint32_t)) {
+      vmsvga_fifo_copy(s, &enabled, 0, sizeof(enabled) / sizeof(uint32_t));
+      if (enabled.index < SVGA3D_NUM_LIGHTS &&
+          vmsvga_context_set(s, ctx, &ctx->light_enabled[enabled.index],
+                             &enabled.enabled, sizeof(enabled.enabled),
+                             VMSVGA_DIRTY_LIGHT)) {
+        ctx->light_dirty |= 1u << enabled.index;
+      };
+    };
+    break;
+  case SVGA_3D_CMD_SETCLIPPLANE:
+    if (words >= sizeof(plane) / sizeof(uint32_t)) {
+      vmsvga_fifo_copy(s, &plane, 0, sizeof(plane) / sizeof(uint32_t));
+      if (plane.index < SVGA3D_NUM_CLIPPLANES &&
+          vmsvga_context_set(s, ctx, ctx->clip_plane[plane.index],
+                             plane.plane, sizeof(plane.plane),
+                             VMSVGA_DIRTY_CLIPPLANE)) {
+        ctx->clip_dirty |= 1u << plane.index;
+      };
+    };
+    break;
+  case SVGA_3D_CMD_SETZRANGE:
+    if (words >= sizeof(zrange) / sizeof(uint32_t)) {
+      vmsvga_fifo_copy(s, &zrange, 0, sizeof(zrange) / sizeof(uint32_t));
+      vmsvga_context_set(s, ctx, &ctx->zrange, &zrange.zRange,
+                         sizeof(zrange.zRange), VMSVGA_DIRTY_ZRANGE);
+    };
+    break;
+  case SVGA_3D_CMD_SETVIEWPORT:
+    if (words >= sizeof(rect) / sizeof(uint32_t)) {
+      vmsvga_fifo_copy(s, &rect, 0, sizeof(rect) / sizeof(uint32_t));
+      vmsvga_context_set(s, ctx, &ctx->viewport, &rect.rect,
+                         sizeof(rect.rect), VMSVGA_DIRTY_VIEWPORT);
+    };
+    break;
+  case SVGA_3D_CMD_SETSCISSORRECT:
+    if (words >= sizeof(rect) / sizeof(uint32_t)) {
+      vmsvga_fifo_copy(s, &rect, 0, sizeof(rect) / sizeof(uint32_t));
+      vmsvga_context_set(s, ctx, &ctx->scissor, &rect.rect,
+                         sizeof(rect.rect), VMSVGA_DIRTY_SCISSOR);
+    };
+    break;
+  case SVGA_3D_CMD_CLEAR:
+    if (words < sizeof(clear) / sizeof(uint32_t) || s->render == NULL) {
+      break;
+    };
+    vmsvga_fifo_copy(s, &clear, 0, sizeof(clear) / sizeof(uint32_t));
+    count = (words - (sizeof(clear) / sizeof(uint32_t))) /
+            (sizeof(SVGA3dRect) / sizeof(uint32_t));
+    rects = g_new(SVGA3dRect, MAX(count, 1));
+    vmsvga_fifo_copy(s, rects, sizeof(clear) / sizeof(uint32_t),
+                     count * (sizeof(SVGA3dRect) / sizeof(uint32_t)));
+    vmsvga_context_flush(s, ctx);
+    s->render->clear(s, ctx, &clear, rects, count);
+    g_free(rects);
+    break;
+  case SVGA_3D_CMD_DRAW_PRIMITIVES:
+    if (words < sizeof(draw) / sizeof(uint32_t) || s->render == NULL) {
+      break;
+    };
+    vmsvga_fifo_copy(s, &draw, 0, sizeof(draw) / sizeof(uint32_t));
+    if (draw.numVertexDecls > SVGA3D_MAX_VERTEX_ARRAYS ||
+        draw.numRanges > SVGA3D_MAX_DRAW_PRIMITIVE_RANGES ||
+        words < (sizeof(draw) + (draw.numVertexDecls * sizeof(decls[0])) +
+                 (draw.numRanges * sizeof(ranges[0]))) /
+                    sizeof(uint32_t)) {
+      break;
+    };
+    vmsvga_fifo_copy(s, decls, sizeof(draw) / sizeof(uint32_t),
+                     draw.numVertexDecls * sizeof(decls[0]) / sizeof(uint32_t));
+    vmsvga_fifo_copy(s, ranges,
+                     (sizeof(draw) + (draw.numVertexDecls * sizeof(decls[0]))) /
+                         sizeof(uint32_t),
+                     draw.numRanges * sizeof(ranges[0]) / sizeof(uint32_t));
+    vmsvga_context_flush(s, ctx);
+    s->render->draw(s, ctx, decls, draw.numVertexDecls, ranges,
+                    draw.numRanges);
+    break;
+  case SVGA_3D_CMD_SHADER_DEFINE:
+  case SVGA_3D_CMD_SHADER_DESTROY:
+    // both start with cid, shid and type
+    if (words < sizeof(shader) / sizeof(uint32_t)) {
+      break;
+    };
+    vmsvga_fifo_copy(s, &shader, 0, sizeof(shader) / sizeof(uint32_t));
+    if (shader.shid >= SVGA3D_MAX_SHADERIDS ||
+        (shader.type != SVGA3D_SHADERTYPE_VS &&
+         shader.type != SVGA3D_SHADERTYPE_PS)) {
+      break;
+    };
+    if (cmd == SVGA_3D_CMD_SHADER_DESTROY) {
+      g_hash_table_remove(
+          ctx->shaders,
+          GUINT_TO_POINTER((shader.shid << 1) |
+                           (shader.type - SVGA3D_SHADERTYPE_MIN)));
+      break;
+    };
+    count = words - (sizeof(shader) / sizeof(uint32_t));
+    tokens = g_new(uint32_t, MAX(count, 1));
+    vmsvga_fifo_copy(s, tokens, sizeof(shader) / sizeof(uint32_t), count);
+    sh = vmsvga_shader_get(s, shader.type, tokens, count);
+    if (sh == NULL) {
+      g_hash_table_remove(
+          ctx->shaders,
+          GUINT_TO_POINTER((shader.shid << 1) |
+                           (shader.type - SVGA3D_SHADERTYPE_MIN)));
+      break;
+    };
+    g_hash_table_insert(ctx->shaders,
+                        GUINT_TO_POINTER((shader.shid << 1) |
+                                         (shader.type - SVGA3D_SHADERTYPE_MIN)),
+                        sh);
+    break;
+  case SVGA_3D_CMD_SET_SHADER:
+    if (words < sizeof(bind) / sizeof(uint32_t)) {
+      break;
+    };
+    vmsvga_fifo_copy(s, &bind, 0, sizeof(bind) / sizeof(uint32_t));
+    if (bind.type != SVGA3D_SHADERTYPE_VS &&
+        bind.type != SVGA3D_SHADERTYPE_PS) {
+      break;
+    };
+    sh = NULL;
+    if (bind.shid < SVGA3D_MAX_SHADERIDS) {
+      sh = g_hash_table_lookup(
+          ctx->shaders, GUINT_TO_POINTER((bind.shid << 1) |
+                                         (bind.type - SVGA3D_SHADERTYPE_MIN)));
+    };
+    // the bound shader holds its own reference, so destroying the shid
+    // leaves it in place until the guest binds something else
+    old = ctx->shader[bind.type - SVGA3D_SHADERTYPE_MIN];
+    if (vmsvga_context_set(s, ctx,
+                           &ctx->shader[bind.type - SVGA3D_SHADERTYPE_MIN],
+                           &sh, sizeof(sh), VMSVGA_DIRTY_SHADER)) {
+      if (old != NULL) {
+        vmsvga_shader_unref(old);
+      };
+      if (sh != NULL) {
+        sh->refs++;
+      };
+    };
+    break;
+  default:
+    break;
+  };
+};
+static void vmsvga_dx_shader_free(gpointer data) {
+  struct vmsvga_dx_shader_s *dxs = data;
+  if (dxs->sh != NULL) {
+    vmsvga_shader_unref(dxs->sh);
+  };
+  g_free(dxs);
+};
+static void vmsvga_dx_reset(struct vmsvga_state_s *s) {
+  uint32_t i;
+  for (i = 0; i < SVGA3D_NUM_SHADERTYPE; i++) {
+    if (s->dx_shader[i] != NULL) {
+      vmsvga_shader_unref(s->dx_shader[i]);
+      s->dx_shader[i] = NULL;
+    };
+  };
+  g_hash_table_remove_all(s->dx_shaders);
+  g_hash_table_remove_all(s->mobs);
+};
+// Guest backed MOBs and DX shaders. FIFO commands carry no DX context, so
+// DX shader ids and bindings are tracked per device
+static void vmsvga_gb_cmd(struct vmsvga_state_s *s, uint32_t cmd,
+                          uint32_t words) {
+  VPRINT("vmsvga_gb_cmd was just executed\n");
+  SVGA3dCmdDefineGBMob mob;
+  SVGA3dCmdDefineGBMob64 mob64;
+  SVGA3dCmdDXDefineShader define;
+  SVGA3dCmdDXBindShader bind;
+  SVGA3dCmdDXSetShader set;
+  struct vmsvga_mob_s *m;
+  struct vmsvga_dx_shader_s *dxs;
+  struct vmsvga_shader_s *sh;
+  struct vmsvga_shader_s *old;
+  uint32_t *tokens;
+  uint32_t i;
+  switch (cmd) {
+  case SVGA_3D_CMD_DEFINE_GB_MOB:
+    if (words < sizeof(mob) / sizeof(uint32_t)) {
+      break;
+    };
+    vmsvga_fifo_copy(s, &mob, 0, sizeof(mob) / sizeof(uint32_t));
+    mob64.mobid = mob.mobid;
+    mob64.ptDepth = mob.ptDepth;
+    mob64.base = mob.base;
+    mob64.sizeInBytes = mob.sizeInBytes;
+    goto define;
+  case SVGA_3D_CMD_DEFINE_GB_MOB64:
+    if (words < sizeof(mob64) / sizeof(uint32_t)) {
+      break;
+    };
+    vmsvga_fifo_copy(s, &mob64, 0, sizeof(mob64) / sizeof(uint32_t));
+  define:
+    if (mob64.ptDepth >= SVGA3D_MOBFMT_PREDX_MAX ||
+        (g_hash_table_size(s->mobs) >= VMSVGA_MOB_MAX &&
+         !g_hash_table_contains(s->mobs, GUINT_TO_POINTER(mob64.mobid)))) {
+      break;
+    };
+    m = g_new(struct vmsvga_mob_s, 1);
+    m->format = mob64.ptDepth;
+    m->size = mob64.sizeInBytes;
+    m->base = mob64.base;
+    g_hash_table_insert(s->mobs, GUINT_TO_POINTER(mob64.mobid), m);
+    break;
+  case SVGA_3D_CMD_DESTROY_GB_MOB:
+    if (words < 1) {
+      break;
+    };
+    g_hash_table_remove(s->mobs, GUINT_TO_POINTER(vmsvga_fifo_peek(s, 0)));
+    break;
+  case SVGA_3D_CMD_DX_DEFINE_SHADER:
+    if (words < sizeof(define) / sizeof(uint32_t)) {
+      break;
+    };
+    vmsvga_fifo_copy(s, &define, 0, sizeof(define) / sizeof(uint32_t));
+    if (define.shaderId >= SVGA3D_MAX_SHADERIDS ||
+        define.type < SVGA3D_SHADERTYPE_MIN ||
+        define.type >= SVGA3D_SHADERTYPE_MAX) {
+      break;
+    };
+    dxs = g_new0(struct vmsvga_dx_shader_s, 1);
+    dxs->type = define.type;
+    dxs->size = define.sizeInBytes;
+    g_hash_table_insert(s->dx_shaders, GUINT_TO_POINTER(define.shaderId),
+                        dxs);
+    break;
+  case SVGA_3D_CMD_DX_DESTROY_SHADER:
+    if (words < 1) {
+      break;
+    };
+    g_hash_table_remove(s->dx_shaders,
+                        GUINT_TO_POINTER(vmsvga_fifo_peek(s, 0)));
+    break;
+  case SVGA_3D_CMD_DX_BIND_SHADER:
+    // the bytecode lives in the MOB, a rebind replaces the translation
+    if (words < sizeof(bind) / sizeof(uint32_t)) {
+      break;
+    };
+    vmsvga_fifo_copy(s, &bind, 0, sizeof(bind) / sizeof(uint32_t));
+    dxs = g_hash_table_lookup(s->dx_shaders, GUINT_TO_POINTER(bind.shid));
+    if (dxs == NULL) {
+      break;
+    };
+    if (dxs->sh != NULL) {
+      vmsvga_shader_unref(dxs->sh);
+      dxs->sh = NULL;
+    };
+    if (bind.mobid == SVGA3D_INVALID_ID || dxs->size < 2 * sizeof(uint32_t) ||
+        (dxs->size % sizeof(uint32_t)) != 0 ||
+        dxs->size > VMSVGA_DX_SHADER_MAX) {
+      break;
+    };
+    tokens = g_malloc(dxs->size);
+    if (!vmsvga_mob_read(s, bind.mobid, bind.offsetInBytes, tokens,
+                         dxs->size)) {
+      g_free(tokens);
+      break;
+    };
+    for (i = 0; i < dxs->size / sizeof(uint32_t); i++) {
+      tokens[i] = le32_to_cpu(tokens[i]);
+    };
+    dxs->sh = vmsvga_shader_get(s, dxs->type | VMSVGA_SHADER_DX, tokens,
+                                dxs->size / sizeof(uint32_t));
+    break;
+  case SVGA_3D_CMD_DX_SET_SHADER:
+    if (words < sizeof(set) / sizeof(uint32_t)) {
+      break;
+    };
+    vmsvga_fifo_copy(s, &set, 0, sizeof(set) / sizeof(uint32_t));
+    if (set.type < SVGA3D_SHADERTYPE_MIN ||
+        set.type >= SVGA3D_SHADERTYPE_MAX) {
+      break;
+    };
+    sh = NULL;
+    dxs = g_hash_table_lookup(s->dx_shaders, GUINT_TO_POINTER(set.shaderId));
+    if (dxs != NULL && dxs->type == set.type) {
+      sh = dxs->sh;
+    };
+    old = s->dx_shader[set.type - SVGA3D_SHADERTYPE_MIN];
+    if (old != sh) {
+      if (sh != NULL) {
+        sh->refs++;
+      };
+      if (old != NULL) {
+        vmsvga_shader_unref(old);
+      };
+      s->dx_shader[set.type - SVGA3D_SHADERTYPE_MIN] = sh;
+    };
+    break;
+  default:
+    break;
+  };
+};
+static void vmsvga_cursor_define(struct vmsvga_state_s *s,
+                                 struct vmsvga_cursor_definition_s *c,
+                                 uint32_t kind, uint32_t words) {
+  VPRINT("vmsvga_cursor_define was just executed\n");
+  struct vmsvga_cursor_cache_s *e;
+  const uint32_t *src;
+  QEMUCursor *qc;
+  uint64_t hash = vmsvga_cursor_hash(s, words);
+  uint32_t done;
+  uint32_t n;
+  e = vmsvga_cursor_cache_slot(s, c, kind, hash);
+  if (vmsvga_cursor_cache_match(e, c, kind, hash)) {
+    VPRINT("vmsvga_cursor_define | cache hit for id %u\n", c->id);
+    vmsvga_cursor_defer(s, e->qc);
+    return;
+  };
+  qc = cursor_alloc(c->width, c->height);
+  if (qc != NULL) {
+    qc->hot_x = c->hot_x;
+    qc->hot_y = c->hot_y;
+    if (kind == SVGA_CMD_DEFINE_ALPHA_CURSOR) {
+      for (done = 0; done < words; done += n) {
+        n = vmsvga_fifo_span(s, done, words - done, &src);
+        vmsvga_cursor_convert_argb(qc->data + done, src, n,
+                                   s->cursor_premultiplied);
+      };
+    } else if (c->and_mask_bpp == 1) {
+      vmsvga_cursor_convert_mono(s, c, qc->data);
+    } else {
+      uint32_t i;
+      uint32_t pixels = ((c->width) * (c->height));
+      for (i = 0; i < pixels; i++) {
+        qc->data[i] = vmsvga_fifo_peek(s, i) + vmsvga_fifo_peek(s, pixels + i);
+      };
     };
 #ifdef VERBOSE
-    cursor_print_ascii_art(qc, "vmsvga_rgba");
-#endif
-    VPRINT("vmsvga_rgba_cursor_define | xor_mask == %u : and_mask == %u\n",
-           *c->xor_mask, *c->and_mask);
-    dpy_cursor_define(s->vga.con, qc);
-#ifdef QEMU_V9_2_0
-    cursor_unref(qc);
-#else
-    cursor_put(qc);
+    cursor_print_ascii_art(qc, "vmsvga_cursor");
 #endif
+    vmsvga_cursor_cache_store(e, c, kind, hash, qc);
+    vmsvga_cursor_defer(s, qc);
+    vmsvga_cursor_unref(qc);
   };
 };
 static inline int vmsvga_fifo_length(struct vmsvga_state_s *s) {
@@ -252,6 +3414,18 @@ static inline int vmsvga_fifo_length(struct vmsvga_state_s *s) {
   s->fifo_max = le32_to_cpu(s->fifo[SVGA_FIFO_MAX]);
   s->fifo_next = le32_to_cpu(s->fifo[SVGA_FIFO_NEXT_CMD]);
   s->fifo_stop = le32_to_cpu(s->fifo[SVGA_FIFO_STOP]);
+  // every offset comes from the guest, a ring that does not fit in the
+  // FIFO BAR behind the registers reads as empty
+  if (((s->fifo_min | s->fifo_max | s->fifo_next | s->fifo_stop) & 3) != 0 ||
+      s->fifo_min < SVGA_FIFO_STOP * sizeof(uint32_t) + sizeof(uint32_t) ||
+      s->fifo_min >= s->fifo_max || s->fifo_max > s->fifo_size ||
+      s->fifo_next < s->fifo_min || s->fifo_next >= s->fifo_max ||
+      s->fifo_stop < s->fifo_min || s->fifo_stop >= s->fifo_max) {
+    VPRINT("fifo_min: %u, fifo_max: %u, fifo_next: %u, fifo_stop: %u are "
+           "invalid\n",
+           s->fifo_min, s->fifo_max, s->fifo_next, s->fifo_stop);
+    return 0;
+  };
   if (s->fifo_next >= s->fifo_stop) {
     num = s->fifo_next - s->fifo_stop;
   } else {
@@ -464,18 +3638,234 @@ typedef struct {
 typedef struct {
   SVGA3dSize size;
 } SVGA3dCmdSize;
+static void vmsvga_rect_copy(struct vmsvga_state_s *s, uint32_t src_x,
+                             uint32_t src_y, uint32_t dst_x, uint32_t dst_y,
+                             uint32_t w, uint32_t h);
+static void vmsvga_capture_open(struct vmsvga_state_s *s, Error **errp) {
+  VPRINT("vmsvga_capture_open was just executed\n");
+  s->capture_file = fopen(s->capture_path, "wb");
+  if (s->capture_file == NULL) {
+    error_setg_errno(errp, errno, "vmware-svga: cannot open capture file %s",
+                     s->capture_path);
+    return;
+  };
+  setvbuf(s->capture_file, NULL, _IOFBF, 1048576);
+  qemu_mutex_init(&s->capture_lock);
+};
+static inline bool vmsvga_capture_on(struct vmsvga_state_s *s) {
+  return s->capture_file != NULL && !qatomic_read(&s->capture_failed);
+};
+// Called with capture_lock held. A short write stops the capture instead
+// of leaving a log with holes a replay would misread
+static bool vmsvga_capture_write(struct vmsvga_state_s *s, const void *data,
+                                 size_t size) {
+  if (s->capture_failed) {
+    return false;
+  };
+  if (size > 0 && fwrite(data, size, 1, s->capture_file) != 1) {
+    error_report("vmware-svga: short write to capture file %s, capture "
+                 "stopped",
+                 s->capture_path);
+    qatomic_set(&s->capture_failed, true);
+    return false;
+  };
+  return true;
+};
+// The header carries the VRAM size, so it is written once vmsvga_init ran
+static void vmsvga_capture_start(struct vmsvga_state_s *s) {
+  struct vmsvga_capture_header_s header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, VMSVGA_CAPTURE_MAGIC, sizeof(header.magic));
+  header.version = cpu_to_le32(VMSVGA_CAPTURE_VERSION);
+  header.vram_size = cpu_to_le32(s->vga.vram_size);
+  header.fifo_size = cpu_to_le32(s->fifo_size);
+  s->capture_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+  qemu_mutex_lock(&s->capture_lock);
+  vmsvga_capture_write(s, &header, sizeof(header));
+  qemu_mutex_unlock(&s->capture_lock);
+};
+// Records come from the vCPU thread and the FIFO worker. Callers gather the
+// payload first, capture_lock only covers copying at most one chunk into
+// the stdio buffer so register writes never wait for a large dump
+static void vmsvga_capture_record(struct vmsvga_state_s *s, uint32_t source,
+                                  uint32_t kind, const struct iovec *iov,
+                                  uint32_t count) {
+  static const uint8_t pad[8];
+  struct vmsvga_capture_record_s record;
+  uint32_t length = 0;
+  uint32_t i;
+  bool ok;
+  for (i = 0; i < count; i++) {
+    length += iov[i].iov_len;
+  };
+  record.source = cpu_to_le16(source);
+  record.kind = cpu_to_le16(kind);
+  record.length = cpu_to_le32(length);
+  qemu_mutex_lock(&s->capture_lock);
+  // stamped under the lock so timestamps grow in file order
+  record.timestamp = cpu_to_le64(qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                 s->capture_start);
+  ok = vmsvga_capture_write(s, &record, sizeof(record));
+  for (i = 0; ok && i < count; i++) {
+    ok = vmsvga_capture_write(s, iov[i].iov_base, iov[i].iov_len);
+  };
+  if (ok && (length % 8) != 0) {
+    vmsvga_capture_write(s, pad, 8 - (length % 8));
+  };
+  qemu_mutex_unlock(&s->capture_lock);
+};
+static void vmsvga_capture_reg(struct vmsvga_state_s *s, uint32_t index,
+                               uint32_t value) {
+  uint32_t payload[2];
+  struct iovec iov = {.iov_base = payload, .iov_len = sizeof(payload)};
+  if (!vmsvga_capture_on(s)) {
+    return;
+  };
+  payload[0] = cpu_to_le32(index);
+  payload[1] = cpu_to_le32(value);
+  vmsvga_capture_record(s, VMSVGA_CAPTURE_SRC_REG, VMSVGA_CAPTURE_KIND_REG,
+                        &iov, 1);
+};
+// Before every command batch the scanout range of VRAM is compared block by
+// block with what the log holds so far, and changed runs are recorded, so
+// guest CPU drawing between batches reaches the replay as well
+static void vmsvga_capture_vram(struct vmsvga_state_s *s) {
+  uint32_t payload[2];
+  struct iovec iov[2];
+  uint64_t pos;
+  uint64_t run;
+  uint64_t end;
+  if (!vmsvga_capture_on(s) || s->mode_offset >= s->vga.vram_size) {
+    return;
+  };
+  if (s->capture_vram == NULL) {
+    s->capture_vram = g_malloc0(s->vga.vram_size);
+  };
+  end = MIN(s->mode_offset + ((uint64_t)s->mode_height * s->mode_stride),
+            s->vga.vram_size);
+  pos = QEMU_ALIGN_DOWN(s->mode_offset, VMSVGA_CAPTURE_BLOCK);
+  while (pos < end) {
+    run = pos;
+    while (run < end && (run - pos) < VMSVGA_CAPTURE_CHUNK &&
+           memcmp(s->vga.vram_ptr + run, s->capture_vram + run,
+                  MIN(VMSVGA_CAPTURE_BLOCK, end - run)) != 0) {
+      run += VMSVGA_CAPTURE_BLOCK;
+    };
+    if (run == pos) {
+      pos += VMSVGA_CAPTURE_BLOCK;
+      continue;
+    };
+    run = MIN(run, end);
+    // the copy is what gets written, the guest may change VRAM meanwhile
+    memcpy(s->capture_vram + pos, s->vga.vram_ptr + pos, run - pos);
+    payload[0] = cpu_to_le32(pos);
+    payload[1] = cpu_to_le32(run - pos);
+    iov[0].iov_base = payload;
+    iov[0].iov_len = sizeof(payload);
+    iov[1].iov_base = s->capture_vram + pos;
+    iov[1].iov_len = run - pos;
+    vmsvga_capture_record(s, s->capture_source, VMSVGA_CAPTURE_KIND_VRAM, iov,
+                          2);
+    pos = run;
+  };
+};
+// Commands only carry GMR ids, so the pages behind a GMR are captured the
+// first time the decoder touches it after it was defined, one chunk of
+// pages per record
+static void vmsvga_capture_gmr(struct vmsvga_state_s *s, uint32_t gmr_id) {
+  struct vmsvga_gmr_s *gmr = &s->gmr[gmr_id];
+  uint32_t per = VMSVGA_CAPTURE_CHUNK >> VMSVGA_GMR_PAGE_SHIFT;
+  uint32_t payload[4];
+  struct iovec iov[2];
+  uint8_t *chunk;
+  uint32_t first;
+  uint32_t count;
+  uint32_t i;
+  if (!vmsvga_capture_on(s) || (s->capture_gmr & (1ULL << gmr_id))) {
+    return;
+  };
+  s->capture_gmr |= 1ULL << gmr_id;
+  chunk = g_malloc(VMSVGA_CAPTURE_CHUNK);
+  for (first = 0; first < gmr->num_pages && vmsvga_capture_on(s);
+       first += count) {
+    count = MIN(per, gmr->num_pages - first);
+    for (i = 0; i < count; i++) {
+      // pages outside guest RAM read back as zeros
+      vmsvga_dma(s, gmr->pages[first + i] << VMSVGA_GMR_PAGE_SHIFT,
+                 chunk + (i << VMSVGA_GMR_PAGE_SHIFT),
+                 1 << VMSVGA_GMR_PAGE_SHIFT, false);
+    };
+    payload[0] = cpu_to_le32(gmr_id);
+    payload[1] = cpu_to_le32(gmr->num_pages);
+    payload[2] = cpu_to_le32(first);
+    payload[3] = cpu_to_le32(count);
+    iov[0].iov_base = payload;
+    iov[0].iov_len = sizeof(payload);
+    iov[1].iov_base = chunk;
+    iov[1].iov_len = count << VMSVGA_GMR_PAGE_SHIFT;
+    vmsvga_capture_record(s, s->capture_source, VMSVGA_CAPTURE_KIND_GMR, iov,
+                          2);
+  };
+  g_free(chunk);
+};
+// Records exactly the words the decoder consumed for one command, starting
+// with the command id, so a replay sees the same stream the device did
+static void vmsvga_capture_fifo(struct vmsvga_state_s *s,
+                                uint32_t cmd_start) {
+  struct iovec iov[2];
+  uint32_t count = 1;
+  if (!vmsvga_capture_on(s)) {
+    return;
+  };
+  iov[0].iov_base = (uint8_t *)s->fifo + cmd_start;
+  if (s->fifo_stop >= cmd_start) {
+    iov[0].iov_len = s->fifo_stop - cmd_start;
+  } else {
+    iov[0].iov_len = s->fifo_max - cmd_start;
+    iov[1].iov_base = (uint8_t *)s->fifo + s->fifo_min;
+    iov[1].iov_len = s->fifo_stop - s->fifo_min;
+    count = 2;
+  };
+  vmsvga_capture_record(s, s->capture_source, VMSVGA_CAPTURE_KIND_FIFO, iov,
+                        count);
+};
+static inline bool vmsvga_fifo_enabled(struct vmsvga_state_s *s) {
+  return (s->enable >= 1 || s->config >= 1) &&
+         (s->new_width >= 1 && s->new_height >= 1 && s->new_depth >= 1);
+};
 static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
   VPRINT("vmsvga_fifo_run was just executed\n");
   uint32_t args;
   uint32_t len;
   uint32_t cmd;
-  uint32_t i;
   uint32_t fence_arg;
   uint32_t irq_status;
   uint32_t fifo_start;
+  uint32_t cmd_start;
+  uint32_t count = 0;
   struct vmsvga_cursor_definition_s cursor;
   len = vmsvga_fifo_length(s);
+  if (len >= 1) {
+    vmsvga_capture_vram(s);
+  };
   while ((len >= 1) && (s->sync >= 1)) {
+    // let BQL holders waiting for fifo_lock in between commands, a reset or
+    // a stopping VM ends the batch here
+    if (++count > VMSVGA_FIFO_BATCH) {
+      count = 1;
+      qemu_mutex_unlock(&s->fifo_lock);
+      qemu_mutex_lock(&s->fifo_lock);
+      if (qatomic_read(&s->fifo_paused) || !vmsvga_fifo_enabled(s)) {
+        break;
+      };
+    };
+    if (qatomic_read(&s->gmr_pending) != 0) {
+      vmsvga_gmr_apply(s);
+    };
+    if (qatomic_read(&s->screen_reset_pending)) {
+      vmsvga_screen_apply(s);
+    };
+    cmd_start = s->fifo_stop;
     cmd = vmsvga_fifo_read(s);
     irq_status = 0;
     fifo_start = s->fifo_stop;
@@ -927,42 +4317,42 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
         break;
       };
       len -= sizeof(SVGAFifoCmdRectCopy) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGAFifoCmdRectCopy =
-          sizeof(SVGAFifoCmdRectCopy) / sizeof(uint32_t);
-      while (SizeOfSVGAFifoCmdRectCopy >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdRectCopy -= 1;
-      };
-      VPRINT("SVGA_CMD_RECT_COPY command %u in SVGA command FIFO\n", cmd);
+      SVGAFifoCmdRectCopy rect_copy;
+      rect_copy.srcX = vmsvga_fifo_read(s);
+      rect_copy.srcY = vmsvga_fifo_read(s);
+      rect_copy.destX = vmsvga_fifo_read(s);
+      rect_copy.destY = vmsvga_fifo_read(s);
+      rect_copy.width = vmsvga_fifo_read(s);
+      rect_copy.height = vmsvga_fifo_read(s);
+      vmsvga_rect_copy(s, rect_copy.srcX, rect_copy.srcY, rect_copy.destX,
+                       rect_copy.destY, rect_copy.width, rect_copy.height);
+      VPRINT("SVGA_CMD_RECT_COPY command %u in SVGA command FIFO %u %u %u %u "
+             "%u %u\n",
+             cmd, rect_copy.srcX, rect_copy.srcY, rect_copy.destX,
+             rect_copy.destY, rect_copy.width, rect_copy.height);
       break;
     case SVGA_CMD_DEFINE_CURSOR:
-      len -= sizeof(SVGAFifoCmdDefineCursor) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGAFifoCmdDefineCursor =
-          sizeof(SVGAFifoCmdDefineCursor) / sizeof(uint32_t);
-      while (SizeOfSVGAFifoCmdDefineCursor >= 1) {
-        cursor.id = vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdDefineCursor -= 1;
-        cursor.hot_x = vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdDefineCursor -= 1;
-        cursor.hot_y = vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdDefineCursor -= 1;
-        cursor.width = vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdDefineCursor -= 1;
-        cursor.height = vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdDefineCursor -= 1;
-        cursor.and_mask_bpp = vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdDefineCursor -= 1;
-        cursor.xor_mask_bpp = vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdDefineCursor -= 1;
+      if (len < (sizeof(SVGAFifoCmdDefineCursor) / sizeof(uint32_t)) + 1) {
+        s->fifo_stop = fifo_start;
+        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
+        len = 0;
+        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
+        break;
       };
-      args =
-          (SVGA_PIXMAP_SIZE(cursor.width, cursor.height, cursor.and_mask_bpp) +
-           SVGA_PIXMAP_SIZE(cursor.width, cursor.height, cursor.xor_mask_bpp));
-      len -= args;
-      if (cursor.width < 1 || cursor.height < 1 || cursor.and_mask_bpp < 1 ||
-          cursor.xor_mask_bpp < 1 || cursor.width > s->new_width ||
-          cursor.height > s->new_height || cursor.and_mask_bpp > s->new_depth ||
-          cursor.xor_mask_bpp > s->new_depth) {
+      len -= sizeof(SVGAFifoCmdDefineCursor) / sizeof(uint32_t) + 1;
+      cursor.id = vmsvga_fifo_read(s);
+      cursor.hot_x = vmsvga_fifo_read(s);
+      cursor.hot_y = vmsvga_fifo_read(s);
+      cursor.width = vmsvga_fifo_read(s);
+      cursor.height = vmsvga_fifo_read(s);
+      cursor.and_mask_bpp = vmsvga_fifo_read(s);
+      cursor.xor_mask_bpp = vmsvga_fifo_read(s);
+      if (cursor.width < 1 || cursor.height < 1 ||
+          cursor.width > VMSVGA_CURSOR_MAX_DIMENSION ||
+          cursor.height > VMSVGA_CURSOR_MAX_DIMENSION ||
+          (cursor.and_mask_bpp != 1 && cursor.and_mask_bpp != 32) ||
+          (cursor.xor_mask_bpp != 1 && cursor.xor_mask_bpp != 32) ||
+          (cursor.and_mask_bpp == 32 && cursor.xor_mask_bpp != 32)) {
         s->fifo_stop = fifo_start;
         s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
         len = 0;
@@ -972,48 +4362,44 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
                cursor.height, cursor.and_mask_bpp, cursor.xor_mask_bpp);
         break;
       };
-      for (args = 0; args < SVGA_PIXMAP_SIZE(cursor.width, cursor.height,
-                                             cursor.and_mask_bpp);
-           args++) {
-        cursor.and_mask[args] = vmsvga_fifo_read_raw(s);
-        VPRINT("cursor.and_mask[args] %u\n", cursor.and_mask[args]);
-      };
-      for (args = 0; args < SVGA_PIXMAP_SIZE(cursor.width, cursor.height,
-                                             cursor.xor_mask_bpp);
-           args++) {
-        cursor.xor_mask[args] = vmsvga_fifo_read_raw(s);
-        VPRINT("cursor.xor_mask[args] %u\n", cursor.xor_mask[args]);
+      args =
+          (SVGA_PIXMAP_SIZE(cursor.width, cursor.height, cursor.and_mask_bpp) +
+           SVGA_PIXMAP_SIZE(cursor.width, cursor.height, cursor.xor_mask_bpp));
+      if (len < args) {
+        s->fifo_stop = fifo_start;
+        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
+        len = 0;
+        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
+        break;
       };
-      vmsvga_cursor_define(s, &cursor);
+      len -= args;
+      vmsvga_cursor_define(s, &cursor, cmd, args);
+      vmsvga_fifo_skip(s, args);
       VPRINT("SVGA_CMD_DEFINE_CURSOR command %u in SVGA command FIFO %u %u %u "
              "%u %u %u %u\n",
              cmd, cursor.id, cursor.hot_x, cursor.hot_y, cursor.width,
              cursor.height, cursor.and_mask_bpp, cursor.xor_mask_bpp);
       break;
     case SVGA_CMD_DEFINE_ALPHA_CURSOR:
-      len -= sizeof(SVGAFifoCmdDefineAlphaCursor) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGAFifoCmdDefineAlphaCursor =
-          sizeof(SVGAFifoCmdDefineAlphaCursor) / sizeof(uint32_t);
-      while (SizeOfSVGAFifoCmdDefineAlphaCursor >= 1) {
-        cursor.id = vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdDefineAlphaCursor -= 1;
-        cursor.hot_x = vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdDefineAlphaCursor -= 1;
-        cursor.hot_y = vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdDefineAlphaCursor -= 1;
-        cursor.width = vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdDefineAlphaCursor -= 1;
-        cursor.height = vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdDefineAlphaCursor -= 1;
+      if (len <
+          (sizeof(SVGAFifoCmdDefineAlphaCursor) / sizeof(uint32_t)) + 1) {
+        s->fifo_stop = fifo_start;
+        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
+        len = 0;
+        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
+        break;
       };
+      len -= sizeof(SVGAFifoCmdDefineAlphaCursor) / sizeof(uint32_t) + 1;
+      cursor.id = vmsvga_fifo_read(s);
+      cursor.hot_x = vmsvga_fifo_read(s);
+      cursor.hot_y = vmsvga_fifo_read(s);
+      cursor.width = vmsvga_fifo_read(s);
+      cursor.height = vmsvga_fifo_read(s);
       cursor.and_mask_bpp = 32;
       cursor.xor_mask_bpp = 32;
-      args = ((cursor.width) * (cursor.height));
-      len -= args;
-      if (cursor.width < 1 || cursor.height < 1 || cursor.and_mask_bpp < 1 ||
-          cursor.xor_mask_bpp < 1 || cursor.width > s->new_width ||
-          cursor.height > s->new_height || cursor.and_mask_bpp > s->new_depth ||
-          cursor.xor_mask_bpp > s->new_depth) {
+      if (cursor.width < 1 || cursor.height < 1 ||
+          cursor.width > VMSVGA_CURSOR_MAX_DIMENSION ||
+          cursor.height > VMSVGA_CURSOR_MAX_DIMENSION) {
         s->fifo_stop = fifo_start;
         s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
         len = 0;
@@ -1023,13 +4409,17 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
                cursor.height, cursor.and_mask_bpp, cursor.xor_mask_bpp);
         break;
       };
-      for (i = 0; i < args; i++) {
-        uint32_t rgba = vmsvga_fifo_read_raw(s);
-        cursor.xor_mask[i] = rgba & 0x00ffffff;
-        cursor.and_mask[i] = rgba & 0xff000000;
-        VPRINT("rgba %u\n", rgba);
+      args = ((cursor.width) * (cursor.height));
+      if (len < args) {
+        s->fifo_stop = fifo_start;
+        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
+        len = 0;
+        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
+        break;
       };
-      vmsvga_rgba_cursor_define(s, &cursor);
+      len -= args;
+      vmsvga_cursor_define(s, &cursor, cmd, args);
+      vmsvga_fifo_skip(s, args);
       VPRINT("SVGA_CMD_DEFINE_ALPHA_CURSOR command %u in SVGA command FIFO %u "
              "%u %u %u %u %u %u\n",
              cmd, cursor.id, cursor.hot_x, cursor.hot_y, cursor.width,
@@ -1066,13 +4456,12 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
         break;
       };
       len -= sizeof(SVGAFifoCmdDefineGMR2) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGAFifoCmdDefineGMR2 =
-          sizeof(SVGAFifoCmdDefineGMR2) / sizeof(uint32_t);
-      while (SizeOfSVGAFifoCmdDefineGMR2 >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdDefineGMR2 -= 1;
-      };
-      VPRINT("SVGA_CMD_DEFINE_GMR2 command %u in SVGA command FIFO\n", cmd);
+      SVGAFifoCmdDefineGMR2 define_gmr2;
+      define_gmr2.gmrId = vmsvga_fifo_read(s);
+      define_gmr2.numPages = vmsvga_fifo_read(s);
+      vmsvga_gmr_define(s, define_gmr2.gmrId, define_gmr2.numPages);
+      VPRINT("SVGA_CMD_DEFINE_GMR2 command %u in SVGA command FIFO %u %u\n",
+             cmd, define_gmr2.gmrId, define_gmr2.numPages);
       break;
     case SVGA_CMD_REMAP_GMR2:
       if (len < (sizeof(SVGAFifoCmdRemapGMR2) / sizeof(uint32_t)) + 1) {
@@ -1083,13 +4472,27 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
         break;
       };
       len -= sizeof(SVGAFifoCmdRemapGMR2) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGAFifoCmdRemapGMR2 =
-          sizeof(SVGAFifoCmdRemapGMR2) / sizeof(uint32_t);
-      while (SizeOfSVGAFifoCmdRemapGMR2 >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdRemapGMR2 -= 1;
+      SVGAFifoCmdRemapGMR2 remap_gmr2;
+      remap_gmr2.gmrId = vmsvga_fifo_read(s);
+      remap_gmr2.flags = vmsvga_fifo_read(s);
+      remap_gmr2.offsetPages = vmsvga_fifo_read(s);
+      remap_gmr2.numPages = vmsvga_fifo_read(s);
+      if (remap_gmr2.numPages > VMSVGA_GMR_MAX_PAGES ||
+          len < vmsvga_gmr_remap_words(&remap_gmr2)) {
+        s->fifo_stop = fifo_start;
+        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
+        len = 0;
+        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
+        break;
       };
-      VPRINT("SVGA_CMD_REMAP_GMR2 command %u in SVGA command FIFO\n", cmd);
+      args = vmsvga_gmr_remap_words(&remap_gmr2);
+      len -= args;
+      vmsvga_gmr_remap(s, &remap_gmr2);
+      vmsvga_fifo_skip(s, args);
+      VPRINT("SVGA_CMD_REMAP_GMR2 command %u in SVGA command FIFO %u %u %u "
+             "%u\n",
+             cmd, remap_gmr2.gmrId, remap_gmr2.flags, remap_gmr2.offsetPages,
+             remap_gmr2.numPages);
       break;
     case SVGA_CMD_RECT_ROP_COPY:
       if (len < (sizeof(SVGAFifoCmdRectRopCopy) / sizeof(uint32_t)) + 1) {
@@ -1100,13 +4503,24 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
         break;
       };
       len -= sizeof(SVGAFifoCmdRectRopCopy) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGAFifoCmdRectRopCopy =
-          sizeof(SVGAFifoCmdRectRopCopy) / sizeof(uint32_t);
-      while (SizeOfSVGAFifoCmdRectRopCopy >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdRectRopCopy -= 1;
-      };
-      VPRINT("SVGA_CMD_RECT_ROP_COPY command %u in SVGA command FIFO\n", cmd);
+      SVGAFifoCmdRectRopCopy rect_rop_copy;
+      rect_rop_copy.srcX = vmsvga_fifo_read(s);
+      rect_rop_copy.srcY = vmsvga_fifo_read(s);
+      rect_rop_copy.destX = vmsvga_fifo_read(s);
+      rect_rop_copy.destY = vmsvga_fifo_read(s);
+      rect_rop_copy.width = vmsvga_fifo_read(s);
+      rect_rop_copy.height = vmsvga_fifo_read(s);
+      rect_rop_copy.rop = vmsvga_fifo_read(s);
+      if (rect_rop_copy.rop == SVGA_ROP_COPY) {
+        vmsvga_rect_copy(s, rect_rop_copy.srcX, rect_rop_copy.srcY,
+                         rect_rop_copy.destX, rect_rop_copy.destY,
+                         rect_rop_copy.width, rect_rop_copy.height);
+      };
+      VPRINT("SVGA_CMD_RECT_ROP_COPY command %u in SVGA command FIFO %u %u %u "
+             "%u %u %u %u\n",
+             cmd, rect_rop_copy.srcX, rect_rop_copy.srcY, rect_rop_copy.destX,
+             rect_rop_copy.destY, rect_rop_copy.width, rect_rop_copy.height,
+             rect_rop_copy.rop);
       break;
     case SVGA_CMD_ESCAPE:
       if (len < (sizeof(SVGAFifoCmdEscape) / sizeof(uint32_t)) + 1) {
@@ -1126,21 +4540,40 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
       VPRINT("SVGA_CMD_ESCAPE command %u in SVGA command FIFO\n", cmd);
       break;
     case SVGA_CMD_DEFINE_SCREEN:
-      if (len < (sizeof(SVGAFifoCmdDefineScreen) / sizeof(uint32_t)) + 1) {
+      if (len < 2) {
         s->fifo_stop = fifo_start;
         s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
         len = 0;
         VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
         break;
       };
-      len -= sizeof(SVGAFifoCmdDefineScreen) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGAFifoCmdDefineScreen =
-          sizeof(SVGAFifoCmdDefineScreen) / sizeof(uint32_t);
-      while (SizeOfSVGAFifoCmdDefineScreen >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdDefineScreen -= 1;
+      // SVGAScreenObject is versioned by its leading structSize
+      args = vmsvga_fifo_peek(s, 0);
+      if (args < offsetof(SVGAScreenObject, backingStore) ||
+          args > VMSVGA_SCREEN_OBJECT_MAX_SIZE || (args % 4) != 0 ||
+          len < (args / sizeof(uint32_t)) + 1) {
+        s->fifo_stop = fifo_start;
+        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
+        len = 0;
+        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
+        break;
       };
-      VPRINT("SVGA_CMD_DEFINE_SCREEN command %u in SVGA command FIFO\n", cmd);
+      len -= (args / sizeof(uint32_t)) + 1;
+      SVGAScreenObject screen_object;
+      uint32_t screen_word;
+      memset(&screen_object, 0, sizeof(screen_object));
+      for (screen_word = 0;
+           screen_word < MIN(args, sizeof(screen_object)) / sizeof(uint32_t);
+           screen_word++) {
+        ((uint32_t *)&screen_object)[screen_word] =
+            vmsvga_fifo_peek(s, screen_word);
+      };
+      vmsvga_fifo_skip(s, args / sizeof(uint32_t));
+      vmsvga_screen_define(s, &screen_object, args);
+      VPRINT("SVGA_CMD_DEFINE_SCREEN command %u in SVGA command FIFO %u %u %u "
+             "%u\n",
+             cmd, screen_object.id, screen_object.flags,
+             screen_object.size.width, screen_object.size.height);
       break;
     case SVGA_CMD_DESTROY_SCREEN:
       if (len < (sizeof(SVGAFifoCmdDestroyScreen) / sizeof(uint32_t)) + 1) {
@@ -1151,13 +4584,11 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
         break;
       };
       len -= sizeof(SVGAFifoCmdDestroyScreen) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGAFifoCmdDestroyScreen =
-          sizeof(SVGAFifoCmdDestroyScreen) / sizeof(uint32_t);
-      while (SizeOfSVGAFifoCmdDestroyScreen >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdDestroyScreen -= 1;
-      };
-      VPRINT("SVGA_CMD_DESTROY_SCREEN command %u in SVGA command FIFO\n", cmd);
+      SVGAFifoCmdDestroyScreen destroy_screen;
+      destroy_screen.screenId = vmsvga_fifo_read(s);
+      vmsvga_screen_destroy(s, destroy_screen.screenId);
+      VPRINT("SVGA_CMD_DESTROY_SCREEN command %u in SVGA command FIFO %u\n",
+             cmd, destroy_screen.screenId);
       break;
     case SVGA_CMD_DEFINE_GMRFB:
       if (len < (sizeof(SVGAFifoCmdDefineGMRFB) / sizeof(uint32_t)) + 1) {
@@ -1168,13 +4599,13 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
         break;
       };
       len -= sizeof(SVGAFifoCmdDefineGMRFB) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGAFifoCmdDefineGMRFB =
-          sizeof(SVGAFifoCmdDefineGMRFB) / sizeof(uint32_t);
-      while (SizeOfSVGAFifoCmdDefineGMRFB >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdDefineGMRFB -= 1;
-      };
-      VPRINT("SVGA_CMD_DEFINE_GMRFB command %u in SVGA command FIFO\n", cmd);
+      s->gmrfb_gmr = vmsvga_fifo_read(s);
+      s->gmrfb_offset = vmsvga_fifo_read(s);
+      s->gmrfb_pitch = vmsvga_fifo_read(s);
+      s->gmrfb_bpp = vmsvga_fifo_read(s) & 0xff;
+      VPRINT("SVGA_CMD_DEFINE_GMRFB command %u in SVGA command FIFO %u %u %u "
+             "%u\n",
+             cmd, s->gmrfb_gmr, s->gmrfb_offset, s->gmrfb_pitch, s->gmrfb_bpp);
       break;
     case SVGA_CMD_BLIT_GMRFB_TO_SCREEN:
       if (len < (sizeof(SVGAFifoCmdBlitGMRFBToScreen) / sizeof(uint32_t)) + 1) {
@@ -1185,14 +4616,18 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
         break;
       };
       len -= sizeof(SVGAFifoCmdBlitGMRFBToScreen) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGAFifoCmdBlitGMRFBToScreen =
-          sizeof(SVGAFifoCmdBlitGMRFBToScreen) / sizeof(uint32_t);
-      while (SizeOfSVGAFifoCmdBlitGMRFBToScreen >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdBlitGMRFBToScreen -= 1;
-      };
-      VPRINT("SVGA_CMD_BLIT_GMRFB_TO_SCREEN command %u in SVGA command FIFO\n",
-             cmd);
+      SVGAFifoCmdBlitGMRFBToScreen blit_to_screen;
+      blit_to_screen.srcOrigin.x = vmsvga_fifo_read(s);
+      blit_to_screen.srcOrigin.y = vmsvga_fifo_read(s);
+      blit_to_screen.destRect.left = vmsvga_fifo_read(s);
+      blit_to_screen.destRect.top = vmsvga_fifo_read(s);
+      blit_to_screen.destRect.right = vmsvga_fifo_read(s);
+      blit_to_screen.destRect.bottom = vmsvga_fifo_read(s);
+      blit_to_screen.destScreenId = vmsvga_fifo_read(s);
+      vmsvga_blit_gmrfb_to_screen(s, &blit_to_screen);
+      VPRINT("SVGA_CMD_BLIT_GMRFB_TO_SCREEN command %u in SVGA command FIFO "
+             "%u\n",
+             cmd, blit_to_screen.destScreenId);
       break;
     case SVGA_CMD_BLIT_SCREEN_TO_GMRFB:
       if (len < (sizeof(SVGAFifoCmdBlitScreenToGMRFB) / sizeof(uint32_t)) + 1) {
@@ -1203,14 +4638,18 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
         break;
       };
       len -= sizeof(SVGAFifoCmdBlitScreenToGMRFB) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGAFifoCmdBlitScreenToGMRFB =
-          sizeof(SVGAFifoCmdBlitScreenToGMRFB) / sizeof(uint32_t);
-      while (SizeOfSVGAFifoCmdBlitScreenToGMRFB >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGAFifoCmdBlitScreenToGMRFB -= 1;
-      };
-      VPRINT("SVGA_CMD_BLIT_SCREEN_TO_GMRFB command %u in SVGA command FIFO\n",
-             cmd);
+      SVGAFifoCmdBlitScreenToGMRFB blit_to_gmrfb;
+      blit_to_gmrfb.destOrigin.x = vmsvga_fifo_read(s);
+      blit_to_gmrfb.destOrigin.y = vmsvga_fifo_read(s);
+      blit_to_gmrfb.srcRect.left = vmsvga_fifo_read(s);
+      blit_to_gmrfb.srcRect.top = vmsvga_fifo_read(s);
+      blit_to_gmrfb.srcRect.right = vmsvga_fifo_read(s);
+      blit_to_gmrfb.srcRect.bottom = vmsvga_fifo_read(s);
+      blit_to_gmrfb.srcScreenId = vmsvga_fifo_read(s);
+      vmsvga_blit_screen_to_gmrfb(s, &blit_to_gmrfb);
+      VPRINT("SVGA_CMD_BLIT_SCREEN_TO_GMRFB command %u in SVGA command FIFO "
+             "%u\n",
+             cmd, blit_to_gmrfb.srcScreenId);
       break;
     case SVGA_CMD_ANNOTATION_FILL:
       if (len < (sizeof(SVGAFifoCmdAnnotationFill) / sizeof(uint32_t)) + 1) {
@@ -1342,391 +4781,179 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
       VPRINT("SVGA_3D_CMD_LEGACY_BASE command %u in SVGA command FIFO\n", cmd);
       break;
     case SVGA_3D_CMD_SURFACE_DEFINE:
-      if (len < sizeof(SVGA3dCmdSize) +
-                    sizeof(SVGA3dCmdDefineSurface) / sizeof(uint32_t) + 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      len -= sizeof(SVGA3dCmdSize) +
-             sizeof(SVGA3dCmdDefineSurface) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdDefineSurface =
-          sizeof(SVGA3dCmdSize) +
-          sizeof(SVGA3dCmdDefineSurface) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdDefineSurface >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdDefineSurface -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_SURFACE_DEFINE command %u in SVGA command FIFO\n",
-             cmd);
-      break;
-    case SVGA_3D_CMD_SURFACE_DESTROY:
-      if (len < sizeof(SVGA3dCmdDestroySurface) / sizeof(uint32_t) + 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      len -= sizeof(SVGA3dCmdDestroySurface) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdDestroySurface =
-          sizeof(SVGA3dCmdDestroySurface) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdDestroySurface >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdDestroySurface -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_SURFACE_DESTROY command %u in SVGA command FIFO\n",
-             cmd);
-      break;
-    case SVGA_3D_CMD_SURFACE_COPY:
-      if (len < sizeof(SVGA3dCmdSurfaceCopy) / sizeof(uint32_t) + 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      len -= sizeof(SVGA3dCmdSurfaceCopy) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdSurfaceCopy =
-          sizeof(SVGA3dCmdSurfaceCopy) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdSurfaceCopy >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdSurfaceCopy -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_SURFACE_COPY command %u in SVGA command FIFO\n", cmd);
-      break;
-    case SVGA_3D_CMD_SURFACE_STRETCHBLT:
-      if (len < sizeof(SVGA3dCmdSurfaceStretchBlt) / sizeof(uint32_t) + 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      len -= sizeof(SVGA3dCmdSurfaceStretchBlt) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdSurfaceStretchBlt =
-          sizeof(SVGA3dCmdSurfaceStretchBlt) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdSurfaceStretchBlt >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdSurfaceStretchBlt -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_SURFACE_STRETCHBLT command %u in SVGA command FIFO\n",
-             cmd);
-      break;
-    case SVGA_3D_CMD_SURFACE_DMA:
-      if (len < sizeof(SVGA3dCmdSurfaceDMA) / sizeof(uint32_t) + 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      len -= sizeof(SVGA3dCmdSurfaceDMA) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdSurfaceDMA =
-          sizeof(SVGA3dCmdSurfaceDMA) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdSurfaceDMA >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdSurfaceDMA -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_SURFACE_DMA command %u in SVGA command FIFO\n", cmd);
-      break;
-    case SVGA_3D_CMD_CONTEXT_DEFINE:
-      if (len < sizeof(SVGA3dCmdDefineContext) / sizeof(uint32_t) + 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      len -= sizeof(SVGA3dCmdDefineContext) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdDefineContext =
-          sizeof(SVGA3dCmdDefineContext) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdDefineContext >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdDefineContext -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_CONTEXT_DEFINE command %u in SVGA command FIFO\n",
-             cmd);
-      break;
-    case SVGA_3D_CMD_CONTEXT_DESTROY:
-      if (len < sizeof(SVGA3dCmdDestroyContext) / sizeof(uint32_t) + 1) {
+      if (len < 2) {
         s->fifo_stop = fifo_start;
         s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
         len = 0;
         VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
         break;
       };
-      len -= sizeof(SVGA3dCmdDestroyContext) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdDestroyContext =
-          sizeof(SVGA3dCmdDestroyContext) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdDestroyContext >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdDestroyContext -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_CONTEXT_DESTROY command %u in SVGA command FIFO\n",
-             cmd);
-      break;
-    case SVGA_3D_CMD_SETTRANSFORM:
-      if (len < sizeof(SVGA3dCmdSetTransform) / sizeof(uint32_t) + 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      len -= sizeof(SVGA3dCmdSetTransform) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdSetTransform =
-          sizeof(SVGA3dCmdSetTransform) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdSetTransform >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdSetTransform -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_SETTRANSFORM command %u in SVGA command FIFO\n", cmd);
-      break;
-    case SVGA_3D_CMD_SETZRANGE:
-      if (len < sizeof(SVGA3dCmdSetZRange) / sizeof(uint32_t) + 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      len -= sizeof(SVGA3dCmdSetZRange) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdSetZRange =
-          sizeof(SVGA3dCmdSetZRange) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdSetZRange >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdSetZRange -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_SETZRANGE command %u in SVGA command FIFO\n", cmd);
-      break;
-    case SVGA_3D_CMD_SETRENDERSTATE:
-      if (len < sizeof(SVGA3dCmdSetRenderState) / sizeof(uint32_t) + 1) {
+      // 3D commands carry their payload size in bytes after the id
+      args = vmsvga_fifo_peek(s, 0);
+      if ((args % 4) != 0 || len < (args / sizeof(uint32_t)) + 2) {
         s->fifo_stop = fifo_start;
         s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
         len = 0;
         VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
         break;
       };
-      len -= sizeof(SVGA3dCmdSetRenderState) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdSetRenderState =
-          sizeof(SVGA3dCmdSetRenderState) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdSetRenderState >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdSetRenderState -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_SETRENDERSTATE command %u in SVGA command FIFO\n",
+      len -= (args / sizeof(uint32_t)) + 2;
+      vmsvga_fifo_skip(s, 1);
+      vmsvga_surface_define(s, cmd, args / sizeof(uint32_t));
+      vmsvga_fifo_skip(s, args / sizeof(uint32_t));
+      VPRINT("SVGA_3D_CMD_SURFACE_DEFINE command %u in SVGA command FIFO\n",
              cmd);
       break;
-    case SVGA_3D_CMD_SETRENDERTARGET:
-      if (len < sizeof(SVGA3dCmdSetRenderTarget) / sizeof(uint32_t) + 1) {
+    case SVGA_3D_CMD_SURFACE_DESTROY:
+      if (len < 2) {
         s->fifo_stop = fifo_start;
         s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
         len = 0;
         VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
         break;
       };
-      len -= sizeof(SVGA3dCmdSetRenderTarget) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdSetRenderTarget =
-          sizeof(SVGA3dCmdSetRenderTarget) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdSetRenderTarget >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdSetRenderTarget -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_SETRENDERTARGET command %u in SVGA command FIFO\n",
-             cmd);
-      break;
-    case SVGA_3D_CMD_SETTEXTURESTATE:
-      if (len < sizeof(SVGA3dCmdSetTextureState) / sizeof(uint32_t) + 1) {
+      // 3D commands carry their payload size in bytes after the id
+      args = vmsvga_fifo_peek(s, 0);
+      if ((args % 4) != 0 || len < (args / sizeof(uint32_t)) + 2) {
         s->fifo_stop = fifo_start;
         s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
         len = 0;
         VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
         break;
       };
-      len -= sizeof(SVGA3dCmdSetTextureState) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdSetTextureState =
-          sizeof(SVGA3dCmdSetTextureState) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdSetTextureState >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdSetTextureState -= 1;
+      len -= (args / sizeof(uint32_t)) + 2;
+      vmsvga_fifo_skip(s, 1);
+      if (args >= sizeof(SVGA3dCmdDestroySurface)) {
+        vmsvga_surface_destroy(s, vmsvga_fifo_peek(s, 0));
       };
-      VPRINT("SVGA_3D_CMD_SETTEXTURESTATE command %u in SVGA command FIFO\n",
+      vmsvga_fifo_skip(s, args / sizeof(uint32_t));
+      VPRINT("SVGA_3D_CMD_SURFACE_DESTROY command %u in SVGA command FIFO\n",
              cmd);
       break;
-    case SVGA_3D_CMD_SETMATERIAL:
-      if (len < sizeof(SVGA3dCmdSetMaterial) / sizeof(uint32_t) + 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      len -= sizeof(SVGA3dCmdSetMaterial) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdSetMaterial =
-          sizeof(SVGA3dCmdSetMaterial) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdSetMaterial >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdSetMaterial -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_SETMATERIAL command %u in SVGA command FIFO\n", cmd);
-      break;
-    case SVGA_3D_CMD_SETLIGHTDATA:
-      if (len < sizeof(SVGA3dCmdSetLightData) / sizeof(uint32_t) + 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      len -= sizeof(SVGA3dCmdSetLightData) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdSetLightData =
-          sizeof(SVGA3dCmdSetLightData) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdSetLightData >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdSetLightData -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_SETLIGHTDATA command %u in SVGA command FIFO\n", cmd);
-      break;
-    case SVGA_3D_CMD_SETLIGHTENABLED:
-      if (len < sizeof(SVGA3dCmdSetLightEnabled) / sizeof(uint32_t) + 1) {
+    case SVGA_3D_CMD_SURFACE_COPY:
+      if (len < sizeof(SVGA3dCmdSurfaceCopy) / sizeof(uint32_t) + 1) {
         s->fifo_stop = fifo_start;
         s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
         len = 0;
         VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
         break;
       };
-      len -= sizeof(SVGA3dCmdSetLightEnabled) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdSetLightEnabled =
-          sizeof(SVGA3dCmdSetLightEnabled) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdSetLightEnabled >= 1) {
+      len -= sizeof(SVGA3dCmdSurfaceCopy) / sizeof(uint32_t) + 1;
+      uint32_t SizeOfSVGA3dCmdSurfaceCopy =
+          sizeof(SVGA3dCmdSurfaceCopy) / sizeof(uint32_t);
+      while (SizeOfSVGA3dCmdSurfaceCopy >= 1) {
         vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdSetLightEnabled -= 1;
+        SizeOfSVGA3dCmdSurfaceCopy -= 1;
       };
-      VPRINT("SVGA_3D_CMD_SETLIGHTENABLED command %u in SVGA command FIFO\n",
-             cmd);
+      VPRINT("SVGA_3D_CMD_SURFACE_COPY command %u in SVGA command FIFO\n", cmd);
       break;
-    case SVGA_3D_CMD_SETVIEWPORT:
-      if (len < sizeof(SVGA3dCmdSetViewport) / sizeof(uint32_t) + 1) {
+    case SVGA_3D_CMD_SURFACE_STRETCHBLT:
+      if (len < sizeof(SVGA3dCmdSurfaceStretchBlt) / sizeof(uint32_t) + 1) {
         s->fifo_stop = fifo_start;
         s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
         len = 0;
         VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
         break;
       };
-      len -= sizeof(SVGA3dCmdSetViewport) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdSetViewport =
-          sizeof(SVGA3dCmdSetViewport) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdSetViewport >= 1) {
+      len -= sizeof(SVGA3dCmdSurfaceStretchBlt) / sizeof(uint32_t) + 1;
+      uint32_t SizeOfSVGA3dCmdSurfaceStretchBlt =
+          sizeof(SVGA3dCmdSurfaceStretchBlt) / sizeof(uint32_t);
+      while (SizeOfSVGA3dCmdSurfaceStretchBlt >= 1) {
         vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdSetViewport -= 1;
+        SizeOfSVGA3dCmdSurfaceStretchBlt -= 1;
       };
-      VPRINT("SVGA_3D_CMD_SETVIEWPORT command %u in SVGA command FIFO\n", cmd);
+      VPRINT("SVGA_3D_CMD_SURFACE_STRETCHBLT command %u in SVGA command FIFO\n",
+             cmd);
       break;
-    case SVGA_3D_CMD_SETCLIPPLANE:
-      if (len < sizeof(SVGA3dCmdSetClipPlane) / sizeof(uint32_t) + 1) {
+    case SVGA_3D_CMD_SURFACE_DMA:
+      if (len < 2) {
         s->fifo_stop = fifo_start;
         s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
         len = 0;
         VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
         break;
       };
-      len -= sizeof(SVGA3dCmdSetClipPlane) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdSetClipPlane =
-          sizeof(SVGA3dCmdSetClipPlane) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdSetClipPlane >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdSetClipPlane -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_SETCLIPPLANE command %u in SVGA command FIFO\n", cmd);
-      break;
-    case SVGA_3D_CMD_CLEAR:
-      if (len < sizeof(SVGA3dCmdClear) / sizeof(uint32_t) + 1) {
+      args = vmsvga_fifo_peek(s, 0);
+      if ((args % 4) != 0 || len < (args / sizeof(uint32_t)) + 2) {
         s->fifo_stop = fifo_start;
         s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
         len = 0;
         VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
         break;
       };
-      len -= sizeof(SVGA3dCmdClear) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdClear = sizeof(SVGA3dCmdClear) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdClear >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdClear -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_CLEAR command %u in SVGA command FIFO\n", cmd);
+      len -= (args / sizeof(uint32_t)) + 2;
+      vmsvga_fifo_skip(s, 1);
+      vmsvga_surface_dma(s, args / sizeof(uint32_t));
+      vmsvga_fifo_skip(s, args / sizeof(uint32_t));
+      VPRINT("SVGA_3D_CMD_SURFACE_DMA command %u in SVGA command FIFO\n", cmd);
       break;
+    case SVGA_3D_CMD_CONTEXT_DEFINE:
+    case SVGA_3D_CMD_CONTEXT_DESTROY:
+    case SVGA_3D_CMD_SETTRANSFORM:
+    case SVGA_3D_CMD_SETZRANGE:
+    case SVGA_3D_CMD_SETRENDERSTATE:
+    case SVGA_3D_CMD_SETRENDERTARGET:
+    case SVGA_3D_CMD_CLEAR:
     case SVGA_3D_CMD_PRESENT:
-      if (len < sizeof(SVGA3dCmdPresent) / sizeof(uint32_t) + 1) {
+    case SVGA_3D_CMD_SETVIEWPORT:
+    case SVGA_3D_CMD_SETSCISSORRECT:
+    case SVGA_3D_CMD_DRAW_PRIMITIVES:
+    case SVGA_3D_CMD_SETTEXTURESTATE:
+    case SVGA_3D_CMD_SETMATERIAL:
+    case SVGA_3D_CMD_SETLIGHTDATA:
+    case SVGA_3D_CMD_SETLIGHTENABLED:
+    case SVGA_3D_CMD_SETCLIPPLANE:
+    case SVGA_3D_CMD_SHADER_DEFINE:
+    case SVGA_3D_CMD_SHADER_DESTROY:
+    case SVGA_3D_CMD_SET_SHADER:
+      if (len < 2) {
         s->fifo_stop = fifo_start;
         s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
         len = 0;
         VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
         break;
       };
-      len -= sizeof(SVGA3dCmdPresent) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdPresent =
-          sizeof(SVGA3dCmdPresent) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdPresent >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdPresent -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_PRESENT command %u in SVGA command FIFO\n", cmd);
-      break;
-    case SVGA_3D_CMD_SHADER_DEFINE:
-      if (len < sizeof(SVGA3dCmdDefineShader) / sizeof(uint32_t) + 1) {
+      args = vmsvga_fifo_peek(s, 0);
+      if ((args % 4) != 0 || len < (args / sizeof(uint32_t)) + 2) {
         s->fifo_stop = fifo_start;
         s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
         len = 0;
         VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
         break;
       };
-      len -= sizeof(SVGA3dCmdDefineShader) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdDefineShader =
-          sizeof(SVGA3dCmdDefineShader) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdDefineShader >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdDefineShader -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_SHADER_DEFINE command %u in SVGA command FIFO\n",
-             cmd);
+      len -= (args / sizeof(uint32_t)) + 2;
+      vmsvga_fifo_skip(s, 1);
+      vmsvga_context_cmd(s, cmd, args / sizeof(uint32_t));
+      vmsvga_fifo_skip(s, args / sizeof(uint32_t));
+      VPRINT("SVGA3D context command %u in SVGA command FIFO\n", cmd);
       break;
-    case SVGA_3D_CMD_SHADER_DESTROY:
-      if (len < sizeof(SVGA3dCmdDestroyShader) / sizeof(uint32_t) + 1) {
+    case SVGA_3D_CMD_DEFINE_GB_MOB:
+    case SVGA_3D_CMD_DEFINE_GB_MOB64:
+    case SVGA_3D_CMD_DESTROY_GB_MOB:
+    case SVGA_3D_CMD_DX_DEFINE_SHADER:
+    case SVGA_3D_CMD_DX_DESTROY_SHADER:
+    case SVGA_3D_CMD_DX_BIND_SHADER:
+    case SVGA_3D_CMD_DX_SET_SHADER:
+      if (len < 2) {
         s->fifo_stop = fifo_start;
         s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
         len = 0;
         VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
         break;
       };
-      len -= sizeof(SVGA3dCmdDestroyShader) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdDestroyShader =
-          sizeof(SVGA3dCmdDestroyShader) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdDestroyShader >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdDestroyShader -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_SHADER_DESTROY command %u in SVGA command FIFO\n",
-             cmd);
-      break;
-    case SVGA_3D_CMD_SET_SHADER:
-      if (len < sizeof(SVGA3dCmdSetShader) / sizeof(uint32_t) + 1) {
+      args = vmsvga_fifo_peek(s, 0);
+      if ((args % 4) != 0 || len < (args / sizeof(uint32_t)) + 2) {
         s->fifo_stop = fifo_start;
         s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
         len = 0;
         VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
         break;
       };
-      len -= sizeof(SVGA3dCmdSetShader) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdSetShader =
-          sizeof(SVGA3dCmdSetShader) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdSetShader >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdSetShader -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_SET_SHADER command %u in SVGA command FIFO\n", cmd);
+      len -= (args / sizeof(uint32_t)) + 2;
+      vmsvga_fifo_skip(s, 1);
+      vmsvga_gb_cmd(s, cmd, args / sizeof(uint32_t));
+      vmsvga_fifo_skip(s, args / sizeof(uint32_t));
+      VPRINT("SVGA3D guest backed command %u in SVGA command FIFO\n", cmd);
       break;
     case SVGA_3D_CMD_SET_SHADER_CONST:
       if (len < sizeof(SVGA3dCmdSetShaderConst) / sizeof(uint32_t) + 1) {
@@ -1746,38 +4973,6 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
       VPRINT("SVGA_3D_CMD_SET_SHADER_CONST command %u in SVGA command FIFO\n",
              cmd);
       break;
-    case SVGA_3D_CMD_DRAW_PRIMITIVES:
-      if (len < 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      s->fifo_stop = fifo_start;
-      s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-      len = 0;
-      VPRINT("SVGA_3D_CMD_DRAW_PRIMITIVES command %u in SVGA command FIFO\n",
-             cmd);
-      break;
-    case SVGA_3D_CMD_SETSCISSORRECT:
-      if (len < sizeof(SVGA3dCmdSetScissorRect) / sizeof(uint32_t) + 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      len -= sizeof(SVGA3dCmdSetScissorRect) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdSetScissorRect =
-          sizeof(SVGA3dCmdSetScissorRect) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdSetScissorRect >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdSetScissorRect -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_SETSCISSORRECT command %u in SVGA command FIFO\n",
-             cmd);
-      break;
     case SVGA_3D_CMD_BEGIN_QUERY:
       if (len < sizeof(SVGA3dCmdBeginQuery) / sizeof(uint32_t) + 1) {
         s->fifo_stop = fifo_start;
@@ -1864,23 +5059,26 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
              cmd);
       break;
     case SVGA_3D_CMD_SURFACE_DEFINE_V2:
-      if (len < sizeof(SVGA3dCmdSize) +
-                    sizeof(SVGA3dCmdDefineSurface_v2) / sizeof(uint32_t) + 1) {
+      if (len < 2) {
         s->fifo_stop = fifo_start;
         s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
         len = 0;
         VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
         break;
       };
-      len -= sizeof(SVGA3dCmdSize) +
-             sizeof(SVGA3dCmdDefineSurface_v2) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdDefineSurface_v2 =
-          sizeof(SVGA3dCmdSize) +
-          sizeof(SVGA3dCmdDefineSurface_v2) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdDefineSurface_v2 >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdDefineSurface_v2 -= 1;
+      // 3D commands carry their payload size in bytes after the id
+      args = vmsvga_fifo_peek(s, 0);
+      if ((args % 4) != 0 || len < (args / sizeof(uint32_t)) + 2) {
+        s->fifo_stop = fifo_start;
+        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
+        len = 0;
+        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
+        break;
       };
+      len -= (args / sizeof(uint32_t)) + 2;
+      vmsvga_fifo_skip(s, 1);
+      vmsvga_surface_define(s, cmd, args / sizeof(uint32_t));
+      vmsvga_fifo_skip(s, args / sizeof(uint32_t));
       VPRINT("SVGA_3D_CMD_SURFACE_DEFINE_V2 command %u in SVGA command FIFO\n",
              cmd);
       break;
@@ -2199,42 +5397,6 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
       VPRINT("SVGA_3D_CMD_READBACK_OTABLE command %u in SVGA command FIFO\n",
              cmd);
       break;
-    case SVGA_3D_CMD_DEFINE_GB_MOB:
-      if (len < sizeof(SVGA3dCmdDefineGBMob) / sizeof(uint32_t) + 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      len -= sizeof(SVGA3dCmdDefineGBMob) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdDefineGBMob =
-          sizeof(SVGA3dCmdDefineGBMob) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdDefineGBMob >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdDefineGBMob -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_DEFINE_GB_MOB command %u in SVGA command FIFO\n",
-             cmd);
-      break;
-    case SVGA_3D_CMD_DESTROY_GB_MOB:
-      if (len < sizeof(SVGA3dCmdDestroyGBMob) / sizeof(uint32_t) + 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      len -= sizeof(SVGA3dCmdDestroyGBMob) / sizeof(uint32_t) + 1;
-      uint32_t SizeOfSVGA3dCmdDestroyGBMob =
-          sizeof(SVGA3dCmdDestroyGBMob) / sizeof(uint32_t);
-      while (SizeOfSVGA3dCmdDestroyGBMob >= 1) {
-        vmsvga_fifo_read(s);
-        SizeOfSVGA3dCmdDestroyGBMob -= 1;
-      };
-      VPRINT("SVGA_3D_CMD_DESTROY_GB_MOB command %u in SVGA command FIFO\n",
-             cmd);
-      break;
     case SVGA_3D_CMD_DEAD3:
       if (len < 1) {
         s->fifo_stop = fifo_start;
@@ -2936,18 +6098,6 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
           "SVGA_3D_CMD_DEFINE_GB_SURFACE_V2 command %u in SVGA command FIFO\n",
           cmd);
       break;
-    case SVGA_3D_CMD_DEFINE_GB_MOB64:
-      if (len < sizeof(SVGA3dCmdDefineGBMob) / sizeof(uint32_t) + 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      len -= sizeof(SVGA3dCmdDefineGBMob) / sizeof(uint32_t) + 1;
-      VPRINT("SVGA_3D_CMD_DEFINE_GB_MOB64 command %u in SVGA command FIFO\n",
-             cmd);
-      break;
     case SVGA_3D_CMD_REDEFINE_GB_MOB64:
       if (len < sizeof(SVGA3dCmdRedefineGBMob64) / sizeof(uint32_t) + 1) {
         s->fifo_stop = fifo_start;
@@ -3150,20 +6300,6 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
              "FIFO\n",
              cmd);
       break;
-    case SVGA_3D_CMD_DX_SET_SHADER:
-      if (len < 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      s->fifo_stop = fifo_start;
-      s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-      len = 0;
-      VPRINT("SVGA_3D_CMD_DX_SET_SHADER command %u in SVGA command FIFO\n",
-             cmd);
-      break;
     case SVGA_3D_CMD_DX_SET_SAMPLERS:
       if (len < 1) {
         s->fifo_stop = fifo_start;
@@ -3890,48 +7026,6 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
              "FIFO\n",
              cmd);
       break;
-    case SVGA_3D_CMD_DX_DEFINE_SHADER:
-      if (len < 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      s->fifo_stop = fifo_start;
-      s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-      len = 0;
-      VPRINT("SVGA_3D_CMD_DX_DEFINE_SHADER command %u in SVGA command FIFO\n",
-             cmd);
-      break;
-    case SVGA_3D_CMD_DX_DESTROY_SHADER:
-      if (len < 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      s->fifo_stop = fifo_start;
-      s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-      len = 0;
-      VPRINT("SVGA_3D_CMD_DX_DESTROY_SHADER command %u in SVGA command FIFO\n",
-             cmd);
-      break;
-    case SVGA_3D_CMD_DX_BIND_SHADER:
-      if (len < 1) {
-        s->fifo_stop = fifo_start;
-        s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-        len = 0;
-        VPRINT("rewind command %u in SVGA command FIFO\n", cmd);
-        break;
-      };
-      s->fifo_stop = fifo_start;
-      s->fifo[SVGA_FIFO_STOP] = cpu_to_le32(s->fifo_stop);
-      len = 0;
-      VPRINT("SVGA_3D_CMD_DX_BIND_SHADER command %u in SVGA command FIFO\n",
-             cmd);
-      break;
     case SVGA_3D_CMD_DX_DEFINE_STREAMOUTPUT:
       if (len < 1) {
         s->fifo_stop = fifo_start;
@@ -4913,91 +8007,594 @@ static void vmsvga_fifo_run(struct vmsvga_state_s *s) {
       VPRINT("default command %u in SVGA command FIFO\n", cmd);
       break;
     };
-    if ((irq_status) || ((s->irq_mask) & (SVGA_IRQFLAG_FIFO_PROGRESS))) {
-      VPRINT(
-          "FIFO: irq_status || s -> irq_mask & SVGA_IRQFLAG_FIFO_PROGRESS\n");
-      if ((s->irq_mask) & (SVGA_IRQFLAG_FIFO_PROGRESS)) {
-        VPRINT("FIFO: irq_status |= SVGA_IRQFLAG_FIFO_PROGRESS\n");
-        irq_status |= SVGA_IRQFLAG_FIFO_PROGRESS;
+    // rewound and unknown commands end the batch and are not recorded
+    if (len != 0 || s->fifo_stop != fifo_start) {
+      vmsvga_capture_fifo(s, cmd_start);
+    };
+    if ((irq_status) || ((s->irq_mask) & (SVGA_IRQFLAG_FIFO_PROGRESS))) {
+      VPRINT(
+          "FIFO: irq_status || s -> irq_mask & SVGA_IRQFLAG_FIFO_PROGRESS\n");
+      if ((s->irq_mask) & (SVGA_IRQFLAG_FIFO_PROGRESS)) {
+        VPRINT("FIFO: irq_status |= SVGA_IRQFLAG_FIFO_PROGRESS\n");
+        irq_status |= SVGA_IRQFLAG_FIFO_PROGRESS;
+      };
+      if ((s->irq_mask) & (irq_status)) {
+        VPRINT("FIFO: Pci_set_irq=1\n");
+        vmsvga_irq_defer(s, irq_status);
+      };
+    };
+  };
+  s->sync = 0;
+};
+static uint32_t vmsvga_index_read(void *opaque, uint32_t address) {
+  VPRINT("vmsvga_index_read was just executed\n");
+  struct vmsvga_state_s *s = opaque;
+  VPRINT("vmsvga_index_read %u %u\n", address, s->index);
+  return s->index;
+};
+static void vmsvga_index_write(void *opaque, uint32_t address, uint32_t index) {
+  VPRINT("vmsvga_index_write was just executed\n");
+  struct vmsvga_state_s *s = opaque;
+  VPRINT("vmsvga_index_write %u %u\n", address, index);
+  s->index = index;
+};
+static pixman_format_code_t vmsvga_pixman_format(uint32_t bpp) {
+#define PIXMAN_FORMAT(bpp, type, a, r, g, b)                                   \
+  (((bpp) << 24) | ((type) << 16) | ((a) << 12) | ((r) << 8) | ((g) << 4) |    \
+   ((b)))
+  switch (bpp) {
+  case 4:
+    return PIXMAN_FORMAT(4, 2, 0, 1, 2, 1);
+  case 8:
+    return PIXMAN_FORMAT(8, 2, 0, 3, 3, 2);
+  case 15:
+    return PIXMAN_FORMAT(16, 2, 0, 5, 5, 5);
+  case 16:
+    return PIXMAN_FORMAT(16, 2, 0, 5, 6, 5);
+  case 24:
+    return PIXMAN_FORMAT(24, 2, 0, 8, 8, 8);
+  case 32:
+    return PIXMAN_FORMAT(32, 2, 0, 8, 8, 8);
+  default:
+    return qemu_default_pixman_format(bpp, true);
+  }
+}
+static inline uint32_t vmsvga_bytes_per_line(struct vmsvga_state_s *s) {
+  VPRINT("vmsvga_bytes_per_line was just executed\n");
+  uint64_t packed;
+  if (s->new_depth == 15) {
+    packed = (((16) * (uint64_t)(s->new_width)) / (8));
+  } else {
+    packed = (((s->new_depth) * (uint64_t)(s->new_width)) / (8));
+  };
+  // A locked pitch is only honored while it can hold a full scanline and the
+  // whole frame still fits in VRAM, otherwise the packed layout is used
+  if ((s->pitchlock >= packed) &&
+      (((uint64_t)s->pitchlock * s->new_height) <= s->vga.vram_size)) {
+    return s->pitchlock;
+  };
+  return packed;
+};
+// WIDTH, HEIGHT, BITS_PER_PIXEL and pitch writes only stage a mode, the
+// scanout keeps using the mode_* snapshot until vmsvga_mode_commit runs
+static inline void vmsvga_mode_stage(struct vmsvga_state_s *s) {
+  VPRINT("vmsvga_mode_stage was just executed\n");
+  s->mode_staged++;
+  vmsvga_activity(s);
+};
+static inline void vmsvga_mode_set(struct vmsvga_state_s *s, uint32_t width,
+                                   uint32_t height, uint32_t depth,
+                                   uint32_t stride, uint32_t offset) {
+  if (s->mode_width != width || s->mode_height != height ||
+      s->mode_depth != depth || s->mode_stride != stride ||
+      s->mode_offset != offset) {
+    s->mode_width = width;
+    s->mode_height = height;
+    s->mode_depth = depth;
+    s->mode_stride = stride;
+    s->mode_offset = offset;
+    s->mode_gen++;
+    if (s->mode_gen < 1) {
+      s->mode_gen = 1;
+    };
+    VPRINT("vmsvga_mode_set: width: %u, height: %u, depth: %u, stride: %u, "
+           "offset: %u, gen: %u\n",
+           s->mode_width, s->mode_height, s->mode_depth, s->mode_stride,
+           s->mode_offset, s->mode_gen);
+  };
+};
+// A scanout is only set up over VRAM it can cover completely, whichever
+// way the stride was chosen
+static inline bool vmsvga_mode_fits(struct vmsvga_state_s *s, uint32_t stride,
+                                    uint32_t height, uint32_t offset) {
+  return ((uint64_t)offset + ((uint64_t)stride * height)) <= s->vga.vram_size;
+};
+// Per the screen object spec, reprogramming the GFB registers deletes every
+// screen and turns screen #0 back into the legacy framebuffer
+static void vmsvga_screen_reset(struct vmsvga_state_s *s) {
+  VPRINT("vmsvga_screen_reset was just executed\n");
+  uint32_t i;
+  // the screen table belongs to the worker, which may sit on fifo_lock for
+  // a whole batch, so it is cleared through vmsvga_screen_apply
+  qemu_mutex_lock(&s->bh_lock);
+  s->screen_pending = 0;
+  qatomic_set(&s->screen_reset_pending, true);
+  qemu_mutex_unlock(&s->bh_lock);
+  s->mode_screen = 0;
+  for (i = 1; i < VMSVGA_MAX_SCREENS; i++) {
+    memset(&s->head[i].screen, 0, sizeof(s->head[i].screen));
+    s->head[i].gen++;
+  };
+};
+static inline void vmsvga_mode_commit(struct vmsvga_state_s *s) {
+  VPRINT("vmsvga_mode_commit was just executed\n");
+  uint32_t stride = vmsvga_bytes_per_line(s);
+  if (s->mode_screen >= 1) {
+    if (s->mode_staged == s->mode_seen) {
+      return;
+    };
+    vmsvga_screen_reset(s);
+  };
+  // a packed mode too big for VRAM keeps the previous scanout
+  if (vmsvga_mode_fits(s, stride, s->new_height, 0)) {
+    vmsvga_mode_set(s, s->new_width, s->new_height, s->new_depth, stride, 0);
+  };
+  s->mode_seen = s->mode_staged;
+  s->mode_polled = s->mode_staged;
+};
+// Screen #0 is scanned out through the regular mode state, only its
+// geometry and VRAM offset come from the screen object
+static void vmsvga_screen_primary(struct vmsvga_state_s *s,
+                                  struct vmsvga_screen_s *scr) {
+  VPRINT("vmsvga_screen_primary was just executed\n");
+  if (vmsvga_screen_live(scr)) {
+    s->mode_screen = 1;
+    vmsvga_mode_set(s, scr->width, scr->height, 32, scr->pitch, scr->offset);
+  } else if (s->mode_screen >= 1) {
+    s->mode_screen = 0;
+    if (vmsvga_mode_fits(s, vmsvga_bytes_per_line(s), s->new_height, 0)) {
+      vmsvga_mode_set(s, s->new_width, s->new_height, s->new_depth,
+                      vmsvga_bytes_per_line(s), 0);
+    };
+  };
+};
+// Guests that never touch ENABLE or CONFIG_DONE on a mode switch get their
+// mode committed once it has stayed unchanged for a whole refresh interval
+static inline void vmsvga_mode_poll(struct vmsvga_state_s *s) {
+  if (s->mode_staged != s->mode_seen) {
+    if (s->mode_staged == s->mode_polled) {
+      vmsvga_mode_commit(s);
+    } else {
+      s->mode_polled = s->mode_staged;
+    };
+  };
+};
+static inline bool vmsvga_shadow_wanted(struct vmsvga_state_s *s) {
+  VPRINT("vmsvga_shadow_wanted was just executed\n");
+  // pixman can only wrap VRAM directly when every scanline is word aligned
+  if ((s->mode_stride % 4) != 0) {
+    return (s->mode_depth == 8 || s->mode_depth == 15 ||
+            s->mode_depth == 16 || s->mode_depth == 24 || s->mode_depth == 32);
+  };
+  return (s->shadow) && (s->mode_depth == 8 || s->mode_depth == 15 ||
+                         s->mode_depth == 16 || s->mode_depth == 24);
+};
+static inline void vmsvga_palette_lut_update(struct vmsvga_state_s *s) {
+  VPRINT("vmsvga_palette_lut_update was just executed\n");
+  uint32_t i;
+  for (i = 0; i < 256; i++) {
+    s->palette_lut[i] = 0xff000000 |
+                        ((s->svgapalettebase[(i * 3)] & 0xff) << 16) |
+                        ((s->svgapalettebase[(i * 3) + 1] & 0xff) << 8) |
+                        ((s->svgapalettebase[(i * 3) + 2] & 0xff));
+  };
+  s->palette_dirty = 0;
+};
+static void vmsvga_shadow_convert(struct vmsvga_state_s *s, uint32_t x,
+                                  uint32_t y, uint32_t w, uint32_t h) {
+  VPRINT("vmsvga_shadow_convert was just executed\n");
+  DisplaySurface *surface = qemu_console_surface(s->vga.con);
+  uint32_t bypp = ((s->mode_depth + 7) / 8);
+  uint32_t src_stride = s->mode_stride;
+  uint32_t line;
+  if (x >= surface_width(surface) || y >= surface_height(surface)) {
+    return;
+  };
+  w = MIN(w, surface_width(surface) - x);
+  h = MIN(h, surface_height(surface) - y);
+  if (s->mode_depth == 8 && s->palette_dirty >= 1) {
+    vmsvga_palette_lut_update(s);
+  };
+  for (line = y; line < (y + h); line++) {
+    uint64_t offset =
+        s->mode_offset + ((uint64_t)line * src_stride) + (x * bypp);
+    if ((offset + (w * bypp)) > s->vga.vram_size) {
+      break;
+    };
+    const uint8_t *src = s->vga.vram_ptr + offset;
+    uint32_t *dst = (uint32_t *)((uint8_t *)surface_data(surface) +
+                                 (line * surface_stride(surface))) +
+                    x;
+    switch (s->mode_depth) {
+    case 8:
+      vmsvga_convert_8(s->palette_lut, dst, src, w);
+      break;
+    case 15:
+      vmsvga_convert_16(dst, src, w, 5);
+      break;
+    case 16:
+      vmsvga_convert_16(dst, src, w, 6);
+      break;
+    case 24:
+      vmsvga_convert_24(dst, src, w);
+      break;
+    case 32:
+      memcpy(dst, src, w * 4);
+      break;
+    };
+  };
+};
+// Screen to screen copies are applied to VRAM in place and then reported
+// as a copy, so frontends with CopyRect support can move pixels instead of
+// re-encoding the destination as fresh damage
+static void vmsvga_rect_copy(struct vmsvga_state_s *s, uint32_t src_x,
+                             uint32_t src_y, uint32_t dst_x, uint32_t dst_y,
+                             uint32_t w, uint32_t h) {
+  VPRINT("vmsvga_rect_copy was just executed\n");
+  uint32_t bypp = ((s->mode_depth + 7) / 8);
+  uint32_t stride = s->mode_stride;
+  // RECT_COPY works on the legacy GFB, which is not shown once a screen
+  // object owns screen #0
+  if (s->mode_screen >= 1 || s->mode_depth < 8 || w < 1 || h < 1 ||
+      ((uint64_t)src_x + w) > s->mode_width ||
+      ((uint64_t)dst_x + w) > s->mode_width ||
+      ((uint64_t)src_y + h) > s->mode_height ||
+      ((uint64_t)dst_y + h) > s->mode_height ||
+      (((uint64_t)(MAX(src_y, dst_y) + h - 1) * stride) +
+       ((uint64_t)(MAX(src_x, dst_x) + w) * bypp)) > s->vga.vram_size) {
+    return;
+  };
+  vmsvga_copy_rows(s->vga.vram_ptr, stride,
+                   ((uint64_t)src_y * stride) + (src_x * bypp),
+                   ((uint64_t)dst_y * stride) + (dst_x * bypp), w * bypp, h);
+  // dpy_gfx_copy only runs from vmsvga_fifo_bh and replays the copy on the
+  // listener's own surface, which may still lack source damage or miss
+  // guest writes racing the BH. The next scan catches both, VNC compares
+  // the rescanned rows with its server surface and skips unchanged tiles
+  memory_region_set_dirty(&s->vga.vram, (hwaddr)dst_y * stride,
+                          (hwaddr)h * stride);
+  vmsvga_copy_defer(s, src_x, src_y, dst_x, dst_y, w, h);
+};
+static void vmsvga_fifo_bh(void *opaque) {
+  VPRINT("vmsvga_fifo_bh was just executed\n");
+  struct vmsvga_state_s *s = opaque;
+  struct vmsvga_copy_s copies[VMSVGA_COPY_QUEUE_SIZE];
+  QEMUCursor *qc;
+  struct vmsvga_screen_s screens[VMSVGA_MAX_SCREENS];
+  uint32_t irq_status;
+  uint32_t screen_pending;
+  uint32_t count;
+  uint32_t i;
+  bool overflow;
+  bool blocker_pending;
+  bool blocker_want;
+  qemu_mutex_lock(&s->bh_lock);
+  irq_status = s->irq_pending;
+  s->irq_pending = 0;
+  screen_pending = s->screen_pending;
+  s->screen_pending = 0;
+  memcpy(screens, s->screen_next, sizeof(screens));
+  qc = s->cursor_next;
+  s->cursor_next = NULL;
+  count = s->copy_count;
+  overflow = s->copy_overflow;
+  memcpy(copies, s->copy_queue, count * sizeof(copies[0]));
+  s->copy_count = 0;
+  s->copy_overflow = false;
+  blocker_pending = s->blocker_pending;
+  blocker_want = s->blocker_want;
+  s->blocker_pending = false;
+  qemu_mutex_unlock(&s->bh_lock);
+  if (blocker_pending) {
+    vmsvga_migration_block(s, blocker_want);
+  };
+  if (qc != NULL) {
+    vmsvga_cursor_show(s, qc);
+    vmsvga_cursor_unref(qc);
+  };
+  for (i = 0; i < VMSVGA_MAX_SCREENS; i++) {
+    if (!(screen_pending & (1u << i))) {
+      continue;
+    };
+    if (i == 0) {
+      vmsvga_screen_primary(s, &screens[i]);
+    } else {
+      s->head[i].screen = screens[i];
+      s->head[i].gen++;
+    };
+  };
+  if (s->surface_gen == s->mode_gen && s->surface_gen != 0 &&
+      vmsvga_scanout_watched(s)) {
+    if (overflow) {
+      s->shadow_dirty = 1;
+      dpy_gfx_update(s->vga.con, 0, 0, s->mode_width, s->mode_height);
+    } else {
+      for (i = 0; i < count; i++) {
+        if (s->shadow_active >= 1) {
+          vmsvga_shadow_convert(s, copies[i].dst_x, copies[i].dst_y,
+                                copies[i].w, copies[i].h);
+        };
+        dpy_gfx_copy(s->vga.con, copies[i].src_x, copies[i].src_y,
+                     copies[i].dst_x, copies[i].dst_y, copies[i].w,
+                     copies[i].h);
       };
-      if ((s->irq_mask) & (irq_status)) {
+    };
+  };
+  if (irq_status != 0) {
 #ifndef RAISE_IRQ_OFF
-        struct pci_vmsvga_state_s *pci_vmsvga =
-            container_of(s, struct pci_vmsvga_state_s, chip);
+    struct pci_vmsvga_state_s *pci_vmsvga =
+        container_of(s, struct pci_vmsvga_state_s, chip);
 #endif
-        s->irq_status = irq_status;
-        VPRINT("FIFO: Pci_set_irq=1\n");
+    s->irq_status = irq_status;
 #ifndef RAISE_IRQ_OFF
-        pci_set_irq(PCI_DEVICE(pci_vmsvga), 1);
+    pci_set_irq(PCI_DEVICE(pci_vmsvga), 1);
 #endif
+  };
+};
+static inline void vmsvga_fifo_kick(struct vmsvga_state_s *s) {
+  qemu_event_set(&s->fifo_event);
+};
+// True when the guest queued commands since the worker last looked, a
+// partial command left waiting for more data does not count
+static inline bool vmsvga_fifo_pending(struct vmsvga_state_s *s) {
+  return !qatomic_read(&s->fifo_paused) &&
+         qatomic_read(&s->fifo[SVGA_FIFO_NEXT_CMD]) !=
+             qatomic_read(&s->fifo_seen_next);
+};
+static inline bool vmsvga_fifo_reserved(struct vmsvga_state_s *s) {
+  uint32_t reserved = le32_to_cpu(qatomic_read(&s->fifo[SVGA_FIFO_RESERVED]));
+  return (s->fc & SVGA_FIFO_CAP_RESERVE) && reserved != 0 &&
+         reserved != SVGA_FIFO_RESERVED_UNKNOWN;
+};
+static inline bool vmsvga_fifo_busy(struct vmsvga_state_s *s) {
+  return qatomic_read(&s->sync_req) != qatomic_load_acquire(&s->sync_done);
+};
+// BUSY polls kick the worker when commands are queued. This runs on the
+// vCPU with the BQL held, so it never waits for the batch to finish, the
+// guest simply reads BUSY again
+static uint32_t vmsvga_fifo_busy_poll(struct vmsvga_state_s *s) {
+  if (vmsvga_fifo_enabled(s) && vmsvga_fifo_pending(s)) {
+    vmsvga_fifo_kick(s);
+  };
+  return vmsvga_fifo_busy(s);
+};
+// Before sleeping the worker polls the ring for a while, the window grows
+// while it keeps catching new work and shrinks when it only burns time
+static bool vmsvga_fifo_spin(struct vmsvga_state_s *s) {
+  int64_t deadline;
+  int64_t window = s->fifo_spin_ns;
+  // with SVGA_FIFO_CAP_RESERVE a non-zero SVGA_FIFO_RESERVED means the
+  // guest is writing a command in place and is about to commit it
+  if (vmsvga_fifo_reserved(s)) {
+    window = VMSVGA_SPIN_MAX_NS;
+  };
+  if (window < 1) {
+    return false;
+  };
+  deadline = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + window;
+  while (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < deadline) {
+    if (vmsvga_fifo_busy(s) ||
+        (vmsvga_fifo_enabled(s) && vmsvga_fifo_pending(s))) {
+      return true;
+    };
+    cpu_relax();
+  };
+  s->fifo_spin_ns /= 2;
+  if (s->fifo_spin_ns < VMSVGA_SPIN_MIN_NS) {
+    s->fifo_spin_ns = 0;
+  };
+  return false;
+};
+// SYNC writes and refreshes only kick this thread, decoding and VRAM access
+// happen here without the BQL so other vCPUs and devices keep running
+static void *vmsvga_fifo_worker(void *arg) {
+  struct vmsvga_state_s *s = arg;
+  int64_t start;
+  int64_t slept;
+  uint32_t req;
+  uint32_t next;
+  bool paused;
+  // guest memory is looked up through RCU protected flat views
+  rcu_register_thread();
+  while (true) {
+    if (!vmsvga_fifo_spin(s)) {
+      start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+      qemu_event_wait(&s->fifo_event);
+      slept = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+      if (slept < VMSVGA_SPIN_MAX_NS) {
+        s->fifo_spin_ns =
+            MIN(MAX(s->fifo_spin_ns * 2, VMSVGA_SPIN_MIN_NS), VMSVGA_SPIN_MAX_NS);
       };
     };
+    qemu_event_reset(&s->fifo_event);
+    req = qatomic_load_acquire(&s->sync_req);
+    qemu_mutex_lock(&s->fifo_lock);
+    if (!qatomic_read(&s->fifo_paused) && qatomic_read(&s->shader_io_ready)) {
+      vmsvga_shader_io_apply(s);
+    };
+    if (!qatomic_read(&s->fifo_paused) && vmsvga_fifo_enabled(s)) {
+      next = qatomic_read(&s->fifo[SVGA_FIFO_NEXT_CMD]);
+      if (next != s->fifo_seen_next) {
+        vmsvga_activity(s);
+      };
+      qatomic_set(&s->fifo_seen_next, next);
+      // an outstanding SYNC is what woke the worker, otherwise the refresh
+      s->capture_source = (req != qatomic_read(&s->sync_done))
+                              ? VMSVGA_CAPTURE_SRC_SYNC
+                              : VMSVGA_CAPTURE_SRC_REFRESH;
+      s->sync = 1;
+      vmsvga_fifo_run(s);
+      s->fifo[SVGA_FIFO_BUSY] = s->sync;
+      vmsvga_objects_check(s);
+    };
+    paused = qatomic_read(&s->fifo_paused);
+    qemu_mutex_unlock(&s->fifo_lock);
+    // a paused worker executed nothing, the kick on resume completes the sync
+    if (!paused) {
+      qatomic_store_release(&s->sync_done, req);
+    };
   };
-  s->sync = 0;
+  rcu_unregister_thread();
+  return NULL;
 };
-static uint32_t vmsvga_index_read(void *opaque, uint32_t address) {
-  VPRINT("vmsvga_index_read was just executed\n");
+// Keep the worker away from the FIFO while the VM is stopped so RAM and
+// device state are saved at a command boundary
+static void vmsvga_vm_state_change(void *opaque, bool running,
+                                   RunState state) {
   struct vmsvga_state_s *s = opaque;
-  VPRINT("vmsvga_index_read %u %u\n", address, s->index);
-  return s->index;
+  if (running) {
+    qatomic_set(&s->fifo_paused, false);
+    vmsvga_fifo_kick(s);
+    vmsvga_cursor_poll_arm(s);
+  } else {
+    timer_del(s->cursor_timer);
+    qatomic_set(&s->fifo_paused, true);
+    // the batch ends at the next command boundary, a screen reset the
+    // worker did not pick up yet must reach the migrated screen table
+    qemu_mutex_lock(&s->fifo_lock);
+    if (qatomic_read(&s->screen_reset_pending)) {
+      vmsvga_screen_apply(s);
+    };
+    qemu_mutex_unlock(&s->fifo_lock);
+  };
 };
-static void vmsvga_index_write(void *opaque, uint32_t address, uint32_t index) {
-  VPRINT("vmsvga_index_write was just executed\n");
-  struct vmsvga_state_s *s = opaque;
-  VPRINT("vmsvga_index_write %u %u\n", address, index);
-  s->index = index;
+// Push the VRAM rows of one scanout written since the last refresh to its
+// console, converting them first when a shadow surface is in use. Returns
+// whether anything was damaged
+static bool vmsvga_dirty_scan(struct vmsvga_state_s *s, QemuConsole *con,
+                              uint32_t base, uint32_t stride,
+                              uint32_t line_size, uint32_t width,
+                              uint32_t height, bool shadow, bool full) {
+  DirtyBitmapSnapshot *snap;
+  uint32_t band = 0;
+  uint32_t y;
+  bool in_band = false;
+  bool damaged = false;
+  if (base >= s->vga.vram_size) {
+    return false;
+  };
+  if ((base + ((uint64_t)height * stride)) > s->vga.vram_size) {
+    height = (s->vga.vram_size - base) / stride;
+  };
+  snap = memory_region_snapshot_and_clear_dirty(
+      &s->vga.vram, base, (uint64_t)height * stride, DIRTY_MEMORY_VGA);
+  if (full) {
+    if (shadow) {
+      vmsvga_shadow_convert(s, 0, 0, width, height);
+    };
+    dpy_gfx_update(con, 0, 0, width, height);
+    g_free(snap);
+    return true;
+  };
+  for (y = 0; y <= height; y++) {
+    bool dirty = (y < height) &&
+                 memory_region_snapshot_get_dirty(
+                     &s->vga.vram, snap, base + ((uint64_t)y * stride),
+                     line_size);
+    if (dirty && !in_band) {
+      band = y;
+      in_band = true;
+    } else if (!dirty && in_band) {
+      if (shadow) {
+        vmsvga_shadow_convert(s, 0, band, width, y - band);
+      };
+      dpy_gfx_update(con, 0, band, width, y - band);
+      in_band = false;
+      damaged = true;
+    };
+  };
+  g_free(snap);
+  return damaged;
+};
+static bool vmsvga_scanout_refresh(struct vmsvga_state_s *s) {
+  VPRINT("vmsvga_scanout_refresh was just executed\n");
+  uint32_t line_size = s->mode_width * ((s->mode_depth + 7) / 8);
+  bool full = (s->shadow_dirty >= 1);
+  if (s->mode_stride < 1 || line_size < 1) {
+    return false;
+  };
+  s->shadow_dirty = 0;
+  return vmsvga_dirty_scan(s, s->vga.con, s->mode_offset, s->mode_stride,
+                           line_size, s->mode_width, s->mode_height,
+                           s->shadow_active >= 1, full);
+};
+// Secondary screens always wrap their 32bpp backing store in VRAM
+static void vmsvga_head_update(void *opaque) {
+  struct vmsvga_head_s *h = opaque;
+  struct vmsvga_state_s *s = h->s;
+  struct vmsvga_screen_s *scr = &h->screen;
+  DisplaySurface *surface;
+  bool live = vmsvga_screen_live(scr) && !(scr->flags & SVGA_SCREEN_BLANKING);
+  if (!qemu_console_is_visible(h->con)) {
+    h->surface_gen = 0;
+    return;
+  };
+  if (h->surface_gen != h->gen) {
+    if (live) {
+      surface = qemu_create_displaysurface_from(
+          scr->width, scr->height, vmsvga_pixman_format(32), scr->pitch,
+          s->vga.vram_ptr + scr->offset);
+    } else if (scr->defined >= 1 && scr->width >= 1 && scr->height >= 1) {
+      surface = qemu_create_displaysurface(scr->width, scr->height);
+    } else {
+      surface = qemu_create_displaysurface(640, 480);
+    };
+    dpy_gfx_replace_surface(h->con, surface);
+    h->surface_gen = h->gen;
+    if (live) {
+      vmsvga_dirty_scan(s, h->con, scr->offset, scr->pitch, scr->width * 4,
+                        scr->width, scr->height, false, true);
+    };
+    return;
+  };
+  if (live) {
+    vmsvga_dirty_scan(s, h->con, scr->offset, scr->pitch, scr->width * 4,
+                      scr->width, scr->height, false, false);
+  };
+};
+static void vmsvga_head_invalidate(void *opaque) {
+  struct vmsvga_head_s *h = opaque;
+  h->surface_gen = 0;
 };
-static pixman_format_code_t vmsvga_pixman_format(uint32_t bpp) {
-#define PIXMAN_FORMAT(bpp, type, a, r, g, b)                                   \
-  (((bpp) << 24) | ((type) << 16) | ((a) << 12) | ((r) << 8) | ((g) << 4) |    \
-   ((b)))
-  switch (bpp) {
-  case 4:
-    return PIXMAN_FORMAT(4, 2, 0, 1, 2, 1);
-  case 8:
-    return PIXMAN_FORMAT(8, 2, 0, 3, 3, 2);
-  case 15:
-    return PIXMAN_FORMAT(16, 2, 0, 5, 5, 5);
-  case 16:
-    return PIXMAN_FORMAT(16, 2, 0, 5, 6, 5);
-  case 24:
-    return PIXMAN_FORMAT(24, 2, 0, 8, 8, 8);
-  case 32:
-    return PIXMAN_FORMAT(32, 2, 0, 8, 8, 8);
-  default:
-    return qemu_default_pixman_format(bpp, true);
-  }
-}
 static inline void vmsvga_check_size(struct vmsvga_state_s *s) {
   VPRINT("vmsvga_check_size was just executed\n");
-  DisplaySurface *surface = qemu_console_surface(s->vga.con);
-  uint32_t new_stride;
-  if (s->pitchlock >= 1) {
-    new_stride = s->pitchlock;
-  } else {
-    new_stride = (((s->new_depth) * (s->new_width)) / (8));
+  DisplaySurface *surface;
+  if (s->surface_gen == s->mode_gen) {
+    return;
   };
-  if (s->new_width != surface_width(surface) ||
-      s->new_height != surface_height(surface) ||
-      (new_stride != surface_stride(surface)) ||
-      s->new_depth != surface_bits_per_pixel(surface)) {
-    pixman_format_code_t format = vmsvga_pixman_format(s->new_depth);
+  if (vmsvga_shadow_wanted(s)) {
+    surface = qemu_create_displaysurface(s->mode_width, s->mode_height);
+    s->shadow_active = 1;
+    s->shadow_dirty = 1;
+    s->palette_dirty = 1;
+  } else {
     surface = qemu_create_displaysurface_from(
-        s->new_width, s->new_height, format, new_stride, s->vga.vram_ptr);
-    VPRINT("vmsvga_check_size: old_width: %u, old_height: %u, old_depth: %u, "
-           "old_format: %u, old_stride: %u, new_width: %u, new_height: %u, "
-           "new_depth: %u, new_format: %u, new_stride: %u\n",
-           surface_width(surface), surface_height(surface),
-           surface_bits_per_pixel(surface),
-           vmsvga_pixman_format(surface_bits_per_pixel(surface)),
-           surface_stride(surface), s->new_width, s->new_height, s->new_depth,
-           format, new_stride);
-    dpy_gfx_replace_surface(s->vga.con, surface);
+        s->mode_width, s->mode_height, vmsvga_pixman_format(s->mode_depth),
+        s->mode_stride, s->vga.vram_ptr + s->mode_offset);
+    s->shadow_active = 0;
   };
+  VPRINT("vmsvga_check_size: new_width: %u, new_height: %u, new_depth: %u, "
+         "new_stride: %u, shadow: %u, gen: %u\n",
+         s->mode_width, s->mode_height, s->mode_depth, s->mode_stride,
+         s->shadow_active, s->mode_gen);
+  dpy_gfx_replace_surface(s->vga.con, surface);
+  s->surface_gen = s->mode_gen;
 };
 static void *vmsvga_loop(void *arg) {
   VPRINT("vmsvga_loop was just executed\n");
   struct vmsvga_state_s *s = (struct vmsvga_state_s *)arg;
+  uint32_t seen = 0;
+  uint32_t activity;
   while (true) {
     // s->fifo[SVGA_FIFO_MIN] = 4096;
     // s->fifo[SVGA_FIFO_MAX] = 2097152;
@@ -5006,7 +8603,6 @@ static void *vmsvga_loop(void *arg) {
     // s->fifo[SVGA_FIFO_CAPABILITIES] = 1919;
     // s->fifo[SVGA_FIFO_FENCE] = 4294967198;
     s->fifo[SVGA_FIFO_3D_HWVERSION] = 131073;         // SVGA3D_HWVERSION_WS8_B1
-    s->fifo[SVGA_FIFO_RESERVED] = 4294967295;         // -1
     s->fifo[SVGA_FIFO_CURSOR_SCREEN_ID] = 4294967295; // -1
     // s->fifo[SVGA_FIFO_DEAD] = 2;
     s->fifo[SVGA_FIFO_3D_HWVERSION_REVISED] = 131073; // SVGA3D_HWVERSION_WS8_B1
@@ -5188,22 +8784,21 @@ static void *vmsvga_loop(void *arg) {
     s->fifo[217] = 19161088;
     // SVGA_FIFO_3D_CAPS
     // s->fifo[SVGA_FIFO_FENCE_GOAL] = 4294967198;
-    if (s->pitchlock >= 1) {
-      s->fifo[SVGA_FIFO_PITCHLOCK] = s->pitchlock;
-    } else {
-      s->fifo[SVGA_FIFO_PITCHLOCK] = (((s->new_depth) * (s->new_width)) / (8));
-    };
     s->fifo[SVGA_FIFO_FLAGS] = s->ff;
     s->fifo[SVGA_FIFO_CAPABILITIES] = s->fc;
     s->fifo[SVGA_FIFO_BUSY] = s->sync;
     s->fifo[SVGA_FIFO_DEAD] = 0;
-    if ((s->enable >= 1 || s->config >= 1) &&
-        (s->new_width >= 1 && s->new_height >= 1 && s->new_depth >= 1)) {
-      if (s->pitchlock >= 1) {
-        s->new_width = (((s->pitchlock) * (8)) / (s->new_depth));
-      };
-      dpy_gfx_update(s->vga.con, 0, 0, s->new_width, s->new_height);
+    // damage reaches the console through vmsvga_scanout_refresh, this
+    // loop only republishes registers. While nothing happens it waits for
+    // the SYNC writes, BUSY polls and refreshes that kick the worker, only
+    // the worker resets the event so the short sleep keeps a kick that is
+    // still set from turning this into a spin
+    activity = qatomic_read(&s->activity);
+    if (activity == seen) {
+      qemu_event_wait(&s->fifo_event);
     };
+    seen = activity;
+    g_usleep(VMSVGA_LOOP_ACTIVE_US);
   };
   return 0;
 };
@@ -5253,12 +8848,12 @@ static uint32_t vmsvga_value_read(void *opaque, uint32_t address) {
            ret);
     break;
   case SVGA_REG_MAX_WIDTH:
-    ret = 8192;
+    ret = VMSVGA_MAX_WIDTH;
     VPRINT("SVGA_REG_MAX_WIDTH register %u with the return of %u\n", s->index,
            ret);
     break;
   case SVGA_REG_MAX_HEIGHT:
-    ret = 8192;
+    ret = VMSVGA_MAX_HEIGHT;
     VPRINT("SVGA_REG_MAX_HEIGHT register %u with the return of %u\n", s->index,
            ret);
     break;
@@ -5351,11 +8946,7 @@ static uint32_t vmsvga_value_read(void *opaque, uint32_t address) {
            ret);
     break;
   case SVGA_REG_BYTES_PER_LINE:
-    if (s->pitchlock >= 1) {
-      ret = s->pitchlock;
-    } else {
-      ret = (((s->new_depth) * (s->new_width)) / (8));
-    };
+    ret = vmsvga_bytes_per_line(s);
     VPRINT("SVGA_REG_BYTES_PER_LINE register %u with the return of %u\n",
            s->index, ret);
     break;
@@ -5380,11 +8971,8 @@ static uint32_t vmsvga_value_read(void *opaque, uint32_t address) {
            ret);
     break;
   case SVGA_REG_FB_SIZE:
-    if (s->pitchlock >= 1) {
-      ret = ((s->new_height) * (s->pitchlock));
-    } else {
-      ret = ((s->new_height) * ((((s->new_depth) * (s->new_width)) / (8))));
-    };
+    ret = MIN((uint64_t)s->new_height * vmsvga_bytes_per_line(s),
+              s->vga.vram_size);
     VPRINT("SVGA_REG_FB_SIZE register %u with the return of %u\n", s->index,
            ret);
     break;
@@ -5399,11 +8987,7 @@ static uint32_t vmsvga_value_read(void *opaque, uint32_t address) {
            s->index, ret);
     break;
   case SVGA_REG_SUGGESTED_GBOBJECT_MEM_SIZE_KB:
-    if (s->pitchlock >= 1) {
-      ret = ((s->new_height) * (s->pitchlock));
-    } else {
-      ret = ((s->new_height) * ((((s->new_depth) * (s->new_width)) / (8))));
-    };
+    ret = ((s->new_height) * (vmsvga_bytes_per_line(s)));
     VPRINT("SVGA_REG_SUGGESTED_GBOBJECT_MEM_SIZE_KB register %u with the "
            "return of %u\n",
            s->index, ret);
@@ -5423,9 +9007,13 @@ static uint32_t vmsvga_value_read(void *opaque, uint32_t address) {
     caps = 0xffffffff;
 #ifndef EXPCAPS
     caps -= SVGA_CAP_RECT_FILL;        // Windows 9x
-    caps -= SVGA_CAP_RECT_COPY;        // Windows 9x & Windows (XPDM)
+    if (!s->rect_copy) {
+      caps -= SVGA_CAP_RECT_COPY; // Windows 9x & Windows (XPDM)
+    };
     caps -= SVGA_CAP_LEGACY_OFFSCREEN; // Windows 9x
-    caps -= SVGA_CAP_SCREEN_OBJECT_2;  // Linux
+    if (!s->screen_object) {
+      caps -= SVGA_CAP_SCREEN_OBJECT_2; // Linux
+    };
     caps -= SVGA_CAP_CMD_BUFFERS_2;    // Windows (WDDM)
     caps -= SVGA_CAP_GBOBJECTS;        // Linux, Windows (XPDM) & Windows (WDDM)
 #endif
@@ -5454,11 +9042,11 @@ static uint32_t vmsvga_value_read(void *opaque, uint32_t address) {
            ret);
     break;
   case SVGA_REG_SYNC:
-    ret = s->sync;
+    ret = vmsvga_fifo_busy(s);
     VPRINT("SVGA_REG_SYNC register %u with the return of %u\n", s->index, ret);
     break;
   case SVGA_REG_BUSY:
-    ret = s->sync;
+    ret = vmsvga_fifo_busy_poll(s);
     VPRINT("SVGA_REG_BUSY register %u with the return of %u\n", s->index, ret);
     break;
   case SVGA_REG_GUEST_ID:
@@ -5502,16 +9090,12 @@ static uint32_t vmsvga_value_read(void *opaque, uint32_t address) {
            ret);
     break;
   case SVGA_REG_NUM_DISPLAYS:
-    ret = 1;
+    ret = s->num_screens;
     VPRINT("SVGA_REG_NUM_DISPLAYS register %u with the return of %u\n",
            s->index, ret);
     break;
   case SVGA_REG_PITCHLOCK:
-    if (s->pitchlock >= 1) {
-      ret = s->pitchlock;
-    } else {
-      ret = (((s->new_depth) * (s->new_width)) / (8));
-    };
+    ret = vmsvga_bytes_per_line(s);
     VPRINT("SVGA_REG_PITCHLOCK register %u with the return of %u\n", s->index,
            ret);
     break;
@@ -5568,7 +9152,7 @@ static uint32_t vmsvga_value_read(void *opaque, uint32_t address) {
            s->index, ret);
     break;
   case SVGA_REG_GMRS_MAX_PAGES:
-    ret = 196608;
+    ret = VMSVGA_GMR_MAX_PAGES;
     VPRINT("SVGA_REG_GMRS_MAX_PAGES register %u with the return of %u\n",
            s->index, ret);
     break;
@@ -5578,12 +9162,12 @@ static uint32_t vmsvga_value_read(void *opaque, uint32_t address) {
            ret);
     break;
   case SVGA_REG_GMR_MAX_IDS:
-    ret = 64;
+    ret = VMSVGA_GMR_MAX_IDS;
     VPRINT("SVGA_REG_GMR_MAX_IDS register %u with the return of %u\n", s->index,
            ret);
     break;
   case SVGA_REG_GMR_MAX_DESCRIPTOR_LENGTH:
-    ret = 4096;
+    ret = VMSVGA_GMR_MAX_DESCRIPTORS;
     VPRINT("SVGA_REG_GMR_MAX_DESCRIPTOR_LENGTH register %u with the return of "
            "%u\n",
            s->index, ret);
@@ -5609,7 +9193,7 @@ static uint32_t vmsvga_value_read(void *opaque, uint32_t address) {
            ret);
     break;
   case SVGA_REG_MEMORY_SIZE:
-    ret = s->vga.vram_size + 61440000;
+    ret = s->vga.vram_size;
     VPRINT("SVGA_REG_MEMORY_SIZE register %u with the return of %u\n", s->index,
            ret);
     break;
@@ -5628,7 +9212,7 @@ static uint32_t vmsvga_value_read(void *opaque, uint32_t address) {
            ret);
     break;
   case SVGA_REG_CURSOR_MAX_DIMENSION:
-    ret = 2048;
+    ret = VMSVGA_CURSOR_MAX_DIMENSION;
     VPRINT("SVGA_REG_CURSOR_MAX_DIMENSION register %u with the return of %u\n",
            s->index, ret);
     break;
@@ -6425,6 +10009,7 @@ static void vmsvga_value_write(void *opaque, uint32_t address, uint32_t value) {
   struct vmsvga_state_s *s = opaque;
   uint32_t irq_status;
   irq_status = 0;
+  vmsvga_capture_reg(s, s->index, value);
   VPRINT("Unknown register %u with the value of %u\n", s->index, value);
   switch (s->index) {
   case SVGA_REG_ID:
@@ -6443,40 +10028,45 @@ static void vmsvga_value_write(void *opaque, uint32_t address, uint32_t value) {
       s->config = 0;
     } else {
       s->enable = value;
+      vmsvga_mode_commit(s);
+      vmsvga_cursor_poll_arm(s);
     };
     VPRINT("SVGA_REG_ENABLE register %u with the value of %u\n", s->index,
            value);
     break;
   case SVGA_REG_WIDTH:
     if (value >= 1) {
-      s->new_width = value;
+      s->new_width = MIN(value, VMSVGA_MAX_WIDTH);
     } else {
       s->new_width = 1024;
       s->enable = 0;
       s->config = 0;
     };
+    vmsvga_mode_stage(s);
     VPRINT("SVGA_REG_WIDTH register %u with the value of %u\n", s->index,
            value);
     break;
   case SVGA_REG_HEIGHT:
     if (value >= 1) {
-      s->new_height = value;
+      s->new_height = MIN(value, VMSVGA_MAX_HEIGHT);
     } else {
       s->new_height = 768;
       s->enable = 0;
       s->config = 0;
     };
+    vmsvga_mode_stage(s);
     VPRINT("SVGA_REG_HEIGHT register %u with the value of %u\n", s->index,
            value);
     break;
   case SVGA_REG_BITS_PER_PIXEL:
     if (value >= 1) {
-      s->new_depth = value;
+      s->new_depth = MIN(value, 32);
     } else {
       s->new_depth = 32;
       s->enable = 0;
       s->config = 0;
     };
+    vmsvga_mode_stage(s);
     VPRINT("SVGA_REG_BITS_PER_PIXEL register %u with the value of %u\n",
            s->index, value);
     break;
@@ -6486,17 +10076,16 @@ static void vmsvga_value_write(void *opaque, uint32_t address, uint32_t value) {
       s->config = 0;
     } else {
       s->config = value;
+      vmsvga_mode_commit(s);
+      vmsvga_cursor_poll_arm(s);
     };
     VPRINT("SVGA_REG_CONFIG_DONE register %u with the value of %u\n", s->index,
            value);
     break;
   case SVGA_REG_SYNC:
-    if ((s->enable >= 1 || s->config >= 1) &&
-        (s->new_width >= 1 && s->new_height >= 1 && s->new_depth >= 1)) {
-      if (s->sync < 1 && value >= 1) {
-        s->sync = 1;
-        vmsvga_fifo_run(s);
-      };
+    if (vmsvga_fifo_enabled(s) && value >= 1) {
+      qatomic_inc(&s->sync_req);
+      vmsvga_fifo_kick(s);
     };
     VPRINT("SVGA_REG_SYNC register %u with the value of %u\n", s->index, value);
     break;
@@ -6515,34 +10104,42 @@ static void vmsvga_value_write(void *opaque, uint32_t address, uint32_t value) {
     break;
   case SVGA_REG_CURSOR_X:
     s->fifo[SVGA_FIFO_CURSOR_X] = value;
+    s->cursor_pending = 1;
+    vmsvga_cursor_poll_arm(s);
     VPRINT("SVGA_REG_CURSOR_X register %u with the value of %u\n", s->index,
            value);
     break;
   case SVGA_REG_CURSOR_Y:
     s->fifo[SVGA_FIFO_CURSOR_Y] = value;
+    s->cursor_pending = 1;
+    vmsvga_cursor_poll_arm(s);
     VPRINT("SVGA_REG_CURSOR_Y register %u with the value of %u\n", s->index,
            value);
     break;
   case SVGA_REG_CURSOR_ON:
     s->fifo[SVGA_FIFO_CURSOR_ON] = value;
+    s->cursor_pending = 1;
+    vmsvga_cursor_poll_arm(s);
     VPRINT("SVGA_REG_CURSOR_ON register %u with the value of %u\n", s->index,
            value);
     break;
   case SVGA_REG_BYTES_PER_LINE:
-    if (value >= 1) {
-      // s->pitchlock = value;
+    if (value >= 1 && value <= s->vga.vram_size) {
+      s->pitchlock = value;
     } else {
-      // s->pitchlock = (((s->new_depth) * (s->new_width)) / (8));
+      s->pitchlock = 0;
     };
+    vmsvga_mode_stage(s);
     VPRINT("SVGA_REG_BYTES_PER_LINE register %u with the value of %u\n",
            s->index, value);
     break;
   case SVGA_REG_PITCHLOCK:
-    if (value >= 1) {
-      // s->pitchlock = value;
+    if (value >= 1 && value <= s->vga.vram_size) {
+      s->pitchlock = value;
     } else {
-      // s->pitchlock = (((s->new_depth) * (s->new_width)) / (8));
+      s->pitchlock = 0;
     };
+    vmsvga_mode_stage(s);
     VPRINT("SVGA_REG_PITCHLOCK register %u with the value of %u\n", s->index,
            value);
     break;
@@ -6622,6 +10219,7 @@ static void vmsvga_value_write(void *opaque, uint32_t address, uint32_t value) {
       s->enable = 0;
       s->config = 0;
     };
+    vmsvga_mode_stage(s);
     VPRINT("SVGA_REG_DISPLAY_WIDTH register %u with the value of %u\n",
            s->index, value);
     break;
@@ -6633,6 +10231,7 @@ static void vmsvga_value_write(void *opaque, uint32_t address, uint32_t value) {
       s->enable = 0;
       s->config = 0;
     };
+    vmsvga_mode_stage(s);
     VPRINT("SVGA_REG_DISPLAY_HEIGHT register %u with the value of %u\n",
            s->index, value);
     break;
@@ -6658,6 +10257,7 @@ static void vmsvga_value_write(void *opaque, uint32_t address, uint32_t value) {
     break;
   case SVGA_REG_GMR_DESCRIPTOR:
     s->gmrdesc = value;
+    vmsvga_gmr_define_desc(s, s->gmrid, value);
     VPRINT("SVGA_REG_GMR_DESCRIPTOR register %u with the value of %u\n",
            s->index, value);
     break;
@@ -6937,6 +10537,10 @@ static void vmsvga_value_write(void *opaque, uint32_t address, uint32_t value) {
   if (s->index >= SVGA_REG_PALETTE_MIN && s->index <= SVGA_REG_PALETTE_MAX) {
     uint32_t idx = s->index - SVGA_REG_PALETTE_MIN;
     s->svgapalettebase[idx] = value;
+    s->palette_dirty = 1;
+    if (s->mode_depth == 8) {
+      s->shadow_dirty = 1;
+    };
     VPRINT("SVGA_REG_PALETTE_%u register %u with the value of %u\n", s->index,
            s->index, value);
   };
@@ -6978,18 +10582,41 @@ static void vmsvga_bios_write(void *opaque, uint32_t address, uint32_t data) {
   s->bios = data;
   VPRINT("vmsvga_bios_write %u %u\n", address, data);
 };
+// A refresh means a listener wants a frame, so anything skipped while
+// nobody asked is rebuilt and redrawn in full
+static void vmsvga_refresh_resume(struct vmsvga_state_s *s) {
+  s->refresh_last = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+  if (s->refresh_stalled >= 1) {
+    VPRINT("vmsvga_refresh_resume: listener is back\n");
+    s->refresh_stalled = 0;
+    s->surface_gen = 0;
+    s->shadow_dirty = 1;
+    s->palette_dirty = 1;
+    s->cursor_pending = 1;
+    if (s->cursor_shown != NULL) {
+      dpy_cursor_define(s->vga.con, s->cursor_shown);
+    };
+  };
+};
 static void vmsvga_update_display(void *opaque) {
   // VPRINT("vmsvga_update_display was just executed\n");
   struct vmsvga_state_s *s = opaque;
+  vmsvga_refresh_resume(s);
   if ((s->enable >= 1 || s->config >= 1) &&
       (s->new_width >= 1 && s->new_height >= 1 && s->new_depth >= 1)) {
-    vmsvga_check_size(s);
-    if (s->sync < 1) {
-      s->sync = 1;
-      vmsvga_fifo_run(s);
-      cursor_update_from_fifo(s);
+    vmsvga_mode_poll(s);
+    if (qatomic_read(&s->sync) < 1) {
+      vmsvga_fifo_kick(s);
     };
+    vmsvga_check_size(s);
+    cursor_update_from_fifo(s);
+    // the dirty log is read on every tick, plain CPU writes to VRAM bump
+    // no counter. An idle scanout reports no damage, which is what lets
+    // listeners such as VNC stretch their own refresh interval
+    vmsvga_scanout_refresh(s);
   } else {
+    s->shadow_active = 0;
+    s->surface_gen = 0;
     s->vcs = s->vga;
     s->vga.hw_ops->gfx_update(&s->vcs);
   };
@@ -7000,9 +10627,31 @@ static void vmsvga_reset(DeviceState *dev) {
   struct vmsvga_state_s *s = &pci->chip;
   s->enable = 0;
   s->config = 0;
+  s->pitchlock = 0;
+  vmsvga_mode_stage(s);
+  qemu_mutex_lock(&s->fifo_lock);
+  vmsvga_cursor_cache_reset(s);
+  vmsvga_gmr_reset(s);
+  vmsvga_context_reset(s);
+  vmsvga_dx_reset(s);
+  g_hash_table_remove_all(s->shader_cache);
+  vmsvga_surface_reset(s);
+  vmsvga_objects_check(s);
+  vmsvga_screen_reset(s);
+  vmsvga_screen_apply(s);
+  qemu_mutex_unlock(&s->fifo_lock);
+  s->cursor_pending = 1;
 };
 static void vmsvga_invalidate_display(void *opaque) {
   VPRINT("vmsvga_invalidate_display was just executed\n");
+  struct vmsvga_state_s *s = opaque;
+  s->shadow_dirty = 1;
+  s->surface_gen = 0;
+  if (s->cursor_shown != NULL) {
+    vmsvga_cursor_unref(s->cursor_shown);
+    s->cursor_shown = NULL;
+  };
+  s->cursor_pending = 1;
 };
 static void vmsvga_text_update(void *opaque, console_ch_t *chardata) {
   VPRINT("vmsvga_text_update was just executed\n");
@@ -7011,14 +10660,315 @@ static void vmsvga_text_update(void *opaque, console_ch_t *chardata) {
     s->vga.hw_ops->text_update(&s->vga, chardata);
   };
 };
+// Backstop for a blocker that could not be added because a migration was
+// already running when the first 3D object appeared
+static int vmsvga_pre_save(void *opaque) {
+  VPRINT("vmsvga_pre_save was just executed\n");
+  struct vmsvga_state_s *s = opaque;
+  if (s->objects_live) {
+    error_report("vmware-svga: 3D surfaces, contexts and shaders are in use "
+                 "and cannot be migrated");
+    return -EBUSY;
+  };
+  return 0;
+};
+static int vmsvga_pre_load(void *opaque) {
+  VPRINT("vmsvga_pre_load was just executed\n");
+  struct vmsvga_state_s *s = opaque;
+  s->mode_loaded = false;
+  return 0;
+};
 static int vmsvga_post_load(void *opaque, int version_id) {
   VPRINT("vmsvga_post_load was just executed\n");
+  struct vmsvga_state_s *s = opaque;
+  // the ring bounds are checked against fifo_size, which must be the BAR
+  if (s->fifo_size != memory_region_size(&s->fifo_ram)) {
+    return -EINVAL;
+  };
+  // without the mode subsection the scanout is whatever the registers stage
+  if (!s->mode_loaded && s->mode_screen < 1) {
+    vmsvga_mode_commit(s);
+  };
+  s->mode_seen = s->mode_staged;
+  s->mode_polled = s->mode_staged;
+  s->surface_gen = 0;
+  s->shadow_dirty = 1;
+  s->palette_dirty = 1;
+  s->cursor_pending = 1;
+  vmsvga_cursor_poll_arm(s);
+  // pending commands are still in the migrated FIFO RAM, the worker picks
+  // them up once the VM runs again, until then BUSY must stay set
+  s->sync = 0;
+  qatomic_set(&s->sync_done, s->sync_req);
+  if (vmsvga_fifo_enabled(s) &&
+      s->fifo[SVGA_FIFO_NEXT_CMD] != s->fifo[SVGA_FIFO_STOP]) {
+    qatomic_inc(&s->sync_req);
+  };
+  return 0;
+};
+// A destination that does not get this subsection commits the staged
+// registers, so it is only sent when that would not give the same result
+static bool vmsvga_mode_needed(void *opaque) {
+  struct vmsvga_state_s *s = opaque;
+  uint32_t i;
+  if (s->mode_width != s->new_width || s->mode_height != s->new_height ||
+      s->mode_depth != s->new_depth ||
+      s->mode_stride != vmsvga_bytes_per_line(s)) {
+    return true;
+  };
+  // the cursor poll takes a pitch it did not publish as a guest write
+  if (s->fifo_pitchlock != 0 &&
+      s->fifo_pitchlock != vmsvga_bytes_per_line(s)) {
+    return true;
+  };
+  for (i = 0; i < s->scratch_size; i++) {
+    if (s->scratch[i] != 0) {
+      return true;
+    };
+  };
+  return false;
+};
+static int vmsvga_mode_post_load(void *opaque, int version_id) {
+  VPRINT("vmsvga_mode_post_load was just executed\n");
+  struct vmsvga_state_s *s = opaque;
+  if ((uint64_t)s->mode_stride * s->mode_height > s->vga.vram_size) {
+    return -EINVAL;
+  };
+  s->mode_loaded = true;
+  return 0;
+};
+static VMStateDescription vmstate_vmware_vga_mode = {
+    .name = "vmware_vga_internal/mode",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = vmsvga_mode_needed,
+    .post_load = vmsvga_mode_post_load,
+    .fields = (const VMStateField[]){
+        VMSTATE_UINT32(fifo_pitchlock, struct vmsvga_state_s),
+        VMSTATE_UINT32(mode_width, struct vmsvga_state_s),
+        VMSTATE_UINT32(mode_height, struct vmsvga_state_s),
+        VMSTATE_UINT32(mode_depth, struct vmsvga_state_s),
+        VMSTATE_UINT32(mode_stride, struct vmsvga_state_s),
+        VMSTATE_UINT32(mode_gen, struct vmsvga_state_s),
+        VMSTATE_UINT32(cursor_count, struct vmsvga_state_s),
+        VMSTATE_VARRAY_UINT32(scratch, struct vmsvga_state_s, scratch_size, 0,
+                              vmstate_info_uint32, uint32_t),
+        VMSTATE_END_OF_LIST()}};
+static bool vmsvga_cursor_needed(void *opaque) {
+  struct vmsvga_state_s *s = opaque;
+  return s->cursor_shown != NULL;
+};
+static int vmsvga_cursor_pre_save(void *opaque) {
+  VPRINT("vmsvga_cursor_pre_save was just executed\n");
+  struct vmsvga_state_s *s = opaque;
+  QEMUCursor *qc = s->cursor_shown;
+  g_free(s->cursor_mig_data);
+  s->cursor_mig_data = NULL;
+  s->cursor_mig_size = 0;
+  if (qc == NULL) {
+    return 0;
+  };
+  s->cursor_mig_width = qc->width;
+  s->cursor_mig_height = qc->height;
+  s->cursor_mig_hot_x = qc->hot_x;
+  s->cursor_mig_hot_y = qc->hot_y;
+  s->cursor_mig_size = qc->width * qc->height * sizeof(uint32_t);
+  s->cursor_mig_data = g_memdup2(qc->data, s->cursor_mig_size);
+  return 0;
+};
+static int vmsvga_cursor_post_load(void *opaque, int version_id) {
+  VPRINT("vmsvga_cursor_post_load was just executed\n");
+  struct vmsvga_state_s *s = opaque;
+  QEMUCursor *qc;
+  if (s->cursor_mig_width < 1 || s->cursor_mig_height < 1 ||
+      s->cursor_mig_width > VMSVGA_CURSOR_MAX_DIMENSION ||
+      s->cursor_mig_height > VMSVGA_CURSOR_MAX_DIMENSION ||
+      s->cursor_mig_size != (s->cursor_mig_width * s->cursor_mig_height *
+                             sizeof(uint32_t))) {
+    return -EINVAL;
+  };
+  qc = cursor_alloc(s->cursor_mig_width, s->cursor_mig_height);
+  if (qc != NULL) {
+    qc->hot_x = s->cursor_mig_hot_x;
+    qc->hot_y = s->cursor_mig_hot_y;
+    memcpy(qc->data, s->cursor_mig_data, s->cursor_mig_size);
+    qemu_mutex_lock(&s->fifo_lock);
+    vmsvga_cursor_cache_reset(s);
+    qemu_mutex_unlock(&s->fifo_lock);
+    vmsvga_cursor_show(s, qc);
+    vmsvga_cursor_unref(qc);
+  };
+  g_free(s->cursor_mig_data);
+  s->cursor_mig_data = NULL;
+  s->cursor_mig_size = 0;
+  return 0;
+};
+static VMStateDescription vmstate_vmware_vga_cursor = {
+    .name = "vmware_vga_internal/cursor",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = vmsvga_cursor_needed,
+    .pre_save = vmsvga_cursor_pre_save,
+    .post_load = vmsvga_cursor_post_load,
+    .fields = (const VMStateField[]){
+        VMSTATE_UINT32(cursor_mig_width, struct vmsvga_state_s),
+        VMSTATE_UINT32(cursor_mig_height, struct vmsvga_state_s),
+        VMSTATE_UINT32(cursor_mig_hot_x, struct vmsvga_state_s),
+        VMSTATE_UINT32(cursor_mig_hot_y, struct vmsvga_state_s),
+        VMSTATE_UINT32(cursor_mig_size, struct vmsvga_state_s),
+        VMSTATE_VBUFFER_ALLOC_UINT32(cursor_mig_data, struct vmsvga_state_s, 0,
+                                     NULL, cursor_mig_size),
+        VMSTATE_END_OF_LIST()}};
+static VMStateDescription vmstate_vmware_vga_screen_object = {
+    .name = "vmware_vga_screen_object",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]){
+        VMSTATE_UINT32(defined, struct vmsvga_screen_s),
+        VMSTATE_UINT32(flags, struct vmsvga_screen_s),
+        VMSTATE_UINT32(width, struct vmsvga_screen_s),
+        VMSTATE_UINT32(height, struct vmsvga_screen_s),
+        VMSTATE_INT32(root_x, struct vmsvga_screen_s),
+        VMSTATE_INT32(root_y, struct vmsvga_screen_s),
+        VMSTATE_UINT32(offset, struct vmsvga_screen_s),
+        VMSTATE_UINT32(pitch, struct vmsvga_screen_s),
+        VMSTATE_END_OF_LIST()}};
+static bool vmsvga_screen_needed(void *opaque) {
+  struct vmsvga_state_s *s = opaque;
+  uint32_t i;
+  for (i = 0; i < VMSVGA_MAX_SCREENS; i++) {
+    if (s->screen[i].defined >= 1) {
+      return true;
+    };
+  };
+  return s->mode_screen >= 1 || s->gmrfb_bpp != 0;
+};
+static int vmsvga_screen_post_load(void *opaque, int version_id) {
+  VPRINT("vmsvga_screen_post_load was just executed\n");
+  struct vmsvga_state_s *s = opaque;
+  uint32_t i;
+  for (i = 0; i < VMSVGA_MAX_SCREENS; i++) {
+    if (s->screen[i].defined >= 1 && i >= s->num_screens) {
+      return -EINVAL;
+    };
+    if (i >= 1) {
+      s->head[i].screen = s->screen[i];
+      s->head[i].gen++;
+    };
+  };
+  if (s->mode_screen >= 1 && ((uint64_t)s->mode_offset +
+                              ((uint64_t)s->mode_stride * s->mode_height)) >
+                                 s->vga.vram_size) {
+    return -EINVAL;
+  };
+  return 0;
+};
+static VMStateDescription vmstate_vmware_vga_screen = {
+    .name = "vmware_vga_internal/screen",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = vmsvga_screen_needed,
+    .post_load = vmsvga_screen_post_load,
+    .fields = (const VMStateField[]){
+        VMSTATE_UINT32(mode_offset, struct vmsvga_state_s),
+        VMSTATE_UINT32(mode_screen, struct vmsvga_state_s),
+        VMSTATE_STRUCT_ARRAY(screen, struct vmsvga_state_s, VMSVGA_MAX_SCREENS,
+                             1, vmstate_vmware_vga_screen_object,
+                             struct vmsvga_screen_s),
+        VMSTATE_UINT32(gmrfb_gmr, struct vmsvga_state_s),
+        VMSTATE_UINT32(gmrfb_offset, struct vmsvga_state_s),
+        VMSTATE_UINT32(gmrfb_pitch, struct vmsvga_state_s),
+        VMSTATE_UINT32(gmrfb_bpp, struct vmsvga_state_s),
+        VMSTATE_END_OF_LIST()}};
+static bool vmsvga_gmr_needed(void *opaque) {
+  struct vmsvga_state_s *s = opaque;
+  uint32_t i;
+  for (i = 0; i < VMSVGA_GMR_MAX_IDS; i++) {
+    if (s->gmr[i].num_pages >= 1) {
+      return true;
+    };
+  };
+  return false;
+};
+// GMR page lists travel as one little-endian blob, a page count per GMR
+// followed by that many 64-bit page numbers
+static int vmsvga_gmr_pre_save(void *opaque) {
+  VPRINT("vmsvga_gmr_pre_save was just executed\n");
+  struct vmsvga_state_s *s = opaque;
+  uint64_t *out;
+  uint32_t words = 0;
+  uint32_t i;
+  uint32_t j;
+  qemu_mutex_lock(&s->fifo_lock);
+  vmsvga_gmr_apply(s);
+  qemu_mutex_unlock(&s->fifo_lock);
+  for (i = 0; i < VMSVGA_GMR_MAX_IDS; i++) {
+    words += 1 + s->gmr[i].num_pages;
+  };
+  g_free(s->gmr_mig_data);
+  s->gmr_mig_size = words * sizeof(uint64_t);
+  s->gmr_mig_data = g_malloc(s->gmr_mig_size);
+  out = (uint64_t *)s->gmr_mig_data;
+  for (i = 0; i < VMSVGA_GMR_MAX_IDS; i++) {
+    *out++ = cpu_to_le64(s->gmr[i].num_pages);
+    for (j = 0; j < s->gmr[i].num_pages; j++) {
+      *out++ = cpu_to_le64(s->gmr[i].pages[j]);
+    };
+  };
   return 0;
 };
+static int vmsvga_gmr_post_load(void *opaque, int version_id) {
+  VPRINT("vmsvga_gmr_post_load was just executed\n");
+  struct vmsvga_state_s *s = opaque;
+  uint64_t *in = (uint64_t *)s->gmr_mig_data;
+  uint32_t words = s->gmr_mig_size / sizeof(uint64_t);
+  uint32_t num_pages;
+  uint32_t i;
+  uint32_t j;
+  int ret = 0;
+  qemu_mutex_lock(&s->fifo_lock);
+  vmsvga_gmr_reset(s);
+  for (i = 0; i < VMSVGA_GMR_MAX_IDS; i++) {
+    if (words < 1) {
+      ret = -EINVAL;
+      break;
+    };
+    num_pages = le64_to_cpu(*in++);
+    words--;
+    if (num_pages > VMSVGA_GMR_MAX_PAGES || num_pages > words) {
+      ret = -EINVAL;
+      break;
+    };
+    vmsvga_gmr_define(s, i, num_pages);
+    for (j = 0; j < num_pages; j++) {
+      s->gmr[i].pages[j] = le64_to_cpu(*in++);
+    };
+    words -= num_pages;
+  };
+  qemu_mutex_unlock(&s->fifo_lock);
+  g_free(s->gmr_mig_data);
+  s->gmr_mig_data = NULL;
+  s->gmr_mig_size = 0;
+  return ret;
+};
+static VMStateDescription vmstate_vmware_vga_gmr = {
+    .name = "vmware_vga_internal/gmr",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = vmsvga_gmr_needed,
+    .pre_save = vmsvga_gmr_pre_save,
+    .post_load = vmsvga_gmr_post_load,
+    .fields = (const VMStateField[]){
+        VMSTATE_UINT32(gmr_mig_size, struct vmsvga_state_s),
+        VMSTATE_VBUFFER_ALLOC_UINT32(gmr_mig_data, struct vmsvga_state_s, 0,
+                                     NULL, gmr_mig_size),
+        VMSTATE_END_OF_LIST()}};
 static VMStateDescription vmstate_vmware_vga_internal = {
     .name = "vmware_vga_internal",
     .version_id = 1,
     .minimum_version_id = 0,
+    .pre_save = vmsvga_pre_save,
+    .pre_load = vmsvga_pre_load,
     .post_load = vmsvga_post_load,
     .fields = (const VMStateField[]){
         VMSTATE_UINT32_ARRAY(svgapalettebase, struct vmsvga_state_s,
@@ -7058,7 +11008,10 @@ static VMStateDescription vmstate_vmware_vga_internal = {
         VMSTATE_UINT32(cursor, struct vmsvga_state_s),
         VMSTATE_UINT32(fc, struct vmsvga_state_s),
         VMSTATE_UINT32(ff, struct vmsvga_state_s),
-        VMSTATE_END_OF_LIST()}};
+        VMSTATE_END_OF_LIST()},
+    .subsections = (const VMStateDescription *const[]){
+        &vmstate_vmware_vga_mode, &vmstate_vmware_vga_cursor,
+        &vmstate_vmware_vga_screen, &vmstate_vmware_vga_gmr, NULL}};
 static VMStateDescription vmstate_vmware_vga = {
     .name = "vmware_vga",
     .version_id = 0,
@@ -7073,18 +11026,46 @@ static GraphicHwOps vmsvga_ops = {
     .gfx_update = vmsvga_update_display,
     .text_update = vmsvga_text_update,
 };
+static GraphicHwOps vmsvga_head_ops = {
+    .invalidate = vmsvga_head_invalidate,
+    .gfx_update = vmsvga_head_update,
+};
 static void vmsvga_init(DeviceState *dev, struct vmsvga_state_s *s,
                         MemoryRegion *address_space, MemoryRegion *io) {
   VPRINT("vmsvga_init was just executed\n");
   s->scratch_size = 32;
   s->scratch = g_malloc(s->scratch_size * 4);
+  uint32_t i;
   s->vga.con = graphic_console_init(dev, 0, &vmsvga_ops, s);
-  s->fifo_size = 2097152;
+  for (i = 1; i < s->num_screens; i++) {
+    s->head[i].s = s;
+    s->head[i].gen = 1;
+    s->head[i].con = graphic_console_init(dev, i, &vmsvga_head_ops,
+                                          &s->head[i]);
+  };
   memory_region_init_ram(&s->fifo_ram, NULL, "vmsvga.fifo", s->fifo_size,
                          &error_fatal);
   s->fifo = (uint32_t *)memory_region_get_ram_ptr(&s->fifo_ram);
   vga_common_init(&s->vga, OBJECT(dev), &error_fatal);
   vga_init(&s->vga, OBJECT(dev), address_space, io, true);
+  memory_region_set_log(&s->vga.vram, true, DIRTY_MEMORY_VGA);
+  s->cursor_timer = timer_new_ms(QEMU_CLOCK_REALTIME, vmsvga_cursor_poll, s);
+  s->fifo_bh = qemu_bh_new(vmsvga_fifo_bh, s);
+  s->surfaces = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                      vmsvga_surface_free);
+  s->shader_cache = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL,
+                                          vmsvga_shader_free);
+  s->mobs = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  s->dx_shaders = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                        vmsvga_dx_shader_free);
+  qemu_mutex_init(&s->fifo_lock);
+  qemu_mutex_init(&s->bh_lock);
+  qemu_event_init(&s->fifo_event, false);
+  qemu_mutex_init(&s->shader_io_lock);
+  qemu_event_init(&s->shader_io_event, false);
+  g_queue_init(&s->shader_io_todo);
+  g_queue_init(&s->shader_io_done);
+  qemu_add_vm_change_state_handler(vmsvga_vm_state_change, s);
 #ifdef QEMU_V9_2_0
   vmstate_register_any(NULL, &vmstate_vga_common, &s->vga);
 #else
@@ -7093,18 +11074,26 @@ static void vmsvga_init(DeviceState *dev, struct vmsvga_state_s *s,
   if (s->thread < 1) {
     s->thread++;
     s->fifo[SVGA_FIFO_CURSOR_ON] = SVGA_CURSOR_ON_SHOW;
+    s->fifo[SVGA_FIFO_RESERVED] = 0;
     s->new_width = 1024;
     s->new_height = 768;
     s->new_depth = 32;
+    vmsvga_mode_commit(s);
     pthread_t threads[1];
     s->ff = 0xffffffff;
     s->fc = 0xffffffff;
 #ifndef EXPCAPS
-    s->ff -= SVGA_FIFO_FLAG_ACCELFRONT;     // Windows (XPDM)
-    s->fc -= SVGA_FIFO_CAP_SCREEN_OBJECT;   // Windows (WDDM)
-    s->fc -= SVGA_FIFO_CAP_SCREEN_OBJECT_2; // Windows (WDDM)
+    s->ff -= SVGA_FIFO_FLAG_ACCELFRONT; // Windows (XPDM)
+    if (!s->screen_object) {
+      s->fc -= SVGA_FIFO_CAP_SCREEN_OBJECT;   // Windows (WDDM)
+      s->fc -= SVGA_FIFO_CAP_SCREEN_OBJECT_2; // Windows (WDDM)
+    };
 #endif
     pthread_create(threads, NULL, vmsvga_loop, (void *)s);
+    pthread_create(threads, NULL, vmsvga_fifo_worker, (void *)s);
+    if (s->shader_cache_dir != NULL) {
+      pthread_create(threads, NULL, vmsvga_shader_io, (void *)s);
+    };
   };
 };
 static uint64_t vmsvga_io_read(void *opaque, hwaddr addr, unsigned size) {
@@ -7169,25 +11158,144 @@ static MemoryRegionOps vmsvga_io_ops = {
 static void pci_vmsvga_realize(PCIDevice *dev, Error **errp) {
   VPRINT("pci_vmsvga_realize was just executed\n");
   struct pci_vmsvga_state_s *s = VMWARE_SVGA(dev);
+  uint32_t i;
+  if (s->chip.fifo_size < VMSVGA_FIFO_SIZE_MIN ||
+      s->chip.fifo_size > VMSVGA_FIFO_SIZE_MAX) {
+    error_setg(errp, "vmware-svga: fifo_size must be between %u and %u bytes",
+               VMSVGA_FIFO_SIZE_MIN, VMSVGA_FIFO_SIZE_MAX);
+    return;
+  };
+  if (s->chip.num_screens < 1 || s->chip.num_screens > VMSVGA_MAX_SCREENS) {
+    error_setg(errp, "vmware-svga: screens must be between 1 and %u",
+               VMSVGA_MAX_SCREENS);
+    return;
+  };
+  // 3D context commands are decoded either way, "none" leaves them unexecuted
+  s->chip.render = vmsvga_render_backends[0];
+  if (s->chip.render_backend != NULL) {
+    s->chip.render = NULL;
+    for (i = 0; i < ARRAY_SIZE(vmsvga_render_backends); i++) {
+      if (!strcmp(s->chip.render_backend, vmsvga_render_backends[i]->name)) {
+        s->chip.render = vmsvga_render_backends[i];
+      };
+    };
+    if (s->chip.render == NULL && strcmp(s->chip.render_backend, "none")) {
+      error_setg(errp, "vmware-svga: unknown render-backend '%s'",
+                 s->chip.render_backend);
+      return;
+    };
+  };
+  // "auto" keeps the shader cache with the other per-user caches, so every
+  // VM of the user shares it
+  if (s->chip.shader_cache_dir != NULL) {
+    if (!strcmp(s->chip.shader_cache_dir, "auto")) {
+      g_free(s->chip.shader_cache_dir);
+      s->chip.shader_cache_dir = g_build_filename(
+          g_get_user_cache_dir(), "qemu", "vmware-svga", NULL);
+    };
+    if (s->chip.shader_cache_size_mb < 1) {
+      error_setg(errp, "vmware-svga: shader-cache-size-mb must be at least 1");
+      return;
+    };
+    if (g_mkdir_with_parents(s->chip.shader_cache_dir, 0700) < 0) {
+      error_setg_errno(errp, errno,
+                       "vmware-svga: cannot create shader-cache-dir '%s'",
+                       s->chip.shader_cache_dir);
+      return;
+    };
+  };
+  // the FIFO is exposed as a BAR so its size has to be a power of two
+  s->chip.fifo_size = pow2ceil(s->chip.fifo_size);
   dev->config[PCI_INTERRUPT_PIN] = 1;
   dev->config[PCI_LATENCY_TIMER] = 64;
   dev->config[PCI_CACHE_LINE_SIZE] = 32;
   memory_region_init_io(&s->io_bar, OBJECT(dev), &vmsvga_io_ops, &s->chip,
                         "vmsvga-io", 0x10);
   memory_region_set_flush_coalesced(&s->io_bar);
+  // opened before vmsvga_init starts the device threads, so a failure
+  // leaves nothing running
+  if (s->chip.capture_path != NULL) {
+    vmsvga_capture_open(&s->chip, errp);
+    if (s->chip.capture_file == NULL) {
+      return;
+    };
+  };
   pci_register_bar(dev, 0, PCI_BASE_ADDRESS_SPACE_IO, &s->io_bar);
   vmsvga_init(DEVICE(dev), &s->chip, pci_address_space(dev),
               pci_address_space_io(dev));
   pci_register_bar(dev, 1, PCI_BASE_ADDRESS_MEM_PREFETCH, &s->chip.vga.vram);
   pci_register_bar(dev, 2, PCI_BASE_ADDRESS_MEM_TYPE_32, &s->chip.fifo_ram);
+  if (s->chip.capture_file != NULL) {
+    vmsvga_capture_start(&s->chip);
+  };
 };
 static Property vga_vmware_properties[] = {
     DEFINE_PROP_UINT32("vgamem_mb", struct pci_vmsvga_state_s,
                        chip.vga.vram_size_mb, 128),
+    DEFINE_PROP_UINT32("fifo_size", struct pci_vmsvga_state_s, chip.fifo_size,
+                       2097152),
     DEFINE_PROP_BOOL("global-vmstate", struct pci_vmsvga_state_s,
                      chip.vga.global_vmstate, true),
+    DEFINE_PROP_STRING("capture", struct pci_vmsvga_state_s,
+                       chip.capture_path),
+    DEFINE_PROP_BOOL("cursor-premultiplied", struct pci_vmsvga_state_s,
+                     chip.cursor_premultiplied, true),
+    DEFINE_PROP_BOOL("rect-copy", struct pci_vmsvga_state_s, chip.rect_copy,
+                     false),
+    DEFINE_PROP_BOOL("screen-object", struct pci_vmsvga_state_s,
+                     chip.screen_object, false),
+    DEFINE_PROP_UINT32("screens", struct pci_vmsvga_state_s, chip.num_screens,
+                       1),
+    DEFINE_PROP_BOOL("shadow-surface", struct pci_vmsvga_state_s, chip.shadow,
+                     false),
+    DEFINE_PROP_STRING("render-backend", struct pci_vmsvga_state_s,
+                       chip.render_backend),
+    DEFINE_PROP_UINT32("surface-budget-mb", struct pci_vmsvga_state_s,
+                       chip.surface_budget_mb, VMSVGA_SURFACE_BUDGET_MB),
+    DEFINE_PROP_STRING("shader-cache-dir", struct pci_vmsvga_state_s,
+                       chip.shader_cache_dir),
+    DEFINE_PROP_UINT32("shader-cache-size-mb", struct pci_vmsvga_state_s,
+                       chip.shader_cache_size_mb, VMSVGA_SHADER_DISK_MB),
     DEFINE_PROP_END_OF_LIST(),
 };
+static void vmsvga_get_vram_resident(Object *obj, Visitor *v, const char *name,
+                                     void *opaque, Error **errp) {
+  VPRINT("vmsvga_get_vram_resident was just executed\n");
+  struct pci_vmsvga_state_s *pci = VMWARE_SVGA(obj);
+  struct vmsvga_state_s *s = &pci->chip;
+  uint64_t resident = s->vga.vram_size;
+#ifndef _WIN32
+  if (s->vga.vram_ptr != NULL) {
+    size_t page = qemu_real_host_page_size();
+    size_t pages = DIV_ROUND_UP(s->vga.vram_size, page);
+    unsigned char *vec = g_malloc(pages);
+    size_t i;
+    if (mincore(s->vga.vram_ptr, s->vga.vram_size, (void *)vec) == 0) {
+      resident = 0;
+      for (i = 0; i < pages; i++) {
+        if (vec[i] & 1) {
+          resident += page;
+        };
+      };
+    };
+    g_free(vec);
+  };
+#endif
+  visit_type_uint64(v, name, &resident, errp);
+};
+// Counters kept by the FIFO thread, opaque is the field offset. They are
+// read without fifo_lock so a QOM query never waits for a batch
+static void vmsvga_get_counter(Object *obj, Visitor *v, const char *name,
+                               void *opaque, Error **errp) {
+  VPRINT("vmsvga_get_counter was just executed\n");
+  struct pci_vmsvga_state_s *pci = VMWARE_SVGA(obj);
+  struct vmsvga_state_s *s = &pci->chip;
+  uint64_t value = 0;
+  if (s->surfaces != NULL) {
+    value = qatomic_read_u64((uint64_t *)((uint8_t *)s + (uintptr_t)opaque));
+  };
+  visit_type_uint64(v, name, &value, errp);
+};
 static void vmsvga_class_init(ObjectClass *klass, void *data) {
   VPRINT("vmsvga_class_init was just executed\n");
   DeviceClass *dc = DEVICE_CLASS(klass);
@@ -7207,6 +11315,48 @@ static void vmsvga_class_init(ObjectClass *klass, void *data) {
 #endif
   dc->vmsd = &vmstate_vmware_vga;
   device_class_set_props(dc, vga_vmware_properties);
+  object_class_property_add(klass, "vram-resident", "uint64",
+                            vmsvga_get_vram_resident, NULL, NULL, NULL);
+  // surface-resident includes cached arena blocks
+  object_class_property_add(
+      klass, "surface-resident", "uint64", vmsvga_get_counter, NULL, NULL,
+      (void *)offsetof(struct vmsvga_state_s, surface_bytes));
+  object_class_property_add(
+      klass, "render-state-sets", "uint64", vmsvga_get_counter, NULL, NULL,
+      (void *)offsetof(struct vmsvga_state_s, state_sets));
+  object_class_property_add(
+      klass, "render-state-dropped", "uint64", vmsvga_get_counter, NULL, NULL,
+      (void *)offsetof(struct vmsvga_state_s, state_dropped));
+  object_class_property_add(
+      klass, "render-state-flushes", "uint64", vmsvga_get_counter, NULL, NULL,
+      (void *)offsetof(struct vmsvga_state_s, state_flushes));
+  object_class_property_add(
+      klass, "render-draws-truncated", "uint64", vmsvga_get_counter, NULL,
+      NULL, (void *)offsetof(struct vmsvga_state_s, draws_truncated));
+  object_class_property_add(
+      klass, "shader-cache-hits", "uint64", vmsvga_get_counter, NULL, NULL,
+      (void *)offsetof(struct vmsvga_state_s, shader_hits));
+  object_class_property_add(
+      klass, "shader-cache-misses", "uint64", vmsvga_get_counter, NULL, NULL,
+      (void *)offsetof(struct vmsvga_state_s, shader_misses));
+  object_class_property_add(
+      klass, "shader-cache-bytes", "uint64", vmsvga_get_counter, NULL, NULL,
+      (void *)offsetof(struct vmsvga_state_s, shader_cache_bytes));
+  object_class_property_add(
+      klass, "shader-failures", "uint64", vmsvga_get_counter, NULL, NULL,
+      (void *)offsetof(struct vmsvga_state_s, shader_failures));
+  object_class_property_add(
+      klass, "shader-translate-ns", "uint64", vmsvga_get_counter, NULL, NULL,
+      (void *)offsetof(struct vmsvga_state_s, shader_translate_ns));
+  object_class_property_add(
+      klass, "shader-disk-hits", "uint64", vmsvga_get_counter, NULL, NULL,
+      (void *)offsetof(struct vmsvga_state_s, shader_disk_hits));
+  object_class_property_add(
+      klass, "shader-disk-writes", "uint64", vmsvga_get_counter, NULL, NULL,
+      (void *)offsetof(struct vmsvga_state_s, shader_disk_writes));
+  object_class_property_add(
+      klass, "shader-disk-evictions", "uint64", vmsvga_get_counter, NULL, NULL,
+      (void *)offsetof(struct vmsvga_state_s, shader_disk_evictions));
   dc->hotpluggable = false;
   set_bit(DEVICE_CATEGORY_DISPLAY, dc->categories);
 };
@@ -7214,6 +11364,7 @@ static TypeInfo vmsvga_info = {
     .name = "vmware-svga",
     .parent = TYPE_PCI_DEVICE,
     .instance_size = sizeof(struct pci_vmsvga_state_s),
+    .instance_align = __alignof__(struct pci_vmsvga_state_s),
     .class_init = vmsvga_class_init,
     .interfaces =
         (InterfaceInfo[]){
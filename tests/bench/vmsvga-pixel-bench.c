@@ -0,0 +1,225 @@
+/*
+
+ QEMU VMware Super Video Graphics Array 2 [SVGA-II] pixel kernel benchmark
+
+ Copyright (c) 2023-2026 Christopher Eric Lentocha
+ <christopherericlentocha@gmail.com>
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+
+*/
+// Runs the device pixel kernels on host buffers, no guest needed, and
+// prints one JSON object per measurement. The kernels are built for the
+// SIMD level the compiler targets, build with -mno-sse2 for the scalar
+// numbers. pixman doing the same job is measured next to each of them.
+// An optional argument caps the rect size, it defaults to 8192x8192 which
+// needs about 768 MB of buffers.
+//
+// Like the device, this file is dropped into a QEMU checkout. Build it
+// from tests/bench/meson.build there with
+//   executable('vmsvga-pixel-bench', files('vmsvga-pixel-bench.c'),
+//              dependencies: [qemuutil, pixman])
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include <pixman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "../../hw/display/vmware_vga_pixel.c.inc"
+#define BENCH_MIN_US 50000
+#ifdef __SSE2__
+#define BENCH_SIMD "sse2"
+#else
+#define BENCH_SIMD "scalar"
+#endif
+static const uint32_t bench_sizes[] = {1, 16, 64, 256, 1024, 4096, 8192};
+// the formats vmsvga_pixman_format hands pixman for each guest depth
+static const struct {
+  uint32_t depth;
+  uint32_t bypp;
+  pixman_format_code_t format;
+} bench_depths[] = {
+    {4, 1, PIXMAN_r1g2b1},     {8, 1, PIXMAN_r3g3b2},
+    {15, 2, PIXMAN_x1r5g5b5},  {16, 2, PIXMAN_r5g6b5},
+    {24, 3, PIXMAN_r8g8b8},    {32, 4, PIXMAN_x8r8g8b8},
+};
+struct bench_s {
+  uint8_t *src;
+  uint32_t *dst;
+  uint32_t src_stride;
+  uint32_t dst_stride;
+  uint32_t width;
+  uint32_t height;
+  uint32_t depth;
+  uint32_t bypp;
+  bool overlap;
+  uint32_t lut[256];
+  pixman_image_t *src_image;
+  pixman_image_t *dst_image;
+};
+static void bench_report(const char *kernel, const char *impl,
+                         struct bench_s *b, uint64_t pixels, gint64 us) {
+  printf("{\"kernel\": \"%s\", \"impl\": \"%s\", \"depth\": %u, "
+         "\"width\": %u, \"height\": %u, \"overlap\": %s, "
+         "\"mpix_s\": %.2f}\n",
+         kernel, impl, b->depth, b->width, b->height,
+         b->overlap ? "true" : "false", (double)pixels / MAX(us, 1));
+};
+// Repeats fn until BENCH_MIN_US passed, at least once
+static void bench_run(const char *kernel, const char *impl, struct bench_s *b,
+                      void (*fn)(struct bench_s *b)) {
+  uint64_t pixels = 0;
+  gint64 start = g_get_monotonic_time();
+  gint64 us;
+  do {
+    fn(b);
+    pixels += (uint64_t)b->width * b->height;
+    us = g_get_monotonic_time() - start;
+  } while (us < BENCH_MIN_US);
+  bench_report(kernel, impl, b, pixels, us);
+};
+static void bench_convert(struct bench_s *b) {
+  uint32_t y;
+  for (y = 0; y < b->height; y++) {
+    const uint8_t *src = b->src + ((uint64_t)y * b->src_stride);
+    uint32_t *dst = b->dst + ((uint64_t)y * (b->dst_stride / 4));
+    switch (b->depth) {
+    case 8:
+      vmsvga_convert_8(b->lut, dst, src, b->width);
+      break;
+    case 15:
+      vmsvga_convert_16(dst, src, b->width, 5);
+      break;
+    case 16:
+      vmsvga_convert_16(dst, src, b->width, 6);
+      break;
+    case 24:
+      vmsvga_convert_24(dst, src, b->width);
+      break;
+    case 32:
+      memcpy(dst, src, b->width * 4);
+      break;
+    };
+  };
+};
+static void bench_pixman_convert(struct bench_s *b) {
+  pixman_image_composite32(PIXMAN_OP_SRC, b->src_image, NULL, b->dst_image, 0,
+                           0, 0, 0, 0, 0, b->width, b->height);
+};
+// Copies inside the source buffer like RECT_COPY does in VRAM, shifted by
+// one pixel diagonally when overlapping, into the right half otherwise
+static void bench_copy(struct bench_s *b) {
+  uint64_t dst = b->overlap ? (b->src_stride + b->bypp)
+                            : ((uint64_t)b->width * b->bypp);
+  vmsvga_copy_rows(b->src, b->src_stride, 0, dst, b->width * b->bypp,
+                   b->height);
+};
+static void bench_pixman_copy(struct bench_s *b) {
+  pixman_blt((uint32_t *)b->src, (uint32_t *)b->src, b->src_stride / 4,
+             b->src_stride / 4, b->bypp * 8, b->bypp * 8, 0, 0, b->width, 0,
+             b->width, b->height);
+};
+static void bench_cursor(struct bench_s *b) {
+  uint32_t y;
+  for (y = 0; y < b->height; y++) {
+    vmsvga_cursor_convert_argb(
+        b->dst + ((uint64_t)y * (b->dst_stride / 4)),
+        (const uint32_t *)(b->src + ((uint64_t)y * b->src_stride)), b->width,
+        true);
+  };
+};
+static void bench_fill_source(struct bench_s *b, uint64_t size) {
+  uint64_t i;
+  uint32_t state = 0x9e3779b9;
+  for (i = 0; i < size; i++) {
+    state = (state * 1103515245) + 12345;
+    b->src[i] = state >> 24;
+  };
+};
+static void bench_size(uint32_t size) {
+  struct bench_s b;
+  uint64_t src_size;
+  uint32_t d;
+  uint32_t i;
+  memset(&b, 0, sizeof(b));
+  b.width = size;
+  b.height = size;
+  // room for the right half or the one pixel shift of a copy
+  b.src_stride = ROUND_UP((size * 2) * 4, 4);
+  b.dst_stride = size * 4;
+  src_size = (uint64_t)b.src_stride * (size + 1);
+  b.src = g_malloc(src_size);
+  b.dst = g_malloc((uint64_t)b.dst_stride * size);
+  for (i = 0; i < 256; i++) {
+    b.lut[i] = 0xff000000 | (i * 0x010101);
+  };
+  for (d = 0; d < ARRAY_SIZE(bench_depths); d++) {
+    b.depth = bench_depths[d].depth;
+    b.bypp = bench_depths[d].bypp;
+    bench_fill_source(&b, src_size);
+    b.src_image = pixman_image_create_bits(bench_depths[d].format, size, size,
+                                           (uint32_t *)b.src, b.src_stride);
+    b.dst_image = pixman_image_create_bits(PIXMAN_x8r8g8b8, size, size, b.dst,
+                                           b.dst_stride);
+    // 4bpp is always wrapped straight into pixman, the device has no
+    // converter of its own for it
+    if (b.depth != 4) {
+      bench_run("convert", "vmsvga-" BENCH_SIMD, &b, bench_convert);
+    };
+    // at 8bpp pixman decodes fixed r3g3b2, the scanout used without a
+    // shadow surface, while the device path looks up the palette
+    bench_run("convert", (b.depth == 8) ? "pixman-r3g3b2" : "pixman", &b,
+              bench_pixman_convert);
+    pixman_image_unref(b.src_image);
+    pixman_image_unref(b.dst_image);
+    if (b.depth < 8) {
+      continue;
+    };
+    for (i = 0; i < 2; i++) {
+      b.overlap = (i == 1);
+      bench_run("copy", "vmsvga-" BENCH_SIMD, &b, bench_copy);
+      // pixman_blt refuses overlapping and non-power-of-two depths
+      if (!b.overlap && (b.bypp == 1 || b.bypp == 2 || b.bypp == 4) &&
+          pixman_blt((uint32_t *)b.src, (uint32_t *)b.src, b.src_stride / 4,
+                     b.src_stride / 4, b.bypp * 8, b.bypp * 8, 0, 0, size, 0,
+                     size, size)) {
+        bench_run("copy", "pixman", &b, bench_pixman_copy);
+      };
+    };
+    b.overlap = false;
+  };
+  // cursors are premultiplied 32bpp whatever the mode depth
+  b.depth = 32;
+  b.bypp = 4;
+  bench_fill_source(&b, src_size);
+  bench_run("cursor-argb", "vmsvga-" BENCH_SIMD, &b, bench_cursor);
+  g_free(b.src);
+  g_free(b.dst);
+};
+int main(int argc, char **argv) {
+  uint32_t max = 8192;
+  uint32_t i;
+  if (argc > 1) {
+    max = strtoul(argv[1], NULL, 0);
+  };
+  for (i = 0; i < ARRAY_SIZE(bench_sizes) && bench_sizes[i] <= max; i++) {
+    bench_size(bench_sizes[i]);
+  };
+  return 0;
+};
@@ -0,0 +1,388 @@
+/*
+
+ QEMU VMware Super Video Graphics Array 2 [SVGA-II] qtests
+
+ Copyright (c) 2023-2026 Christopher Eric Lentocha
+ <christopherericlentocha@gmail.com>
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+
+*/
+// Drives the device the way a guest driver does, registers through the I/O
+// BAR and commands through the FIFO BAR, then checks what the FIFO worker
+// left behind. With -m perf the throughput cases report commands and FIFO
+// bytes per second, those include the qtest transport and are meant for
+// spotting regressions between builds rather than as absolute numbers
+//
+// In a QEMU tree it builds next to the other display qtests, in
+// tests/qtest/meson.build:
+//   qtests_i386 += config_all_devices.has_key('CONFIG_VMWARE_VGA') ?
+//     ['vmware-svga-test'] : []
+// and runs with "meson test qtest-x86_64/vmware-svga-test"
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "../../hw/display/include/svga3d_reg.h"
+// legacy 2D fill, only vmware_vga.c defines it
+#define SVGA_CMD_RECT_FILL 2
+#define SVGA_TEST_SLOT 4
+#define SVGA_TEST_WIDTH 64
+#define SVGA_TEST_HEIGHT 64
+#define SVGA_TEST_FIFO_MIN 4096
+#define SVGA_TEST_TIMEOUT_US (10 * G_USEC_PER_SEC)
+#define SVGA_TEST_PERF_US (2 * G_USEC_PER_SEC)
+#define SVGA_TEST_BATCH 4096
+struct svga_test_s {
+  QTestState *qts;
+  QPCIBus *bus;
+  QPCIDevice *dev;
+  QPCIBar io;
+  QPCIBar vram;
+  QPCIBar fifo;
+  uint32_t fifo_size;
+  uint32_t next;
+  uint32_t pitch;
+};
+static void svga_reg_write(struct svga_test_s *t, uint32_t index,
+                           uint32_t value) {
+  qpci_io_writel(t->dev, t->io, SVGA_INDEX_PORT, index);
+  qpci_io_writel(t->dev, t->io, SVGA_VALUE_PORT, value);
+};
+static uint32_t svga_reg_read(struct svga_test_s *t, uint32_t index) {
+  qpci_io_writel(t->dev, t->io, SVGA_INDEX_PORT, index);
+  return qpci_io_readl(t->dev, t->io, SVGA_VALUE_PORT);
+};
+static uint32_t svga_fifo_reg(struct svga_test_s *t, uint32_t reg) {
+  return qpci_io_readl(t->dev, t->fifo, reg * sizeof(uint32_t));
+};
+static void svga_fifo_set(struct svga_test_s *t, uint32_t reg,
+                          uint32_t value) {
+  qpci_io_writel(t->dev, t->fifo, reg * sizeof(uint32_t), value);
+};
+// SYNC asks the worker to drain the ring, BUSY reads back whether it has
+static void svga_sync(struct svga_test_s *t) {
+  gint64 deadline = g_get_monotonic_time() + SVGA_TEST_TIMEOUT_US;
+  svga_reg_write(t, SVGA_REG_SYNC, 1);
+  while (svga_reg_read(t, SVGA_REG_BUSY) != 0) {
+    g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+  };
+};
+// Copies words into the ring at NEXT_CMD, wrapping at MAX, without
+// publishing them and returns where NEXT_CMD goes once they are. The ring
+// is drained first when they would run into STOP
+static uint32_t svga_write(struct svga_test_s *t, const uint32_t *words,
+                           uint32_t count) {
+  uint32_t ring = t->fifo_size - SVGA_TEST_FIFO_MIN;
+  uint32_t bytes = count * sizeof(uint32_t);
+  uint32_t stop = svga_fifo_reg(t, SVGA_FIFO_STOP);
+  uint32_t used = (t->next + ring - stop) % ring;
+  g_autofree uint32_t *le = g_new(uint32_t, count);
+  uint32_t next;
+  uint32_t first;
+  uint32_t i;
+  g_assert_cmpuint(bytes, <, ring);
+  if (used + bytes >= ring) {
+    svga_sync(t);
+  };
+  for (i = 0; i < count; i++) {
+    le[i] = cpu_to_le32(words[i]);
+  };
+  first = MIN(bytes, t->fifo_size - t->next);
+  qpci_memwrite(t->dev, t->fifo, t->next, le, first);
+  if (first < bytes) {
+    qpci_memwrite(t->dev, t->fifo, SVGA_TEST_FIFO_MIN, (uint8_t *)le + first,
+                  bytes - first);
+  };
+  next = t->next + bytes;
+  if (next >= t->fifo_size) {
+    next -= ring;
+  };
+  return next;
+};
+static void svga_submit(struct svga_test_s *t, const uint32_t *words,
+                        uint32_t count) {
+  t->next = svga_write(t, words, count);
+  svga_fifo_set(t, SVGA_FIFO_NEXT_CMD, t->next);
+};
+static struct svga_test_s *svga_start(const char *extra) {
+  struct svga_test_s *t = g_new0(struct svga_test_s, 1);
+  t->qts = qtest_initf("-vga none -device vmware-svga,addr=%02x.0%s",
+                       SVGA_TEST_SLOT, extra);
+  t->bus = qpci_new_pc(t->qts, NULL);
+  t->dev = qpci_device_find(t->bus, QPCI_DEVFN(SVGA_TEST_SLOT, 0));
+  g_assert_nonnull(t->dev);
+  qpci_device_enable(t->dev);
+  t->io = qpci_iomap(t->dev, 0, NULL);
+  t->vram = qpci_iomap(t->dev, 1, NULL);
+  t->fifo = qpci_iomap(t->dev, 2, NULL);
+  svga_reg_write(t, SVGA_REG_ID, SVGA_ID_2);
+  g_assert_cmphex(svga_reg_read(t, SVGA_REG_ID), ==, SVGA_ID_2);
+  svga_reg_write(t, SVGA_REG_WIDTH, SVGA_TEST_WIDTH);
+  svga_reg_write(t, SVGA_REG_HEIGHT, SVGA_TEST_HEIGHT);
+  svga_reg_write(t, SVGA_REG_BITS_PER_PIXEL, 32);
+  t->pitch = svga_reg_read(t, SVGA_REG_BYTES_PER_LINE);
+  g_assert_cmpuint(t->pitch, >=, SVGA_TEST_WIDTH * 4);
+  t->fifo_size = svga_reg_read(t, SVGA_REG_MEM_SIZE);
+  g_assert_cmpuint(t->fifo_size, >, SVGA_TEST_FIFO_MIN * 2);
+  t->next = SVGA_TEST_FIFO_MIN;
+  svga_fifo_set(t, SVGA_FIFO_MIN, SVGA_TEST_FIFO_MIN);
+  svga_fifo_set(t, SVGA_FIFO_MAX, t->fifo_size);
+  svga_fifo_set(t, SVGA_FIFO_NEXT_CMD, t->next);
+  svga_fifo_set(t, SVGA_FIFO_STOP, t->next);
+  svga_reg_write(t, SVGA_REG_ENABLE, 1);
+  svga_reg_write(t, SVGA_REG_CONFIG_DONE, 1);
+  return t;
+};
+static void svga_stop(struct svga_test_s *t) {
+  g_free(t->dev);
+  qpci_free_pc(t->bus);
+  qtest_quit(t->qts);
+  g_free(t);
+};
+// RECT_FILL is not advertised and only consumed, so this checks progress
+// past it rather than what it draws
+static void test_fifo_progress(void) {
+  struct svga_test_s *t = svga_start("");
+  const uint32_t cmds[] = {
+      SVGA_CMD_RECT_FILL, 0x00ff00ff, 0, 0, 8, 8,
+      // unknown context, only the size header is honored
+      SVGA_3D_CMD_SETZRANGE, sizeof(SVGA3dCmdSetZRange), 77, 0, 0x3f800000,
+      SVGA_CMD_UPDATE, 0, 0, SVGA_TEST_WIDTH, SVGA_TEST_HEIGHT,
+  };
+  svga_submit(t, cmds, ARRAY_SIZE(cmds));
+  svga_sync(t);
+  g_assert_cmpuint(svga_fifo_reg(t, SVGA_FIFO_STOP), ==, t->next);
+  svga_stop(t);
+};
+static void test_fifo_fence(void) {
+  struct svga_test_s *t = svga_start("");
+  uint32_t cmds[] = {SVGA_CMD_FENCE, 0};
+  uint32_t i;
+  for (i = 1; i <= 64; i++) {
+    cmds[1] = i;
+    svga_submit(t, cmds, ARRAY_SIZE(cmds));
+  };
+  svga_sync(t);
+  g_assert_cmpuint(svga_fifo_reg(t, SVGA_FIFO_FENCE), ==, 64);
+  svga_stop(t);
+};
+// IRQ status is raised from a bottom half once the worker passed the fence
+static void test_irq_fence(void) {
+  struct svga_test_s *t = svga_start("");
+  const uint32_t cmds[] = {SVGA_CMD_FENCE, 7};
+  gint64 deadline;
+  svga_reg_write(t, SVGA_REG_IRQMASK, SVGA_IRQFLAG_ANY_FENCE);
+  qpci_io_writel(t->dev, t->io, SVGA_IRQSTATUS_PORT, 0xffffffff);
+  g_assert_cmphex(qpci_io_readl(t->dev, t->io, SVGA_IRQSTATUS_PORT), ==, 0);
+  svga_submit(t, cmds, ARRAY_SIZE(cmds));
+  svga_sync(t);
+  deadline = g_get_monotonic_time() + SVGA_TEST_TIMEOUT_US;
+  while (!(qpci_io_readl(t->dev, t->io, SVGA_IRQSTATUS_PORT) &
+           SVGA_IRQFLAG_ANY_FENCE)) {
+    g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+  };
+  qpci_io_writel(t->dev, t->io, SVGA_IRQSTATUS_PORT, SVGA_IRQFLAG_ANY_FENCE);
+  g_assert_cmphex(qpci_io_readl(t->dev, t->io, SVGA_IRQSTATUS_PORT) &
+                      SVGA_IRQFLAG_ANY_FENCE,
+                  ==, 0);
+  svga_stop(t);
+};
+static void test_rect_copy(void) {
+  struct svga_test_s *t = svga_start(",rect-copy=on");
+  const uint32_t cmds[] = {SVGA_CMD_RECT_COPY, 0, 0, 16, 16, 8, 8};
+  uint32_t row[8];
+  uint32_t x;
+  uint32_t y;
+  for (y = 0; y < 8; y++) {
+    for (x = 0; x < 8; x++) {
+      row[x] = cpu_to_le32((y << 8) | x | 0xff000000);
+    };
+    qpci_memwrite(t->dev, t->vram, y * t->pitch, row, sizeof(row));
+  };
+  svga_submit(t, cmds, ARRAY_SIZE(cmds));
+  svga_sync(t);
+  for (y = 0; y < 8; y++) {
+    qpci_memread(t->dev, t->vram, (16 + y) * t->pitch + 16 * 4, row,
+                 sizeof(row));
+    for (x = 0; x < 8; x++) {
+      g_assert_cmphex(le32_to_cpu(row[x]), ==, (y << 8) | x | 0xff000000);
+    };
+  };
+  svga_stop(t);
+};
+// Defines a screen backed by VRAM past the legacy framebuffer and blits
+// into it from a GMRFB that also lives in VRAM
+static void test_screen_blit(void) {
+  struct svga_test_s *t = svga_start(",screen-object=on");
+  const uint32_t offset = 0x10000;
+  const uint32_t pitch = 32 * 4;
+  const uint32_t cmds[] = {
+      SVGA_CMD_DEFINE_SCREEN, sizeof(SVGAScreenObject), 0,
+      SVGA_SCREEN_MUST_BE_SET | SVGA_SCREEN_IS_PRIMARY, 32, 32, 0, 0,
+      SVGA_GMR_FRAMEBUFFER, offset, pitch, 0,
+      SVGA_CMD_DEFINE_GMRFB, SVGA_GMR_FRAMEBUFFER, 0, t->pitch, 32 | (24 << 8),
+      SVGA_CMD_BLIT_GMRFB_TO_SCREEN, 2, 1, 16, 16, 24, 24, 0,
+  };
+  uint32_t row[16];
+  uint32_t x;
+  uint32_t y;
+  g_assert_cmpuint(svga_reg_read(t, SVGA_REG_CAPABILITIES) &
+                       SVGA_CAP_SCREEN_OBJECT_2,
+                   !=, 0);
+  for (y = 0; y < 16; y++) {
+    for (x = 0; x < 16; x++) {
+      row[x] = cpu_to_le32((y << 8) | x | 0xff000000);
+    };
+    qpci_memwrite(t->dev, t->vram, y * t->pitch, row, sizeof(row));
+  };
+  svga_submit(t, cmds, ARRAY_SIZE(cmds));
+  svga_sync(t);
+  g_assert_cmpuint(svga_fifo_reg(t, SVGA_FIFO_STOP), ==, t->next);
+  for (y = 0; y < 8; y++) {
+    qpci_memread(t->dev, t->vram, offset + (16 + y) * pitch + 16 * 4, row,
+                 sizeof(row));
+    for (x = 0; x < 8; x++) {
+      g_assert_cmphex(le32_to_cpu(row[x]), ==,
+                      ((y + 1) << 8) | (x + 2) | 0xff000000);
+    };
+    // nothing right of the rectangle is touched
+    g_assert_cmphex(le32_to_cpu(row[8]), ==, 0);
+  };
+  svga_stop(t);
+};
+// Ring offsets the FIFO BAR cannot hold make the device see an empty ring
+static void test_fifo_bounds(void) {
+  struct svga_test_s *t = svga_start("");
+  const uint32_t cmds[] = {SVGA_CMD_FENCE, 0x55};
+  svga_fifo_set(t, SVGA_FIFO_MAX, t->fifo_size * 2);
+  svga_submit(t, cmds, ARRAY_SIZE(cmds));
+  svga_sync(t);
+  g_assert_cmpuint(svga_fifo_reg(t, SVGA_FIFO_STOP), ==, SVGA_TEST_FIFO_MIN);
+  g_assert_cmphex(svga_fifo_reg(t, SVGA_FIFO_FENCE), !=, 0x55);
+  svga_fifo_set(t, SVGA_FIFO_MAX, t->fifo_size);
+  svga_sync(t);
+  g_assert_cmphex(svga_fifo_reg(t, SVGA_FIFO_FENCE), ==, 0x55);
+  svga_stop(t);
+};
+// With SVGA_FIFO_CAP_RESERVE the guest builds a command in place past
+// NEXT_CMD and announces its size in SVGA_FIFO_RESERVED. The device must
+// leave that register alone and not decode the bytes before the commit
+static void test_fifo_reserve(void) {
+  struct svga_test_s *t = svga_start("");
+  const uint32_t cmds[] = {SVGA_CMD_FENCE, 0x66};
+  uint32_t next;
+  if (!(svga_fifo_reg(t, SVGA_FIFO_CAPABILITIES) & SVGA_FIFO_CAP_RESERVE)) {
+    g_test_skip("SVGA_FIFO_CAP_RESERVE not offered");
+    svga_stop(t);
+    return;
+  };
+  next = svga_write(t, cmds, ARRAY_SIZE(cmds));
+  svga_fifo_set(t, SVGA_FIFO_RESERVED, sizeof(cmds));
+  svga_sync(t);
+  // long enough for the register loop and a few refreshes to run
+  g_usleep(250 * 1000);
+  g_assert_cmpuint(svga_fifo_reg(t, SVGA_FIFO_RESERVED), ==, sizeof(cmds));
+  g_assert_cmpuint(svga_fifo_reg(t, SVGA_FIFO_STOP), ==, t->next);
+  g_assert_cmphex(svga_fifo_reg(t, SVGA_FIFO_FENCE), !=, 0x66);
+  // commit: publish the bytes, then drop the reservation
+  t->next = next;
+  svga_fifo_set(t, SVGA_FIFO_NEXT_CMD, t->next);
+  svga_fifo_set(t, SVGA_FIFO_RESERVED, 0);
+  svga_sync(t);
+  g_assert_cmpuint(svga_fifo_reg(t, SVGA_FIFO_STOP), ==, t->next);
+  g_assert_cmphex(svga_fifo_reg(t, SVGA_FIFO_FENCE), ==, 0x66);
+  g_assert_cmpuint(svga_fifo_reg(t, SVGA_FIFO_RESERVED), ==, 0);
+  svga_stop(t);
+};
+// Repeats one command in batches for SVGA_TEST_PERF_US and reports the
+// rate at which the worker retired them
+static void svga_perf(const char *name, const char *extra,
+                      const uint32_t *cmd, uint32_t words) {
+  struct svga_test_s *t = svga_start(extra);
+  uint32_t per = MAX(SVGA_TEST_BATCH / words, 1);
+  uint32_t *batch = g_new(uint32_t, per * words);
+  uint64_t count = 0;
+  gint64 start;
+  gint64 elapsed;
+  uint32_t i;
+  for (i = 0; i < per; i++) {
+    memcpy(batch + i * words, cmd, words * sizeof(uint32_t));
+  };
+  start = g_get_monotonic_time();
+  do {
+    svga_submit(t, batch, per * words);
+    count += per;
+    elapsed = g_get_monotonic_time() - start;
+  } while (elapsed < SVGA_TEST_PERF_US);
+  svga_sync(t);
+  elapsed = g_get_monotonic_time() - start;
+  g_test_maximized_result((double)count * G_USEC_PER_SEC / elapsed,
+                          "%s: %.0f commands/s, %.2f MB/s of FIFO", name,
+                          (double)count * G_USEC_PER_SEC / elapsed,
+                          (double)count * words * sizeof(uint32_t) /
+                              elapsed);
+  g_free(batch);
+  svga_stop(t);
+};
+static void test_perf_fill(void) {
+  const uint32_t cmd[] = {SVGA_CMD_RECT_FILL, 0x00ff00ff, 0, 0,
+                          SVGA_TEST_WIDTH, SVGA_TEST_HEIGHT};
+  svga_perf("fill", "", cmd, ARRAY_SIZE(cmd));
+};
+static void test_perf_copy(void) {
+  const uint32_t cmd[] = {SVGA_CMD_RECT_COPY, 0, 0, 8, 8,
+                          SVGA_TEST_WIDTH - 8, SVGA_TEST_HEIGHT - 8};
+  svga_perf("copy", ",rect-copy=on", cmd, ARRAY_SIZE(cmd));
+};
+static void test_perf_cursor(void) {
+  uint32_t cmd[6 + 32 * 32];
+  uint32_t i;
+  cmd[0] = SVGA_CMD_DEFINE_ALPHA_CURSOR;
+  cmd[1] = 0;
+  cmd[2] = 4;
+  cmd[3] = 4;
+  cmd[4] = 32;
+  cmd[5] = 32;
+  for (i = 0; i < 32 * 32; i++) {
+    cmd[6 + i] = 0x80000000 | (i * 0x010203);
+  };
+  svga_perf("cursor", "", cmd, ARRAY_SIZE(cmd));
+};
+static void test_perf_3d_skip(void) {
+  const uint32_t cmd[] = {SVGA_3D_CMD_SETZRANGE, sizeof(SVGA3dCmdSetZRange),
+                          77, 0, 0x3f800000};
+  svga_perf("3d-skip", "", cmd, ARRAY_SIZE(cmd));
+};
+int main(int argc, char **argv) {
+  g_test_init(&argc, &argv, NULL);
+  qtest_add_func("/vmware-svga/fifo/progress", test_fifo_progress);
+  qtest_add_func("/vmware-svga/fifo/fence", test_fifo_fence);
+  qtest_add_func("/vmware-svga/fifo/bounds", test_fifo_bounds);
+  qtest_add_func("/vmware-svga/fifo/reserve", test_fifo_reserve);
+  qtest_add_func("/vmware-svga/screen/blit", test_screen_blit);
+  qtest_add_func("/vmware-svga/irq/fence", test_irq_fence);
+  qtest_add_func("/vmware-svga/rect-copy", test_rect_copy);
+  if (g_test_perf()) {
+    qtest_add_func("/vmware-svga/perf/fill", test_perf_fill);
+    qtest_add_func("/vmware-svga/perf/copy", test_perf_copy);
+    qtest_add_func("/vmware-svga/perf/cursor", test_perf_cursor);
+    qtest_add_func("/vmware-svga/perf/3d-skip", test_perf_3d_skip);
+  };
+  return g_test_run();
+};
@@ -0,0 +1,516 @@
+/*
+
+ QEMU VMware Super Video Graphics Array 2 [SVGA-II] shader translator tests
+
+ Copyright (c) 2023-2026 Christopher Eric Lentocha
+ <christopherericlentocha@gmail.com>
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+
+*/
+// Token streams come straight from the guest, so every malformed stream
+// must be rejected or translated without reading past the buffer. Run it
+// under -fsanitize=address to catch reads the asserts cannot see. The
+// GLSL of the valid samples goes through glslangValidator, no backend
+// compiles it inside QEMU yet. The build hands the validator over in
+// GLSLANG_VALIDATOR, a manual run falls back to PATH
+//
+// In a QEMU tree it builds with the other unit tests, in
+// tests/unit/meson.build:
+//   glslang = find_program('glslangValidator', required: false)
+//   tests += {'test-vmsvga-shader': []}
+//   test_env.set('GLSLANG_VALIDATOR', glslang.found() ?
+//                glslang.full_path() : '')
+// An empty GLSLANG_VALIDATOR skips the validator cases
+#include "qemu/osdep.h"
+#include "../../hw/display/include/svga3d_reg.h"
+#include "../../hw/display/include/svga3d_shaderdefs.h"
+#include "../../hw/display/include/VGPU10ShaderTokens.h"
+#define VPRINT(...)
+#include "../../hw/display/vmware_vga_shader.c.inc"
+#define SM_DST(type, num, mask)                                                \
+  (0x80000000u | (((type) & 7) << 28) | ((((type) >> 3) & 3) << 11) |          \
+   ((mask) << 16) | (num))
+#define SM_SRC(type, num, swz)                                                 \
+  (0x80000000u | (((type) & 7) << 28) | ((((type) >> 3) & 3) << 11) |          \
+   ((swz) << 16) | (num))
+#define SM_INS(op, size) ((op) | ((size) << 24))
+#define SM_END 0x0000ffff
+#define DX_SWZ(x, y, z, w) ((x) | ((y) << 2) | ((z) << 4) | ((w) << 6))
+static const uint32_t sm_vs[] = {
+    0xfffe0300,
+    SM_INS(SVGA3DOP_DCL, 2),
+    0x80000000 | SVGA3D_DECLUSAGE_POSITION,
+    SM_DST(SVGA3DREG_INPUT, 0, 15),
+    SM_INS(SVGA3DOP_DCL, 2),
+    0x80000000 | SVGA3D_DECLUSAGE_TEXCOORD,
+    SM_DST(SVGA3DREG_INPUT, 1, 15),
+    SM_INS(SVGA3DOP_DCL, 2),
+    0x80000000 | SVGA3D_DECLUSAGE_POSITION,
+    SM_DST(SVGA3DREG_OUTPUT, 0, 15),
+    SM_INS(SVGA3DOP_DCL, 2),
+    0x80000000 | SVGA3D_DECLUSAGE_TEXCOORD,
+    SM_DST(SVGA3DREG_OUTPUT, 1, 3),
+    SM_INS(SVGA3DOP_DEF, 5),
+    SM_DST(SVGA3DREG_CONST, 10, 15),
+    0x3f800000,
+    0,
+    0,
+    0x3f800000,
+    SM_INS(SVGA3DOP_M4x4, 3),
+    SM_DST(SVGA3DREG_OUTPUT, 0, 15),
+    SM_SRC(SVGA3DREG_INPUT, 0, 0xe4),
+    SM_SRC(SVGA3DREG_CONST, 0, 0xe4),
+    SM_INS(SVGA3DOP_MOVA, 2),
+    SM_DST(SVGA3DREG_ADDR, 0, 1),
+    SM_SRC(SVGA3DREG_CONST, 10, 0),
+    SM_INS(SVGA3DOP_ADD, 4),
+    SM_DST(SVGA3DREG_OUTPUT, 1, 3),
+    SM_SRC(SVGA3DREG_INPUT, 1, 0xe4),
+    SM_SRC(SVGA3DREG_CONST, 4, 0xe4) | (1 << 13),
+    SM_SRC(SVGA3DREG_ADDR, 0, 0),
+    SM_END,
+};
+static const uint32_t sm_ps[] = {
+    0xffff0200,
+    SM_INS(SVGA3DOP_DCL, 2),
+    0x80000000 | (SVGA3DSAMP_2D << 27),
+    SM_DST(SVGA3DREG_SAMPLER, 0, 15),
+    SM_INS(SVGA3DOP_DCL, 2),
+    0x80000000,
+    SM_DST(SVGA3DREG_TEXTURE, 0, 3),
+    SM_INS(SVGA3DOP_TEX, 3),
+    SM_DST(SVGA3DREG_TEMP, 0, 15),
+    SM_SRC(SVGA3DREG_TEXTURE, 0, 0xe4),
+    SM_SRC(SVGA3DREG_SAMPLER, 0, 0xe4),
+    SM_INS(SVGA3DOP_MUL, 3),
+    SM_DST(SVGA3DREG_TEMP, 0, 15) | (1 << 20),
+    SM_SRC(SVGA3DREG_TEMP, 0, 0xe4),
+    SM_SRC(SVGA3DREG_CONST, 0, 0xe4) | (SVGA3DSRCMOD_NEG << 24),
+    SM_INS(SVGA3DOP_MOV, 2),
+    SM_DST(SVGA3DREG_COLOROUT, 0, 15),
+    SM_SRC(SVGA3DREG_TEMP, 0, 0xe4),
+    SM_END,
+};
+static uint32_t dx_buf[256];
+static uint32_t dx_len;
+static void dx_word(uint32_t value) {
+  g_assert_true(dx_len < ARRAY_SIZE(dx_buf));
+  dx_buf[dx_len++] = value;
+};
+static void dx_op(uint32_t opcode, uint32_t len, uint32_t extra) {
+  dx_word(opcode | (len << 24) | extra);
+};
+static uint32_t dx_operand(uint32_t type, uint32_t comps, uint32_t mode,
+                           uint32_t sel, uint32_t dims) {
+  return comps | (mode << 2) | (sel << 4) | (type << 12) | (dims << 20);
+};
+static void dx_begin(uint32_t program) {
+  dx_len = 0;
+  dx_word((program << 16) | 0x40);
+  dx_word(0);
+};
+static void dx_end(void) {
+  dx_op(VGPU10_OPCODE_RET, 1, 0);
+  dx_buf[1] = dx_len;
+};
+// cb0 transform, vertex id compare and if/else flow control
+static void dx_emit_vs(void) {
+  dx_begin(VGPU10_VERTEX_SHADER);
+  dx_op(VGPU10_OPCODE_DCL_CONSTANT_BUFFER, 4, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_CONSTANT_BUFFER, 2, 1,
+                     DX_SWZ(0, 1, 2, 3), 2));
+  dx_word(0);
+  dx_word(4);
+  dx_op(VGPU10_OPCODE_DCL_INPUT, 3, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_INPUT, 2, 0, 0xf, 1));
+  dx_word(0);
+  dx_op(VGPU10_OPCODE_DCL_INPUT, 3, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_INPUT, 2, 0, 0x3, 1));
+  dx_word(1);
+  dx_op(VGPU10_OPCODE_DCL_INPUT_SGV, 4, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_INPUT, 2, 0, 0x1, 1));
+  dx_word(2);
+  dx_word(VGPU10_NAME_VERTEX_ID);
+  dx_op(VGPU10_OPCODE_DCL_OUTPUT_SIV, 4, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_OUTPUT, 2, 0, 0xf, 1));
+  dx_word(0);
+  dx_word(VGPU10_NAME_POSITION);
+  dx_op(VGPU10_OPCODE_DCL_OUTPUT, 3, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_OUTPUT, 2, 0, 0x3, 1));
+  dx_word(1);
+  dx_op(VGPU10_OPCODE_DCL_TEMPS, 2, 0);
+  dx_word(1);
+  // mul r0, v0.xxxx, cb0[0]
+  dx_op(VGPU10_OPCODE_MUL, 8, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_TEMP, 2, 0, 0xf, 1));
+  dx_word(0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_INPUT, 2, 1, DX_SWZ(0, 0, 0, 0), 1));
+  dx_word(0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_CONSTANT_BUFFER, 2, 1,
+                     DX_SWZ(0, 1, 2, 3), 2));
+  dx_word(0);
+  dx_word(0);
+  // mad o0, v0.yyyy, cb0[1], r0
+  dx_op(VGPU10_OPCODE_MAD, 10, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_OUTPUT, 2, 0, 0xf, 1));
+  dx_word(0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_INPUT, 2, 1, DX_SWZ(1, 1, 1, 1), 1));
+  dx_word(0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_CONSTANT_BUFFER, 2, 1,
+                     DX_SWZ(0, 1, 2, 3), 2));
+  dx_word(0);
+  dx_word(1);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_TEMP, 2, 1, DX_SWZ(0, 1, 2, 3), 1));
+  dx_word(0);
+  // ieq r0.x, v2.x, l(0)
+  dx_op(VGPU10_OPCODE_IEQ, 7, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_TEMP, 2, 0, 0x1, 1));
+  dx_word(0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_INPUT, 2, 2, 0, 1));
+  dx_word(2);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_IMMEDIATE32, 1, 0, 0, 0));
+  dx_word(0);
+  // if_nz r0.x
+  dx_op(VGPU10_OPCODE_IF, 3, 1 << 18);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_TEMP, 2, 2, 0, 1));
+  dx_word(0);
+  // mov o1.xy, v1.xyxx
+  dx_op(VGPU10_OPCODE_MOV, 5, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_OUTPUT, 2, 0, 0x3, 1));
+  dx_word(1);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_INPUT, 2, 1, DX_SWZ(0, 1, 0, 0), 1));
+  dx_word(1);
+  dx_op(VGPU10_OPCODE_ELSE, 1, 0);
+  // mov o1.xy, l(1.0, 0.5, 0, 0)
+  dx_op(VGPU10_OPCODE_MOV, 8, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_OUTPUT, 2, 0, 0x3, 1));
+  dx_word(1);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_IMMEDIATE32, 2, 0, 0, 0));
+  dx_word(0x3f800000);
+  dx_word(0x3f000000);
+  dx_word(0);
+  dx_word(0);
+  dx_op(VGPU10_OPCODE_ENDIF, 1, 0);
+  dx_end();
+};
+// offset sample, loop with breakc and a negated saturated move
+static void dx_emit_ps(void) {
+  dx_begin(VGPU10_PIXEL_SHADER);
+  dx_op(VGPU10_OPCODE_DCL_SAMPLER, 3, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_SAMPLER, 0, 0, 0, 1));
+  dx_word(0);
+  dx_op(VGPU10_OPCODE_DCL_RESOURCE, 4,
+        VGPU10_RESOURCE_DIMENSION_TEXTURE2D << 11);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_RESOURCE, 0, 0, 0, 1));
+  dx_word(0);
+  dx_word(0x5555);
+  dx_op(VGPU10_OPCODE_DCL_INPUT_PS, 3, VGPU10_INTERPOLATION_LINEAR << 11);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_INPUT, 2, 0, 0x3, 1));
+  dx_word(1);
+  dx_op(VGPU10_OPCODE_DCL_OUTPUT, 3, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_OUTPUT, 2, 0, 0xf, 1));
+  dx_word(0);
+  dx_op(VGPU10_OPCODE_DCL_TEMPS, 2, 0);
+  dx_word(1);
+  // sample_aoffimmi(1,-1,0) r0, v1.xyxx, t0.xyzw, s0
+  dx_word(VGPU10_OPCODE_SAMPLE | (10 << 24) | (1u << 31));
+  dx_word(VGPU10_EXTENDED_OPCODE_SAMPLE_CONTROLS | (1 << 9) | (0xf << 13));
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_TEMP, 2, 0, 0xf, 1));
+  dx_word(0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_INPUT, 2, 1, DX_SWZ(0, 1, 0, 0), 1));
+  dx_word(1);
+  dx_word(
+      dx_operand(VGPU10_OPERAND_TYPE_RESOURCE, 2, 1, DX_SWZ(0, 1, 2, 3), 1));
+  dx_word(0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_SAMPLER, 0, 0, 0, 1));
+  dx_word(0);
+  dx_op(VGPU10_OPCODE_LOOP, 1, 0);
+  dx_op(VGPU10_OPCODE_BREAKC, 3, 1 << 18);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_TEMP, 2, 2, 3, 1));
+  dx_word(0);
+  dx_op(VGPU10_OPCODE_ENDLOOP, 1, 0);
+  // mov_sat o0, -r0
+  dx_op(VGPU10_OPCODE_MOV, 6, 1 << 13);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_OUTPUT, 2, 0, 0xf, 1));
+  dx_word(0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_TEMP, 2, 1, DX_SWZ(0, 1, 2, 3), 1) |
+          (1u << 31));
+  dx_word(VGPU10_EXTENDED_OPERAND_MODIFIER |
+          (VGPU10_OPERAND_MODIFIER_NEG << 6));
+  dx_word(0);
+  dx_end();
+};
+// triangle in, strip out, passes position and one varying through
+static void dx_emit_gs(void) {
+  dx_begin(VGPU10_GEOMETRY_SHADER);
+  dx_op(VGPU10_OPCODE_DCL_GS_INPUT_PRIMITIVE, 1,
+        VGPU10_PRIMITIVE_TRIANGLE << 11);
+  dx_op(VGPU10_OPCODE_DCL_GS_OUTPUT_PRIMITIVE_TOPOLOGY, 1,
+        VGPU10_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP << 11);
+  dx_op(VGPU10_OPCODE_DCL_MAX_OUTPUT_VERTEX_COUNT, 2, 0);
+  dx_word(3);
+  dx_op(VGPU10_OPCODE_DCL_INPUT_SIV, 5, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_INPUT, 2, 0, 0xf, 2));
+  dx_word(3);
+  dx_word(0);
+  dx_word(VGPU10_NAME_POSITION);
+  dx_op(VGPU10_OPCODE_DCL_INPUT, 4, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_INPUT, 2, 0, 0x3, 2));
+  dx_word(3);
+  dx_word(1);
+  dx_op(VGPU10_OPCODE_DCL_OUTPUT_SIV, 4, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_OUTPUT, 2, 0, 0xf, 1));
+  dx_word(0);
+  dx_word(VGPU10_NAME_POSITION);
+  dx_op(VGPU10_OPCODE_DCL_OUTPUT, 3, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_OUTPUT, 2, 0, 0x3, 1));
+  dx_word(1);
+  dx_op(VGPU10_OPCODE_MOV, 6, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_OUTPUT, 2, 0, 0xf, 1));
+  dx_word(0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_INPUT, 2, 1, DX_SWZ(0, 1, 2, 3), 2));
+  dx_word(1);
+  dx_word(0);
+  dx_op(VGPU10_OPCODE_MOV, 6, 0);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_OUTPUT, 2, 0, 0x3, 1));
+  dx_word(1);
+  dx_word(dx_operand(VGPU10_OPERAND_TYPE_INPUT, 2, 1, DX_SWZ(0, 1, 0, 0), 2));
+  dx_word(1);
+  dx_word(1);
+  dx_op(VGPU10_OPCODE_EMIT, 1, 0);
+  dx_op(VGPU10_OPCODE_CUT, 1, 0);
+  dx_end();
+};
+// Copies the stream into a buffer of exactly count words so any read past
+// the end lands outside the allocation
+static char *sm_translate(uint32_t type, const uint32_t *tok, uint32_t count) {
+  uint32_t *copy = g_memdup2(tok, count * sizeof(uint32_t));
+  char *glsl = vmsvga_sm_translate(type, copy, count);
+  g_free(copy);
+  return glsl;
+};
+static char *dx_translate(uint32_t type, const uint32_t *tok, uint32_t count) {
+  uint32_t *copy = g_memdup2(tok, count * sizeof(uint32_t));
+  char *glsl = vmsvga_dx_translate(type, copy, count);
+  g_free(copy);
+  return glsl;
+};
+static uint32_t test_rand(uint32_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+};
+// stage is the glslangValidator file suffix: vert, frag or geom
+static void glsl_validate(const char *glsl, const char *stage) {
+  const char *env = g_getenv("GLSLANG_VALIDATOR");
+  g_autofree char *tool =
+      env != NULL ? g_strdup(env) : g_find_program_in_path("glslangValidator");
+  g_autofree char *dir = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *out = NULL;
+  g_autofree char *err = NULL;
+  char *argv[3];
+  int status;
+  if (tool == NULL || tool[0] == '\0') {
+    g_test_skip("glslangValidator not found");
+    return;
+  };
+  dir = g_dir_make_tmp("vmsvga-glsl-XXXXXX", NULL);
+  g_assert_nonnull(dir);
+  path = g_strdup_printf("%s/shader.%s", dir, stage);
+  g_assert_true(g_file_set_contents(path, glsl, -1, NULL));
+  argv[0] = tool;
+  argv[1] = path;
+  argv[2] = NULL;
+  g_assert_true(g_spawn_sync(NULL, argv, NULL, G_SPAWN_DEFAULT, NULL, NULL,
+                             &out, &err, &status, NULL));
+  if (!g_spawn_check_wait_status(status, NULL)) {
+    g_printerr("%s%s%s", glsl, out, err);
+  };
+  g_assert_true(g_spawn_check_wait_status(status, NULL));
+  unlink(path);
+  rmdir(dir);
+};
+static void test_sm_valid(void) {
+  char *glsl;
+  glsl = sm_translate(SVGA3D_SHADERTYPE_VS, sm_vs, ARRAY_SIZE(sm_vs));
+  g_assert_nonnull(glsl);
+  g_free(glsl);
+  glsl = sm_translate(SVGA3D_SHADERTYPE_PS, sm_ps, ARRAY_SIZE(sm_ps));
+  g_assert_nonnull(glsl);
+  g_free(glsl);
+};
+// Every opcode given fewer parameters than it reads must fail, an IF with
+// a zero size used to index the token array with an unset argument
+static void test_sm_short_operands(void) {
+  static const struct {
+    uint32_t op;
+    uint32_t nargs;
+  } ops[] = {
+      {SVGA3DOP_IF, 1},      {SVGA3DOP_REP, 1},    {SVGA3DOP_TEXKILL, 1},
+      {SVGA3DOP_IFC, 2},     {SVGA3DOP_BREAKC, 2}, {SVGA3DOP_LOOP, 2},
+      {SVGA3DOP_MOV, 2},     {SVGA3DOP_RCP, 2},    {SVGA3DOP_ADD, 3},
+      {SVGA3DOP_M4x4, 3},    {SVGA3DOP_M3x2, 3},   {SVGA3DOP_TEX, 3},
+      {SVGA3DOP_MAD, 4},     {SVGA3DOP_CMP, 4},    {SVGA3DOP_DP2ADD, 4},
+      {SVGA3DOP_TEXLDD, 5},
+  };
+  uint32_t tok[8];
+  uint32_t i;
+  uint32_t n;
+  uint32_t k;
+  for (i = 0; i < ARRAY_SIZE(ops); i++) {
+    for (n = 0; n < ops[i].nargs; n++) {
+      tok[0] = 0xffff0300;
+      tok[1] = SM_INS(ops[i].op, n);
+      for (k = 0; k < n; k++) {
+        tok[2 + k] = SM_SRC(SVGA3DREG_TEMP, 0, 0xe4);
+      };
+      tok[2 + n] = SM_END;
+      g_assert_null(sm_translate(SVGA3D_SHADERTYPE_PS, tok, n + 3));
+    };
+  };
+};
+static void test_sm_truncated(void) {
+  uint32_t tok[] = {0xffff0300, SM_INS(SVGA3DOP_MAD, 4),
+                    SM_DST(SVGA3DREG_TEMP, 0, 15),
+                    SM_SRC(SVGA3DREG_TEMP, 0, 0xe4), SM_END};
+  uint32_t rel[] = {0xffff0300, SM_INS(SVGA3DOP_MOV, 2),
+                    SM_DST(SVGA3DREG_TEMP, 0, 15),
+                    SM_SRC(SVGA3DREG_CONST, 0, 0xe4) | (1 << 13)};
+  uint32_t n;
+  // the size field runs past the end of the stream
+  g_assert_null(sm_translate(SVGA3D_SHADERTYPE_PS, tok, ARRAY_SIZE(tok) - 1));
+  // a relative source without its address token
+  g_assert_null(sm_translate(SVGA3D_SHADERTYPE_PS, rel, ARRAY_SIZE(rel)));
+  for (n = 1; n < ARRAY_SIZE(sm_vs); n++) {
+    g_free(sm_translate(SVGA3D_SHADERTYPE_VS, sm_vs, n));
+  };
+  for (n = 1; n < ARRAY_SIZE(sm_ps); n++) {
+    g_free(sm_translate(SVGA3D_SHADERTYPE_PS, sm_ps, n));
+  };
+};
+static void test_sm_garbage(void) {
+  uint32_t state = 0x2545f491;
+  uint32_t tok[32];
+  uint32_t iter;
+  uint32_t i;
+  for (iter = 0; iter < 20000; iter++) {
+    memcpy(tok, (iter & 1) ? sm_vs : sm_ps,
+           MIN(sizeof(tok), (iter & 1) ? sizeof(sm_vs) : sizeof(sm_ps)));
+    for (i = 0; i < 4; i++) {
+      tok[1 + (test_rand(&state) % (ARRAY_SIZE(tok) - 1))] ^=
+          1u << (test_rand(&state) % 32);
+    };
+    g_free(sm_translate((iter & 1) ? SVGA3D_SHADERTYPE_VS
+                                   : SVGA3D_SHADERTYPE_PS,
+                        tok, 1 + (test_rand(&state) % ARRAY_SIZE(tok))));
+  };
+};
+static void test_sm_glsl(void) {
+  char *glsl;
+  glsl = sm_translate(SVGA3D_SHADERTYPE_VS, sm_vs, ARRAY_SIZE(sm_vs));
+  g_assert_nonnull(glsl);
+  glsl_validate(glsl, "vert");
+  g_free(glsl);
+  glsl = sm_translate(SVGA3D_SHADERTYPE_PS, sm_ps, ARRAY_SIZE(sm_ps));
+  g_assert_nonnull(glsl);
+  glsl_validate(glsl, "frag");
+  g_free(glsl);
+};
+static void test_dx_valid(void) {
+  char *glsl;
+  dx_emit_vs();
+  glsl = dx_translate(SVGA3D_SHADERTYPE_VS, dx_buf, dx_len);
+  g_assert_nonnull(glsl);
+  g_free(glsl);
+  dx_emit_ps();
+  glsl = dx_translate(SVGA3D_SHADERTYPE_PS, dx_buf, dx_len);
+  g_assert_nonnull(glsl);
+  g_free(glsl);
+  dx_emit_gs();
+  glsl = dx_translate(SVGA3D_SHADERTYPE_GS, dx_buf, dx_len);
+  g_assert_nonnull(glsl);
+  g_free(glsl);
+};
+static void test_dx_glsl(void) {
+  static void (*const emit[])(void) = {dx_emit_vs, dx_emit_ps, dx_emit_gs};
+  static const uint32_t type[] = {SVGA3D_SHADERTYPE_VS, SVGA3D_SHADERTYPE_PS,
+                                  SVGA3D_SHADERTYPE_GS};
+  static const char *const stage[] = {"vert", "frag", "geom"};
+  char *glsl;
+  uint32_t i;
+  for (i = 0; i < ARRAY_SIZE(emit); i++) {
+    emit[i]();
+    glsl = dx_translate(type[i], dx_buf, dx_len);
+    g_assert_nonnull(glsl);
+    glsl_validate(glsl, stage[i]);
+    g_free(glsl);
+  };
+};
+// Cut the stream short both by the buffer size and by the length token
+static void test_dx_truncated(void) {
+  static void (*const emit[])(void) = {dx_emit_vs, dx_emit_ps, dx_emit_gs};
+  static const uint32_t type[] = {SVGA3D_SHADERTYPE_VS, SVGA3D_SHADERTYPE_PS,
+                                  SVGA3D_SHADERTYPE_GS};
+  uint32_t i;
+  uint32_t n;
+  uint32_t len;
+  for (i = 0; i < ARRAY_SIZE(emit); i++) {
+    emit[i]();
+    len = dx_len;
+    for (n = 0; n < len; n++) {
+      g_free(dx_translate(type[i], dx_buf, n));
+    };
+    for (n = 0; n < len; n++) {
+      dx_buf[1] = n;
+      g_free(dx_translate(type[i], dx_buf, len));
+    };
+  };
+};
+static void test_dx_garbage(void) {
+  static void (*const emit[])(void) = {dx_emit_vs, dx_emit_ps, dx_emit_gs};
+  static const uint32_t type[] = {SVGA3D_SHADERTYPE_VS, SVGA3D_SHADERTYPE_PS,
+                                  SVGA3D_SHADERTYPE_GS};
+  uint32_t state = 0x9e3779b9;
+  uint32_t iter;
+  uint32_t i;
+  for (iter = 0; iter < 20000; iter++) {
+    emit[iter % 3]();
+    for (i = 0; i < 4; i++) {
+      dx_buf[2 + (test_rand(&state) % (dx_len - 2))] ^=
+          1u << (test_rand(&state) % 32);
+    };
+    g_free(dx_translate(type[iter % 3], dx_buf, dx_len));
+  };
+};
+int main(int argc, char **argv) {
+  g_test_init(&argc, &argv, NULL);
+  g_test_add_func("/vmsvga/shader/sm/valid", test_sm_valid);
+  g_test_add_func("/vmsvga/shader/sm/short-operands", test_sm_short_operands);
+  g_test_add_func("/vmsvga/shader/sm/truncated", test_sm_truncated);
+  g_test_add_func("/vmsvga/shader/sm/garbage", test_sm_garbage);
+  g_test_add_func("/vmsvga/shader/sm/glsl", test_sm_glsl);
+  g_test_add_func("/vmsvga/shader/dx/valid", test_dx_valid);
+  g_test_add_func("/vmsvga/shader/dx/truncated", test_dx_truncated);
+  g_test_add_func("/vmsvga/shader/dx/garbage", test_dx_garbage);
+  g_test_add_func("/vmsvga/shader/dx/glsl", test_dx_glsl);
+  return g_test_run();
+};